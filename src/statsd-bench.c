@@ -0,0 +1,865 @@
+/*************************************************************************************
+Copyright (C) 2012, 2013 James Slocum
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+OR OTHER DEALINGS IN THE SOFTWARE.
+**************************************************************************************/
+
+
+//The benchmark is built straight from the library source so the private
+//functions on the hot path can be timed on their own.
+#include "statsd.c"
+
+#include <getopt.h>
+#include <sched.h>
+
+#define DEFAULT_ITERATIONS 10000000L
+
+//Benchmarks that make a system call per operation run this many times
+//fewer iterations
+#define SYSCALL_DIVISOR 20
+
+#define MAX_THREADS 64
+
+typedef enum {
+   FORMAT_TEXT = 0,
+   FORMAT_CSV,
+   FORMAT_JSON
+} Format;
+
+static long iterations = DEFAULT_ITERATIONS;
+static int threads = 0;
+static Format format = FORMAT_TEXT;
+static const char* filter = NULL;
+
+//Keeps the compiler from optimizing away the work being timed
+static volatile int sink;
+
+//The port of the local UDP sink the sending benchmarks talk to
+static int sinkPort;
+
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+   Print one result. Operations are the calls being timed, and packets are
+   the datagrams the client sent while they ran.
+*/
+static void report(const char* name, double elapsed, long ops, uint64_t packets){
+   double seconds = elapsed / 1e9;
+
+   switch (format){
+      case FORMAT_CSV:
+         printf("%s,%ld,%.2f,%.0f,%.0f\n", name, ops, elapsed / ops, ops / seconds, packets / seconds);
+         break;
+      case FORMAT_JSON:
+         printf("{\"name\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f,\"packets_per_s\":%.0f}\n",
+            name, ops, elapsed / ops, ops / seconds, packets / seconds);
+         break;
+      default:
+         printf("%-32s %10.2f ns/op %14.0f ops/s %12.0f packets/s\n", name, elapsed / ops, ops / seconds, packets / seconds);
+         break;
+   }
+
+   fflush(stdout);
+}
+
+/**
+   Only run the benchmarks whose name starts with the filter.
+*/
+static int selected(const char* name){
+   return !filter || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+static uint64_t packetsSent(Statsd* stats){
+   StatsdInternalStats counters;
+   statsd_getInternalStats(stats, &counters);
+   return counters.packets;
+}
+
+/**
+   Read and throw away everything sent to the sink, so its socket buffer
+   never fills up and the senders see a server that keeps up.
+*/
+static void* drainSink(void* data){
+   int socketFd = *(int*)data;
+   char buffer[STATSD_LOOPBACK_PACKET_SIZE];
+
+   for (;;){
+      if (recv(socketFd, buffer, sizeof(buffer), 0) < 0 && errno != EINTR){
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+static void startSink(void){
+   static int socketFd;
+   struct sockaddr_in address;
+   socklen_t length = sizeof(address);
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   int receiveBuffer = 8 << 20;
+   socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+   setsockopt(socketFd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+   if (socketFd == -1 || bind(socketFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+         getsockname(socketFd, (struct sockaddr*)&address, &length) != 0){
+      perror("Unable to start the UDP sink");
+      exit(1);
+   }
+
+   sinkPort = ntohs(address.sin_port);
+
+   pthread_t thread;
+   if (pthread_create(&thread, NULL, drainSink, &socketFd) != 0){
+      fprintf(stderr, "Unable to start the UDP sink\n");
+      exit(1);
+   }
+   pthread_detach(thread);
+}
+
+static void newClient(Statsd* stats){
+   stats->socketFd = -1;
+   if (statsd_init(stats, "127.0.0.1", sinkPort, "some.namespace", "requests") != STATSD_SUCCESS){
+      fprintf(stderr, "Unable to initialize the statsd client\n");
+      exit(1);
+   }
+}
+
+static void benchBuildStatString(void){
+   char stat[STAT_MAX_SIZE];
+   double start;
+
+   if (selected("buildStatString")){
+      start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += buildStatString(stat, sizeof(stat), "some.namespace", "requests.count", STATSD_COUNT, i, NO_SAMPLE_RATE, NULL, NULL);
+      }
+      report("buildStatString", now() - start, iterations, 0);
+   }
+
+   if (selected("buildStatString/rate")){
+      start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += buildStatString(stat, sizeof(stat), "some.namespace", "requests.count", STATSD_COUNT, i, 0.1, NULL, NULL);
+      }
+      report("buildStatString/rate", now() - start, iterations, 0);
+   }
+
+   //Fractional values, against the printf formatting they replace
+   if (selected("formatDouble")){
+      start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += formatDouble(stat, i * 0.001);
+      }
+      report("formatDouble", now() - start, iterations, 0);
+   }
+
+   if (selected("snprintf/%.17g")){
+      start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += snprintf(stat, sizeof(stat), "%.17g", i * 0.001);
+      }
+      report("snprintf/%.17g", now() - start, iterations, 0);
+   }
+}
+
+static void benchAddToBatch(void){
+   Statsd stats;
+   newClient(&stats);
+
+   //Reset the batch before it fills up so nothing is ever sent
+   statsd_setPacketSize(&stats, STATSD_LOOPBACK_PACKET_SIZE);
+   if (selected("statsd_addToBatch")){
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         if (stats.batchIndex > STATSD_LOOPBACK_PACKET_SIZE - 1024){
+            statsd_resetBatch(&stats);
+         }
+         sink += statsd_addToBatch(&stats, STATSD_COUNT, "requests.count", (int)i, NO_SAMPLE_RATE);
+      }
+      report("statsd_addToBatch", now() - start, iterations, 0);
+   }
+
+   if (selected("statsd_addMetricToBatch")){
+      StatsdMetric* metric = NULL;
+      statsd_registerMetric(&stats, &metric, "requests.count", STATSD_COUNT, NO_SAMPLE_RATE);
+      statsd_resetBatch(&stats);
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         if (stats.batchIndex > STATSD_LOOPBACK_PACKET_SIZE - 1024){
+            statsd_resetBatch(&stats);
+         }
+         sink += statsd_addMetricToBatch(metric, (int)i);
+      }
+      report("statsd_addMetricToBatch", now() - start, iterations, 0);
+      statsd_freeMetric(metric);
+   }
+
+   //Default tags on the client plus a set of the stat's own
+   const char* hostTags[] = { "host:web-1234", "region:us-east-1" };
+   const char* callTags[] = { "endpoint:/api/v1/users", "status:200" };
+   StatsdTags* tags = NULL;
+   statsd_setTags(&stats, hostTags, 2);
+   statsd_newTags(&tags, callTags, 2);
+   statsd_resetBatch(&stats);
+   if (selected("statsd_addToBatchTagged")){
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         if (stats.batchIndex > STATSD_LOOPBACK_PACKET_SIZE - 1024){
+            statsd_resetBatch(&stats);
+         }
+         sink += statsd_addToBatchTagged(&stats, STATSD_COUNT, "requests.count", i, NO_SAMPLE_RATE, tags);
+      }
+      report("statsd_addToBatchTagged", now() - start, iterations, 0);
+   }
+
+   if (selected("statsd_addMetricToBatch/tagged")){
+      StatsdMetric* metric = NULL;
+      statsd_registerTaggedMetric(&stats, &metric, "requests.count", STATSD_COUNT, NO_SAMPLE_RATE, tags);
+      statsd_resetBatch(&stats);
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         if (stats.batchIndex > STATSD_LOOPBACK_PACKET_SIZE - 1024){
+            statsd_resetBatch(&stats);
+         }
+         sink += statsd_addMetricToBatch(metric, (int)i);
+      }
+      report("statsd_addMetricToBatch/tagged", now() - start, iterations, 0);
+      statsd_freeMetric(metric);
+   }
+   statsd_freeTags(tags);
+
+   statsd_release(&stats);
+}
+
+/**
+   One datagram per stat, through the whole send path to the local sink.
+*/
+static void benchSend(void){
+   if (!selected("statsd_count/send")){
+      return;
+   }
+
+   Statsd stats;
+   newClient(&stats);
+
+   long count = iterations / SYSCALL_DIVISOR;
+   double start = now();
+   for (long i = 0; i < count; i++){
+      sink += statsd_count(&stats, "requests.count", (int)i, NO_SAMPLE_RATE);
+   }
+   report("statsd_count/send", now() - start, count, packetsSent(&stats));
+
+   statsd_release(&stats);
+}
+
+/**
+   statsd_addToBatch() and statsd_sendBatch() to the local sink, sending
+   the batch after a fixed number of stats, or only once the packet is
+   full. The time is per stat added.
+*/
+static void benchSendBatch(void){
+   static const struct {
+      const char* name;
+      int packetSize;
+      int fill;
+   } levels[] = {
+      { "statsd_sendBatch/1", STATSD_ETHERNET_PACKET_SIZE, 1 },
+      { "statsd_sendBatch/8", STATSD_ETHERNET_PACKET_SIZE, 8 },
+      { "statsd_sendBatch/ethernet", STATSD_ETHERNET_PACKET_SIZE, 0 },
+      { "statsd_sendBatch/jumbo", STATSD_JUMBO_PACKET_SIZE, 0 },
+      { "statsd_sendBatch/loopback", STATSD_LOOPBACK_PACKET_SIZE, 0 }
+   };
+
+   for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++){
+      if (!selected(levels[l].name)){
+         continue;
+      }
+
+      Statsd stats;
+      newClient(&stats);
+      statsd_setPacketSize(&stats, levels[l].packetSize);
+
+      //Few stats per batch means a system call for nearly every stat
+      long count = levels[l].fill > 0 && levels[l].fill < 32 ? iterations / SYSCALL_DIVISOR : iterations;
+      double start = now();
+      for (long i = 0; i < count; i++){
+         sink += statsd_addToBatch(&stats, STATSD_COUNT, "requests.count", (int)i, NO_SAMPLE_RATE);
+         if (levels[l].fill > 0 && (i + 1) % levels[l].fill == 0){
+            sink += statsd_sendBatch(&stats);
+         }
+      }
+      statsd_sendBatch(&stats);
+      report(levels[l].name, now() - start, count, packetsSent(&stats));
+
+      statsd_release(&stats);
+   }
+}
+
+/**
+   statsd_sendLines() with a block that splits into many small datagrams,
+   sent with sendmmsg() or through io_uring. The time is per datagram.
+*/
+static void benchSendLines(void){
+   static const struct {
+      const char* name;
+      int uring;
+   } backends[] = {
+      { "statsd_sendLines/sendmmsg", 0 },
+      { "statsd_sendLines/uring", 1 }
+   };
+
+   //Three lines to a datagram at the smallest packet size
+   static const char line[] = "requests.count:1|c\n";
+   int lines = 3072;
+   int length = lines * (int)(sizeof(line) - 1);
+   char* block = (char*)malloc(length);
+   for (int i = 0; i < lines; i++){
+      memcpy(block + i * (sizeof(line) - 1), line, sizeof(line) - 1);
+   }
+
+   for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++){
+      if (!selected(backends[b].name)){
+         continue;
+      }
+
+      Statsd stats;
+      newClient(&stats);
+      statsd_setPacketSize(&stats, STATSD_MIN_PACKET_SIZE);
+      if (backends[b].uring && statsd_enableUring(&stats, 256) != STATSD_SUCCESS){
+         fprintf(stderr, "%s: io_uring is not available\n", backends[b].name);
+         statsd_release(&stats);
+         continue;
+      }
+
+      long rounds = iterations / SYSCALL_DIVISOR / (lines / 3);
+      if (rounds < 1){
+         rounds = 1;
+      }
+
+      double start = now();
+      for (long i = 0; i < rounds; i++){
+         sink += statsd_sendLines(&stats, block, length, NULL);
+      }
+      //Wait for the sends still in flight before stopping the clock
+      statsd_disableUring(&stats);
+      uint64_t packets = packetsSent(&stats);
+      report(backends[b].name, now() - start, (long)packets, packets);
+
+      statsd_release(&stats);
+   }
+
+   free(block);
+}
+
+/**
+   A flush every 10ms of a few busy counters, next to a large number of
+   gauges that change rarely. statsd_flush() has to look at every bucket,
+   the scheduler's timer wheel only at the ones that are due. The wheel is
+   run straight from runDue() with a clock that moves one tick per flush.
+*/
+static void benchFlushTick(void){
+   static const struct {
+      const char* name;
+      int wheel;
+   } modes[] = {
+      { "flush/scan", 0 },
+      { "flush/wheel", 1 }
+   };
+
+   int idle = 16384;
+   int busy = 16;
+   char name[32];
+
+   for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++){
+      if (!selected(modes[m].name)){
+         continue;
+      }
+
+      Statsd stats;
+      newClient(&stats);
+      statsd_setPacketSize(&stats, STATSD_ETHERNET_PACKET_SIZE);
+      statsd_enableAggregation(&stats, idle * 2);
+      if (modes[m].wheel){
+         statsd_enableScheduler(&stats, 0, 0, 0);
+         statsd_setFlushInterval(&stats, STATSD_GAUGE, 3600 * 1000);
+         statsd_setFlushInterval(&stats, STATSD_COUNT, WHEEL_TICK);
+      }
+
+      for (int i = 0; i < idle; i++){
+         snprintf(name, sizeof(name), "gauge.%d", i);
+         statsd_gauge(&stats, name, i, NO_SAMPLE_RATE);
+      }
+
+      if (!modes[m].wheel){
+         statsd_flush(&stats);
+      }
+
+      long ticks = iterations / SYSCALL_DIVISOR / busy;
+      if (ticks < 1){
+         ticks = 1;
+      }
+
+      uint64_t packets = packetsSent(&stats);
+      uint64_t clock = monotonicMillis();
+      double start = now();
+      for (long t = 0; t < ticks; t++){
+         for (int i = 0; i < busy; i++){
+            snprintf(name, sizeof(name), "count.%d", i);
+            sink += statsd_count(&stats, name, 1, NO_SAMPLE_RATE);
+         }
+
+         if (modes[m].wheel){
+            clock += WHEEL_TICK;
+            sink += runDue(&stats, clock);
+         }
+         else {
+            sink += statsd_flush(&stats);
+         }
+      }
+      report(modes[m].name, now() - start, ticks, packetsSent(&stats) - packets);
+
+      statsd_release(&stats);
+   }
+}
+
+static void benchSampling(void){
+   Statsd stats;
+   newClient(&stats);
+
+   //A tiny rate so nearly every call is rejected before anything is built
+   statsd_enableAggregation(&stats, 0);
+   if (selected("statsd_count/sampled")){
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += statsd_count(&stats, "requests.count", 1, 0.0001);
+      }
+      report("statsd_count/sampled", now() - start, iterations, 0);
+   }
+
+   StatsdMetric* metric = NULL;
+   statsd_registerMetric(&stats, &metric, "requests.count", STATSD_COUNT, 0.0001);
+   if (selected("statsd_sendMetric/sampled")){
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += statsd_sendMetric(metric, 1);
+      }
+      report("statsd_sendMetric/sampled", now() - start, iterations, 0);
+   }
+
+   if (selected("statsd_sendMetric/keyed")){
+      statsd_setSampling(&stats, STATSD_SAMPLE_KEYED);
+      statsd_setSampleKey("request-1234");
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         sink += statsd_sendMetric(metric, 1);
+      }
+      report("statsd_sendMetric/keyed", now() - start, iterations, 0);
+      statsd_setSampleKey(NULL);
+   }
+   statsd_freeMetric(metric);
+
+   statsd_release(&stats);
+}
+
+/**
+   Time finding the histogram bucket of timings spread over every power of
+   2. Every bucket is checked first to be inside the histogram and in
+   order, the top range included, and the run fails if one is not.
+*/
+static void benchHistogram(void){
+   if (!selected("histogram/index")){
+      return;
+   }
+
+   //The bottom, middle and top of every power of 2, in increasing order
+   uint64_t values[64 * 3];
+   int count = 0;
+   for (int bit = 0; bit < 64; bit++){
+      uint64_t low = 1ULL << bit;
+      values[count++] = low;
+      values[count++] = low + (low >> 1);
+      values[count++] = low + (low - 1);
+   }
+
+   int last = 0;
+   for (int v = 0; v < count; v++){
+      int index = histogramIndex(values[v]);
+      if (index < last || index >= HISTOGRAM_BUCKETS){
+         fprintf(stderr, "histogramIndex(%llu) is %d, outside of %d to %d\n", (unsigned long long)values[v], index, last, HISTOGRAM_BUCKETS - 1);
+         exit(EXIT_FAILURE);
+      }
+      last = index;
+   }
+
+   double start = now();
+   for (long i = 0; i < iterations; i++){
+      sink += histogramIndex(values[i % count]);
+   }
+   report("histogram/index", now() - start, iterations, 0);
+}
+
+static void benchTimer(void){
+   static const struct {
+      const char* name;
+      StatsdClock clock;
+   } clocks[] = {
+      { "statsd_timer/monotonic", STATSD_CLOCK_MONOTONIC },
+      { "statsd_timer/tsc", STATSD_CLOCK_TSC }
+   };
+
+   Statsd stats;
+   newClient(&stats);
+
+   //Aggregated, so the numbers are the cost of the clock and the histogram
+   statsd_enableTimingAggregation(&stats, NULL, 0, 0);
+   for (size_t c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++){
+      if (!selected(clocks[c].name) || statsd_setClock(&stats, clocks[c].clock) != STATSD_SUCCESS){
+         continue;
+      }
+
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         StatsdTimer timer;
+         statsd_timerStart(&stats, &timer, "requests.time", NO_SAMPLE_RATE);
+         sink += statsd_timerStop(&timer);
+      }
+      report(clocks[c].name, now() - start, iterations, 0);
+   }
+
+   if (selected("statsd_timer/sampled")){
+      double start = now();
+      for (long i = 0; i < iterations; i++){
+         StatsdTimer timer;
+         statsd_timerStart(&stats, &timer, "requests.time", 0.0001);
+         sink += statsd_timerStop(&timer);
+      }
+      report("statsd_timer/sampled", now() - start, iterations, 0);
+   }
+
+   statsd_release(&stats);
+}
+
+typedef struct {
+   Statsd* stats;
+   long count;
+   double sampleRate;
+} Worker;
+
+static void* runWorker(void* data){
+   Worker* worker = (Worker*)data;
+   for (long i = 0; i < worker->count; i++){
+      sink += statsd_count(worker->stats, "requests.count", (int)i, worker->sampleRate);
+   }
+   statsd_sendBatch(worker->stats);
+   return NULL;
+}
+
+/**
+   Several threads sharing one client in concurrent mode. The time runs
+   until the flusher thread has sent everything, and is per stat across
+   all of the threads.
+*/
+static void benchContention(const char* name, double sampleRate){
+   if (!selected(name)){
+      return;
+   }
+
+   Statsd stats;
+   newClient(&stats);
+   statsd_setPacketSize(&stats, STATSD_LOOPBACK_PACKET_SIZE);
+   statsd_enableConcurrency(&stats, 10);
+
+   pthread_t thread[MAX_THREADS];
+   Worker worker[MAX_THREADS];
+   long perThread = iterations / threads;
+
+   double start = now();
+   for (int t = 0; t < threads; t++){
+      worker[t].stats = &stats;
+      worker[t].count = perThread;
+      worker[t].sampleRate = sampleRate;
+      pthread_create(&thread[t], NULL, runWorker, &worker[t]);
+   }
+
+   for (int t = 0; t < threads; t++){
+      pthread_join(thread[t], NULL);
+   }
+   statsd_disableConcurrency(&stats);
+   double elapsed = now() - start;
+
+   char label[64];
+   snprintf(label, sizeof(label), "%s/%d", name, threads);
+   report(label, elapsed, perThread * threads, packetsSent(&stats));
+
+   statsd_release(&stats);
+}
+
+typedef struct {
+   StatsdDrain* drain;
+   Statsd* forward;
+   int running;
+} DrainWorker;
+
+static void* runDrain(void* data){
+   DrainWorker* worker = (DrainWorker*)data;
+   struct timespec wait = { 0, 100000 };
+
+   while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)){
+      int records = 0;
+      statsd_drain(worker->drain, worker->forward, &records);
+      if (records == 0){
+         nanosleep(&wait, NULL);
+      }
+   }
+
+   statsd_drain(worker->drain, worker->forward, NULL);
+   return NULL;
+}
+
+/**
+   A producer that waits for room instead of dropping, so the rate is
+   what the drain keeps up with.
+*/
+static void* runShmWorker(void* data){
+   Worker* worker = (Worker*)data;
+   for (long i = 0; i < worker->count; i++){
+      while (statsd_count(worker->stats, "requests.count", (int)i, NO_SAMPLE_RATE) == STATSD_DROPPED){
+         sched_yield();
+      }
+   }
+   return NULL;
+}
+
+static StatsdDrain* openBenchRing(char* ring, int size){
+   snprintf(ring, size, "statsd-bench-%d", (int)getpid());
+
+   StatsdDrain* drain = NULL;
+   if (statsd_openDrain(&drain, ring, 16 << 20) != STATSD_SUCCESS){
+      fprintf(stderr, "Unable to open the shared memory ring\n");
+      exit(1);
+   }
+
+   return drain;
+}
+
+static void removeBenchRing(StatsdDrain* drain, const char* ring){
+   char path[80];
+   snprintf(path, sizeof(path), "/%s", ring);
+   statsd_closeDrain(drain);
+   shm_unlink(path);
+}
+
+/**
+   The cost of adding one stat to a shared memory ring, to compare with
+   statsd_count/send. The ring is drained to the local sink between
+   rounds, outside of the time.
+*/
+static void benchShmAppend(void){
+   if (!selected("shm/append")){
+      return;
+   }
+
+   char ring[64];
+   StatsdDrain* drain = openBenchRing(ring, sizeof(ring));
+
+   Statsd forward;
+   newClient(&forward);
+   statsd_setPacketSize(&forward, STATSD_ETHERNET_PACKET_SIZE);
+
+   char server[80];
+   snprintf(server, sizeof(server), STATSD_SHM_PREFIX "%s", ring);
+   Statsd stats;
+   stats.socketFd = -1;
+   statsd_init(&stats, server, 0, "some.namespace", "requests");
+
+   //A round fills no more then about a quarter of the ring
+   double elapsed = 0;
+   for (long done = 0; done < iterations; done += 100000){
+      long round = iterations - done < 100000 ? iterations - done : 100000;
+      double start = now();
+      for (long i = 0; i < round; i++){
+         sink += statsd_count(&stats, "requests.count", (int)i, NO_SAMPLE_RATE);
+      }
+      elapsed += now() - start;
+      statsd_drain(drain, &forward, NULL);
+   }
+   report("shm/append", elapsed, iterations, 0);
+
+   statsd_release(&stats);
+   statsd_release(&forward);
+   removeBenchRing(drain, ring);
+}
+
+/**
+   One stat per call into a shared memory ring, with a drain thread
+   forwarding them to the local sink in full packets. Each producing
+   thread has a client of its own, as separate processes would. The time
+   runs until the drain has forwarded everything, and packets are the
+   datagrams the drain sent.
+*/
+static void benchShm(const char* name, int producers){
+   if (!selected(name)){
+      return;
+   }
+
+   char ring[64];
+   StatsdDrain* drain = openBenchRing(ring, sizeof(ring));
+
+   Statsd forward;
+   newClient(&forward);
+   statsd_setPacketSize(&forward, STATSD_ETHERNET_PACKET_SIZE);
+
+   char server[80];
+   snprintf(server, sizeof(server), STATSD_SHM_PREFIX "%s", ring);
+
+   Statsd stats[MAX_THREADS];
+   Worker worker[MAX_THREADS];
+   pthread_t thread[MAX_THREADS];
+   long perThread = iterations / producers;
+   for (int t = 0; t < producers; t++){
+      stats[t].socketFd = -1;
+      statsd_init(&stats[t], server, 0, "some.namespace", "requests");
+      worker[t].stats = &stats[t];
+      worker[t].count = perThread;
+      worker[t].sampleRate = NO_SAMPLE_RATE;
+   }
+
+   DrainWorker drainer = { drain, &forward, 1 };
+   pthread_t drainThread;
+   pthread_create(&drainThread, NULL, runDrain, &drainer);
+
+   double start = now();
+   for (int t = 0; t < producers; t++){
+      pthread_create(&thread[t], NULL, runShmWorker, &worker[t]);
+   }
+
+   for (int t = 0; t < producers; t++){
+      pthread_join(thread[t], NULL);
+   }
+   __atomic_store_n(&drainer.running, 0, __ATOMIC_RELEASE);
+   pthread_join(drainThread, NULL);
+   double elapsed = now() - start;
+
+   char label[64];
+   snprintf(label, sizeof(label), "%s/%d", name, producers);
+   report(label, elapsed, perThread * producers, packetsSent(&forward));
+
+   for (int t = 0; t < producers; t++){
+      statsd_release(&stats[t]);
+   }
+   statsd_release(&forward);
+   removeBenchRing(drain, ring);
+}
+
+static void usage(const char* program){
+   fprintf(stderr, "Usage: %s [-n iterations] [-t threads] [-f text|csv|json] [benchmark]\n", program);
+   fprintf(stderr, "  -n  iterations of each benchmark (default %ld, 1/%d of that for\n", DEFAULT_ITERATIONS, SYSCALL_DIVISOR);
+   fprintf(stderr, "      benchmarks that make a system call per stat)\n");
+   fprintf(stderr, "  -t  threads for the contention benchmarks (default: one per CPU)\n");
+   fprintf(stderr, "  -f  output format\n");
+   fprintf(stderr, "  benchmark  only run the benchmarks whose name starts with this\n");
+}
+
+int main(int argc, char* argv[]){
+   int option;
+   while ((option = getopt(argc, argv, "n:t:f:h")) != -1){
+      switch (option){
+         case 'n':
+            iterations = atol(optarg);
+            break;
+         case 't':
+            threads = atoi(optarg);
+            break;
+         case 'f':
+            if (strcmp(optarg, "csv") == 0){
+               format = FORMAT_CSV;
+            }
+            else if (strcmp(optarg, "json") == 0){
+               format = FORMAT_JSON;
+            }
+            else if (strcmp(optarg, "text") == 0){
+               format = FORMAT_TEXT;
+            }
+            else {
+               usage(argv[0]);
+               return EXIT_FAILURE;
+            }
+            break;
+         default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+   }
+
+   //The old form took the iterations as the only argument
+   if (optind < argc){
+      char* end = NULL;
+      long count = strtol(argv[optind], &end, 10);
+      if (*end == '\0'){
+         iterations = count;
+      }
+      else {
+         filter = argv[optind];
+      }
+   }
+
+   if (threads <= 0){
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (threads < 1){
+      threads = 1;
+   }
+   if (threads > MAX_THREADS){
+      threads = MAX_THREADS;
+   }
+
+   if (iterations < SYSCALL_DIVISOR * threads){
+      iterations = SYSCALL_DIVISOR * threads;
+   }
+
+   if (format == FORMAT_CSV){
+      printf("name,ops,ns_per_op,ops_per_s,packets_per_s\n");
+   }
+
+   startSink();
+   benchBuildStatString();
+   benchAddToBatch();
+   benchSend();
+   benchSendBatch();
+   benchSendLines();
+   benchFlushTick();
+   benchSampling();
+   benchHistogram();
+   benchTimer();
+   benchContention("concurrent/count", NO_SAMPLE_RATE);
+   benchContention("concurrent/sampled", 0.0001);
+   benchShmAppend();
+   benchShm("shm/count", 1);
+   if (threads > 1){
+      benchShm("shm/count", threads);
+   }
+   return EXIT_SUCCESS;
+}
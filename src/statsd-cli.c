@@ -25,11 +25,40 @@ OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <math.h>
 #include <config.h>
 #include "statsd.h"
 
+#if !defined (_WIN32)
+   #include <unistd.h>
+   #include <errno.h>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <signal.h>
+   #include <sys/stat.h>
+   #include <pthread.h>
+#endif
+
 #define STRING_MATCH 0
 
+//The most tags -T takes
+#define MAX_TAGS 32
+
+//Stream mode reads up to this much input at a time, and sends the batch
+//at least this often (in milliseconds) even when it is not full
+#define STREAM_BUFFER_SIZE 65536
+#define DEFAULT_FLUSH_INTERVAL 1000
+
+//Flood mode defaults. Latencies are kept in a histogram with 8 linear sub
+//buckets for every power of 2 nanoseconds, within 1/8 of the real value.
+#define FLOOD_DEFAULT_DURATION 10
+#define FLOOD_DEFAULT_BUCKETS 100
+#define FLOOD_MAX_THREADS 256
+#define FLOOD_LATENCY_SUB_BITS 3
+#define FLOOD_LATENCY_BUCKETS (64 << FLOOD_LATENCY_SUB_BITS)
+#define FLOOD_PACING_STEP 64
+#define FLOOD_SEQUENCE_EVERY 16
+
 #if defined (_WIN32)
 #pragma comment (lib, "Ws2_32.lib")
 #endif
@@ -41,6 +70,24 @@ static char* bucket = NULL;
 static int type = STATSD_NONE;
 static int value = 0;
 static double samplerate = 0.0;
+static char* inputPath = NULL;
+static int flushInterval = DEFAULT_FLUSH_INTERVAL;
+static int packetSize = 0;
+static char* tagList = NULL;
+
+static bool flood = false;
+static double floodRate = 0;
+static double floodDuration = FLOOD_DEFAULT_DURATION;
+static int floodThreads = 1;
+static int floodBuckets = FLOOD_DEFAULT_BUCKETS;
+static char* floodMix = NULL;
+static bool floodBatch = false;
+static bool floodShared = false;
+static bool floodSequence = false;
+
+//The -T tags as they were given, for statsd lines that are forwarded as
+//they were written
+static char* lineTags = NULL;
 
 static bool isDigit(const char* str){
    if (str[0] >= '0' && str[0] <= '9'){
@@ -61,8 +108,24 @@ static void usageAndExit(char* prog, FILE* where, int returnCode){
    fprintf(where, "  -t --type : specify the stat type\n");
    fprintf(where, "    types: count, set, gauge, timing\n");
    fprintf(where, "  -r --rate : specify the sample rate\n");
+   fprintf(where, "  -f --file : read stats from a file or FIFO, one per line (- for stdin)\n");
+   fprintf(where, "    lines: \"bucket value type [rate]\" or \"bucket:value|type[|@rate][|#tags]\"\n");
+   fprintf(where, "  -i --interval : in stream mode, send at least every n milliseconds (default = %d)\n", DEFAULT_FLUSH_INTERVAL);
+   fprintf(where, "  -P --packet-size : the largest datagram to send\n");
+   fprintf(where, "  -T --tags : tags to add to every stat, as in host:web1,region:us-east\n");
+   fprintf(where, "  --flood, --bench : send generated stats as fast as asked, and report\n");
+   fprintf(where, "    --ops : target stats per second over all threads (default = no limit)\n");
+   fprintf(where, "    --duration : seconds to run (default = %d)\n", FLOOD_DEFAULT_DURATION);
+   fprintf(where, "    --threads : sending threads (default = 1)\n");
+   fprintf(where, "    --buckets : distinct buckets under the bucket name (default = %d)\n", FLOOD_DEFAULT_BUCKETS);
+   fprintf(where, "    --mix : type weights, as in count:70,timing:20,gauge:5,set:5\n");
+   fprintf(where, "    --batch : batch stats into full datagrams instead of one per stat\n");
+   fprintf(where, "    --shared : share one client in concurrent mode instead of one per thread\n");
+   fprintf(where, "    --sequence : make every %dth stat a per thread sequence for statsd-sink\n", FLOOD_SEQUENCE_EVERY);
    fprintf(where, "example:\n");
    fprintf(where, "  %s -s statsd.example.com -n some.statsd -b counts -t count 25\n", prog);
+   fprintf(where, "  tail -f stats.log | %s -s statsd.example.com -f -\n", prog);
+   fprintf(where, "  %s -s 127.0.0.1 -b load --flood --threads 4 --ops 200000 --batch\n", prog);
 
    exit(returnCode);
 }
@@ -114,6 +177,54 @@ static void parseCommandLine(int argc, char* argv[]){
          samplerate = strtod(argv[i+1], NULL);
          i++;
       }
+      else if (strcmp(argv[i], "-f") == STRING_MATCH || strcmp(argv[i], "--file") == STRING_MATCH) {
+         inputPath = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-i") == STRING_MATCH || strcmp(argv[i], "--interval") == STRING_MATCH) {
+         flushInterval = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-T") == STRING_MATCH || strcmp(argv[i], "--tags") == STRING_MATCH) {
+         tagList = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-P") == STRING_MATCH || strcmp(argv[i], "--packet-size") == STRING_MATCH) {
+         packetSize = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "--flood") == STRING_MATCH || strcmp(argv[i], "--bench") == STRING_MATCH) {
+         flood = true;
+      }
+      else if (strcmp(argv[i], "--ops") == STRING_MATCH) {
+         floodRate = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (strcmp(argv[i], "--duration") == STRING_MATCH) {
+         floodDuration = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (strcmp(argv[i], "--threads") == STRING_MATCH) {
+         floodThreads = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "--buckets") == STRING_MATCH) {
+         floodBuckets = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "--mix") == STRING_MATCH) {
+         floodMix = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "--batch") == STRING_MATCH) {
+         floodBatch = true;
+      }
+      else if (strcmp(argv[i], "--shared") == STRING_MATCH) {
+         floodShared = true;
+      }
+      else if (strcmp(argv[i], "--sequence") == STRING_MATCH) {
+         floodSequence = true;
+      }
       else if (isDigit(argv[i])){
          value = atoi(argv[i]);
       }
@@ -123,6 +234,678 @@ static void parseCommandLine(int argc, char* argv[]){
    }
 }
 
+#if !defined (_WIN32)
+
+/**
+   Turn a type name into a stat type. Both the statsd-cli names (count)
+   and the wire names (c) are accepted.
+*/
+static int parseType(const char* str, int length){
+   static const struct {
+      const char* name;
+      int type;
+   } types[] = {
+      { "count", STATSD_COUNT }, { "c", STATSD_COUNT },
+      { "gauge", STATSD_GAUGE }, { "g", STATSD_GAUGE },
+      { "set", STATSD_SET }, { "s", STATSD_SET },
+      { "timing", STATSD_TIMING }, { "ms", STATSD_TIMING }
+   };
+
+   for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++){
+      if ((int)strlen(types[i].name) == length && strncmp(str, types[i].name, length) == STRING_MATCH){
+         return types[i].type;
+      }
+   }
+
+   return STATSD_NONE;
+}
+
+/**
+   Parse a stat value that runs up to end. Whole numbers are kept exact
+   as 64 bit integers, anything else has to be a finite decimal.
+
+   @param[out] whole - Set to true if the value is a whole number
+   @param[out] integer - The value, if it is a whole number
+   @param[out] real - The value, if it is not
+
+   @return false if the value is not a number
+*/
+static bool parseValue(const char* str, const char* end, bool* whole, int64_t* integer, double* real){
+   char* stop = NULL;
+   errno = 0;
+   *integer = strtoll(str, &stop, 10);
+   *whole = stop != str && stop == end && errno == 0;
+   if (*whole){
+      return true;
+   }
+
+   *real = strtod(str, &stop);
+   return stop != str && stop == end && isfinite(*real);
+}
+
+//Statsd lines waiting to be forwarded
+static char rawLines[STREAM_BUFFER_SIZE];
+static int rawLength = 0;
+
+/**
+   Send the statsd lines that are waiting to be forwarded.
+*/
+static void sendRawLines(Statsd* stats){
+   if (rawLength == 0){
+      return;
+   }
+
+   int ret = statsd_sendLines(stats, rawLines, rawLength, NULL);
+   if (ret != STATSD_SUCCESS && ret != STATSD_DROPPED){
+      fprintf(stderr, "Error sending stats to server (%d)\n", ret);
+   }
+
+   rawLength = 0;
+}
+
+/**
+   Check the tags of a statsd line, "k:v,k2", that run up to end. None of
+   them may be empty.
+*/
+static bool validTags(const char* tags, const char* end){
+   if (tags == end || tags[0] == ',' || end[-1] == ','){
+      return false;
+   }
+
+   for (const char* c = tags; c < end - 1; c++){
+      if (c[0] == ',' && c[1] == ','){
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/**
+   Queue a statsd line, "bucket:value|type[|@rate][|#tags]", to be
+   forwarded as it was written. Whoever wrote the line already sampled the
+   stat, so it is not put through the client's sampling a second time.
+   Only the namespace and the -T tags are added, the -T tags going in
+   front of the line's own as the client's default tags do.
+
+   @param[in] stats - The statsd client
+   @param[in] line - The line, with its ':' at colon and first '|' at bar
+
+   @return false if the line could not be parsed
+*/
+static bool forwardLine(Statsd* stats, const char* line, const char* colon, const char* bar){
+   bool whole;
+   int64_t integer;
+   double real;
+   if (colon == line || !parseValue(colon + 1, bar, &whole, &integer, &real)){
+      return false;
+   }
+
+   const char* typeStart = bar + 1;
+   const char* fields = strchr(typeStart, '|');
+   int typeLength = fields ? (int)(fields - typeStart) : (int)strlen(typeStart);
+   if (parseType(typeStart, typeLength) == STATSD_NONE){
+      return false;
+   }
+
+   const char* tagField = NULL;
+   for (const char* field = fields; field; field = strchr(field + 1, '|')){
+      const char* fieldEnd = strchr(field + 1, '|');
+      if (!fieldEnd){
+         fieldEnd = field + strlen(field);
+      }
+
+      if (field[1] == '#'){
+         if (tagField || !validTags(field + 2, fieldEnd)){
+            return false;
+         }
+
+         tagField = field;
+         continue;
+      }
+
+      if (field[1] != '@'){
+         return false;
+      }
+
+      char* end = NULL;
+      double rate = strtod(field + 2, &end);
+      if (end == field + 2 || end != fieldEnd || !(rate > 0.0 && rate <= 1.0)){
+         return false;
+      }
+   }
+
+   int prefixLength = prefix ? (int)strlen(prefix) + 1 : 0;
+   int lineLength = (int)strlen(line);
+   int tagsLength = lineTags ? (int)strlen(lineTags) + 2 : 0;
+   int length = prefixLength + lineLength + tagsLength + 1;
+
+   if (rawLength + length > STREAM_BUFFER_SIZE){
+      sendRawLines(stats);
+      if (length > STREAM_BUFFER_SIZE){
+         return false;
+      }
+   }
+
+   char* out = rawLines + rawLength;
+   if (prefix){
+      out += sprintf(out, "%s.", prefix);
+   }
+
+   if (lineTags && tagField){
+      int head = (int)(tagField - line) + 2;
+      memcpy(out, line, head);
+      out += head;
+      out += sprintf(out, "%s,", lineTags);
+      memcpy(out, line + head, lineLength - head);
+      out += lineLength - head;
+   }
+   else {
+      memcpy(out, line, lineLength);
+      out += lineLength;
+
+      if (lineTags){
+         out += sprintf(out, "|#%s", lineTags);
+      }
+   }
+
+   *out++ = '\n';
+   rawLength = (int)(out - rawLines);
+   return true;
+}
+
+/**
+   Add one line of input to the batch. A line is either
+   "bucket value type [rate]" or a statsd line,
+   "bucket:value|type[|@rate][|#tags]", which is forwarded as written. The line is modified while it is parsed.
+
+   @return false if the line could not be parsed
+*/
+static bool batchLine(Statsd* stats, char* line){
+   double lineRate = samplerate;
+
+   char* colon = strchr(line, ':');
+   char* bar = colon ? strchr(colon, '|') : NULL;
+   if (bar){
+      return forwardLine(stats, line, colon, bar);
+   }
+
+   char* save = NULL;
+   char* lineBucket = strtok_r(line, " \t", &save);
+   char* lineValue = strtok_r(NULL, " \t", &save);
+   char* typeStr = strtok_r(NULL, " \t", &save);
+   char* rateStr = strtok_r(NULL, " \t", &save);
+
+   if (!typeStr || strtok_r(NULL, " \t", &save)){
+      return false;
+   }
+
+   int lineType = parseType(typeStr, strlen(typeStr));
+   if (rateStr){
+      lineRate = strtod(rateStr, NULL);
+   }
+
+   bool whole;
+   int64_t integer;
+   double real;
+   if (!lineBucket || !*lineBucket || lineType == STATSD_NONE || !lineValue || !parseValue(lineValue, lineValue + strlen(lineValue), &whole, &integer, &real)){
+      return false;
+   }
+
+   int ret = whole ? statsd_addToBatch64(stats, lineType, lineBucket, integer, lineRate) : statsd_addToBatchDouble(stats, lineType, lineBucket, real, lineRate);
+   if (ret != STATSD_SUCCESS && ret != STATSD_DROPPED){
+      fprintf(stderr, "Error sending stats to server (%d)\n", ret);
+   }
+
+   return ret != STATSD_BAD_STATS_TYPE && ret != STATSD_BATCH_FULL;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signum){
+   stopping = 1;
+}
+
+static long long monotonicMillis(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+   Read stats from a file, FIFO or stdin until the input ends (or a
+   signal arrives), packing them into full datagrams. Whatever has been
+   batched is sent at least every flushInterval milliseconds, so a slow
+   writer does not hold stats back. A FIFO is kept open between writers.
+
+   @return The exit code
+*/
+static int streamStats(Statsd* stats){
+   int fd = STDIN_FILENO;
+   if (strcmp(inputPath, "-") != STRING_MATCH){
+      struct stat info;
+      int flags = O_RDONLY;
+
+      //Holding the write end open means the FIFO never reads as ended
+      if (stat(inputPath, &info) == 0 && S_ISFIFO(info.st_mode)){
+         flags = O_RDWR;
+      }
+
+      fd = open(inputPath, flags);
+      if (fd == -1){
+         fprintf(stderr, "Unable to open %s: %s\n", inputPath, strerror(errno));
+         return 1;
+      }
+   }
+
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = stop;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   char* buffer = (char*)malloc(STREAM_BUFFER_SIZE + 1);
+   if (!buffer){
+      fprintf(stderr, "Unable to allocate the input buffer\n");
+      return 1;
+   }
+
+   int length = 0;
+   long long skipped = 0;
+   long long nextFlush = monotonicMillis() + flushInterval;
+   bool ended = false;
+
+   while (!ended && !stopping){
+      long long wait = nextFlush - monotonicMillis();
+      struct pollfd input = { fd, POLLIN, 0 };
+
+      if (wait > 0 && poll(&input, 1, (int)wait) > 0){
+         ssize_t count = read(fd, buffer + length, STREAM_BUFFER_SIZE - length);
+         if (count < 0 && errno != EINTR && errno != EAGAIN){
+            fprintf(stderr, "Unable to read %s: %s\n", inputPath, strerror(errno));
+            ended = true;
+         }
+         else if (count == 0){
+            ended = true;
+         }
+         else if (count > 0){
+            length += count;
+         }
+
+         //At the end of the input the last line does not need a newline
+         if (ended && length > 0 && length < STREAM_BUFFER_SIZE){
+            buffer[length++] = '\n';
+         }
+
+         char* start = buffer;
+         char* newline;
+         while ((newline = (char*)memchr(start, '\n', length - (start - buffer)))){
+            *newline = '\0';
+            if (newline > start && newline[-1] == '\r'){
+               newline[-1] = '\0';
+            }
+
+            if (*start && !batchLine(stats, start)){
+               skipped++;
+            }
+            start = newline + 1;
+         }
+
+         length -= start - buffer;
+         memmove(buffer, start, length);
+
+         //A line longer then the buffer can never be parsed
+         if (length == STREAM_BUFFER_SIZE){
+            skipped++;
+            length = 0;
+         }
+      }
+
+      if (monotonicMillis() >= nextFlush){
+         statsd_sendBatch(stats);
+         sendRawLines(stats);
+         nextFlush = monotonicMillis() + flushInterval;
+      }
+   }
+
+   statsd_sendBatch(stats);
+   sendRawLines(stats);
+   statsd_flush(stats);
+
+   if (skipped > 0){
+      fprintf(stderr, "Skipped %lld lines that could not be parsed\n", skipped);
+   }
+
+   free(buffer);
+   if (fd != STDIN_FILENO){
+      close(fd);
+   }
+
+   return EXIT_SUCCESS;
+}
+
+/**
+   One sending thread of flood mode, and what it measured.
+*/
+typedef struct {
+   pthread_t thread;
+   int index;
+   Statsd* stats;
+   char** names;
+   const int* types;
+   int typeCount;
+   double rate;
+   double deadline;
+
+   uint64_t random;
+   long long sent;
+   long long dropped;
+   long long errors;
+   uint64_t maxLatency;
+   uint64_t latency[FLOOD_LATENCY_BUCKETS];
+} Flooder;
+
+static uint64_t monotonicNanos(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int latencyIndex(uint64_t nanos){
+   if (nanos < (1 << FLOOD_LATENCY_SUB_BITS)){
+      return (int)nanos;
+   }
+
+   int exponent = 63 - __builtin_clzll(nanos);
+   int sub = (int)(nanos >> (exponent - FLOOD_LATENCY_SUB_BITS)) & ((1 << FLOOD_LATENCY_SUB_BITS) - 1);
+   return ((exponent - FLOOD_LATENCY_SUB_BITS + 1) << FLOOD_LATENCY_SUB_BITS) + sub;
+}
+
+static uint64_t latencyValue(int index){
+   if (index < (1 << FLOOD_LATENCY_SUB_BITS)){
+      return index;
+   }
+
+   int exponent = (index >> FLOOD_LATENCY_SUB_BITS) + FLOOD_LATENCY_SUB_BITS - 1;
+   uint64_t sub = index & ((1 << FLOOD_LATENCY_SUB_BITS) - 1);
+   return ((1ULL << FLOOD_LATENCY_SUB_BITS) + sub) << (exponent - FLOOD_LATENCY_SUB_BITS);
+}
+
+static uint64_t latencyPercentile(const Flooder* flooder, double percentile){
+   long long target = (long long)(flooder->sent * percentile / 100.0);
+   long long seen = 0;
+   for (int i = 0; i < FLOOD_LATENCY_BUCKETS; i++){
+      seen += flooder->latency[i];
+      if (seen > target){
+         return latencyValue(i);
+      }
+   }
+
+   return flooder->maxLatency;
+}
+
+static uint64_t nextRandom(Flooder* flooder){
+   flooder->random ^= flooder->random >> 12;
+   flooder->random ^= flooder->random << 25;
+   flooder->random ^= flooder->random >> 27;
+   return flooder->random * 2685821657736338717ULL;
+}
+
+static void* runFlooder(void* data){
+   Flooder* flooder = (Flooder*)data;
+   Statsd* stats = flooder->stats;
+   char sequenceName[64];
+   snprintf(sequenceName, sizeof(sequenceName), "%s.thread%d.sequence", bucket ? bucket : "flood", flooder->index);
+
+   uint64_t started = monotonicNanos();
+   long long sequence = 0;
+
+   for (long long i = 0; ; i++){
+      //Check the clock, and keep to the target rate, every few stats
+      if (i % FLOOD_PACING_STEP == 0){
+         uint64_t current = monotonicNanos();
+         if (current >= flooder->deadline){
+            break;
+         }
+
+         if (flooder->rate > 0){
+            uint64_t due = started + (uint64_t)(i / flooder->rate * 1e9);
+            if (due > current){
+               struct timespec pause = { (time_t)((due - current) / 1000000000ULL), (long)((due - current) % 1000000000ULL) };
+               nanosleep(&pause, NULL);
+            }
+         }
+      }
+
+      uint64_t random = nextRandom(flooder);
+      const char* name = flooder->names[random % floodBuckets];
+      int statType = flooder->types[(random >> 32) % flooder->typeCount];
+      int statValue = (int)((random >> 40) & 0xffff);
+      double statRate = samplerate;
+
+      if (floodSequence && i % FLOOD_SEQUENCE_EVERY == 0){
+         name = sequenceName;
+         statType = STATSD_GAUGE;
+         statValue = (int)sequence++;
+         statRate = 0;
+      }
+
+      uint64_t before = monotonicNanos();
+      int ret;
+      if (floodBatch){
+         ret = statsd_addToBatch(stats, statType, name, statValue, statRate);
+      }
+      else {
+         switch (statType){
+            case STATSD_GAUGE:
+               ret = statsd_gauge(stats, name, statValue, statRate);
+               break;
+            case STATSD_SET:
+               ret = statsd_set(stats, name, statValue, statRate);
+               break;
+            case STATSD_TIMING:
+               ret = statsd_timing(stats, name, statValue, statRate);
+               break;
+            default:
+               ret = statsd_count(stats, name, 1, statRate);
+               break;
+         }
+      }
+      uint64_t latency = monotonicNanos() - before;
+
+      flooder->latency[latencyIndex(latency)]++;
+      if (latency > flooder->maxLatency){
+         flooder->maxLatency = latency;
+      }
+
+      flooder->sent++;
+      if (ret == STATSD_DROPPED){
+         flooder->dropped++;
+      }
+      else if (ret != STATSD_SUCCESS){
+         flooder->errors++;
+      }
+   }
+
+   if (floodBatch){
+      statsd_sendBatch(stats);
+   }
+
+   return NULL;
+}
+
+/**
+   Parse a type mix such as "count:70,timing:20,gauge:5,set:5" into a
+   table of 100 types to pick from at random.
+
+   @return The number of entries in the table, 0 if the mix is invalid
+*/
+static int parseMix(const char* mix, int* types, int size){
+   if (!mix){
+      types[0] = type == STATSD_NONE ? STATSD_COUNT : type;
+      return 1;
+   }
+
+   int weights[STATSD_BATCH] = { 0 };
+   int total = 0;
+   char* copy = strdup(mix);
+   char* save = NULL;
+
+   for (char* part = strtok_r(copy, ",", &save); part; part = strtok_r(NULL, ",", &save)){
+      char* colon = strchr(part, ':');
+      int weight = colon ? atoi(colon + 1) : 1;
+      int partType = parseType(part, colon ? (int)(colon - part) : (int)strlen(part));
+
+      if (partType == STATSD_NONE || weight < 0){
+         free(copy);
+         return 0;
+      }
+
+      weights[partType] += weight;
+      total += weight;
+   }
+   free(copy);
+
+   if (total == 0){
+      return 0;
+   }
+
+   int count = 0;
+   for (int t = 0; t < STATSD_BATCH; t++){
+      for (int w = 0; w < weights[t] * size / total && count < size; w++){
+         types[count++] = t;
+      }
+   }
+
+   return count;
+}
+
+/**
+   Flood the server with generated stats from several threads, and report
+   the rates reached, the errors and the latency of each call.
+
+   @return The exit code
+*/
+static int floodStats(void){
+   static int types[100];
+   int typeCount = parseMix(floodMix, types, 100);
+   if (typeCount == 0){
+      fprintf(stderr, "Invalid type mix %s\n", floodMix);
+      return 1;
+   }
+
+   if (floodThreads < 1 || floodThreads > FLOOD_MAX_THREADS || floodBuckets < 1){
+      fprintf(stderr, "Threads must be from 1 to %d, and there must be at least one bucket\n", FLOOD_MAX_THREADS);
+      return 1;
+   }
+
+   char** names = (char**)malloc(floodBuckets * sizeof(char*));
+   Flooder* flooders = (Flooder*)calloc(floodThreads, sizeof(Flooder));
+   Statsd** clients = (Statsd**)calloc(floodThreads, sizeof(Statsd*));
+   if (!names || !flooders || !clients){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   for (int i = 0; i < floodBuckets; i++){
+      names[i] = (char*)malloc(64);
+      snprintf(names[i], 64, "%s.%d", bucket ? bucket : "flood", i);
+   }
+
+   //Either every thread has a client, or they all share one
+   int clientCount = floodShared ? 1 : floodThreads;
+   for (int i = 0; i < clientCount; i++){
+      int ret = statsd_new(&clients[i], serverAddress, port, prefix, NULL);
+      if (ret == STATSD_SUCCESS && packetSize > 0){
+         ret = statsd_setPacketSize(clients[i], packetSize);
+      }
+      if (ret == STATSD_SUCCESS && floodShared){
+         ret = statsd_enableConcurrency(clients[i], 0);
+      }
+
+      if (ret != STATSD_SUCCESS){
+         fprintf(stderr, "Unable to create statsd object (%d)\n", ret);
+         return 1;
+      }
+   }
+
+   uint64_t started = monotonicNanos();
+   for (int i = 0; i < floodThreads; i++){
+      Flooder* flooder = &flooders[i];
+      flooder->index = i;
+      flooder->stats = clients[floodShared ? 0 : i];
+      flooder->names = names;
+      flooder->types = types;
+      flooder->typeCount = typeCount;
+      flooder->rate = floodRate / floodThreads;
+      flooder->deadline = started + floodDuration * 1e9;
+      flooder->random = (started + i) * 0x9E3779B97F4A7C15ULL | 1;
+
+      if (pthread_create(&flooder->thread, NULL, runFlooder, flooder) != 0){
+         fprintf(stderr, "Unable to start thread %d\n", i);
+         return 1;
+      }
+   }
+
+   for (int i = 0; i < floodThreads; i++){
+      pthread_join(flooders[i].thread, NULL);
+   }
+
+   long long sent = 0;
+   long long dropped = 0;
+   long long errors = 0;
+   uint64_t packets = 0;
+   uint64_t failedCalls = 0;
+   for (int i = 0; i < floodThreads; i++){
+      sent += flooders[i].sent;
+      dropped += flooders[i].dropped;
+      errors += flooders[i].errors;
+   }
+
+   //Stopping concurrent mode sends what the flusher thread is holding
+   for (int i = 0; i < clientCount; i++){
+      StatsdInternalStats internal;
+      statsd_disableConcurrency(clients[i]);
+      statsd_flush(clients[i]);
+      statsd_getInternalStats(clients[i], &internal);
+      packets += internal.packets;
+      failedCalls += internal.failedCalls;
+   }
+   double seconds = (monotonicNanos() - started) / 1e9;
+
+   printf("threads %d\n", floodThreads);
+   printf("seconds %.3f\n", seconds);
+   printf("metrics %lld\n", sent);
+   printf("metrics_per_second %.0f\n", sent / seconds);
+   printf("packets %llu\n", (unsigned long long)packets);
+   printf("packets_per_second %.0f\n", packets / seconds);
+   printf("dropped %lld\n", dropped);
+   printf("send_errors %lld\n", errors);
+   printf("failed_calls %llu\n", (unsigned long long)failedCalls);
+
+   for (int i = 0; i < floodThreads; i++){
+      Flooder* flooder = &flooders[i];
+      printf("thread %d metrics %lld p50_ns %llu p90_ns %llu p99_ns %llu p999_ns %llu max_ns %llu\n", i, flooder->sent,
+         (unsigned long long)latencyPercentile(flooder, 50), (unsigned long long)latencyPercentile(flooder, 90),
+         (unsigned long long)latencyPercentile(flooder, 99), (unsigned long long)latencyPercentile(flooder, 99.9),
+         (unsigned long long)flooder->maxLatency);
+   }
+
+   for (int i = 0; i < clientCount; i++){
+      statsd_free(clients[i]);
+   }
+   for (int i = 0; i < floodBuckets; i++){
+      free(names[i]);
+   }
+   free(names);
+   free(flooders);
+   free(clients);
+
+   return errors > 0 ? 1 : EXIT_SUCCESS;
+}
+
+#endif
+
 int main(int argc, char* argv[]){
 #if defined (_WIN32)
    //Initialize the windows socket library
@@ -138,7 +921,7 @@ int main(int argc, char* argv[]){
    
    srand(time(NULL));
 
-   if (prefix == NULL && bucket == NULL){
+   if (prefix == NULL && bucket == NULL && inputPath == NULL && !flood){
       fprintf(stderr, "You must specify a bucket name!\n");
       usageAndExit(argv[0], stderr, 1);
    }
@@ -148,7 +931,16 @@ int main(int argc, char* argv[]){
       usageAndExit(argv[0], stderr, 1);
    }
 
-   if (type == STATSD_NONE){
+   if (serverAddress != NULL && flood){
+#if defined (_WIN32)
+      fprintf(stderr, "Flood mode is not supported on windows\n");
+      return 1;
+#else
+      return floodStats();
+#endif
+   }
+
+   if (type == STATSD_NONE && inputPath == NULL){
       fprintf(stderr, "You must specify a stat type\n");
       usageAndExit(argv[0], stderr, 1);
    }
@@ -163,6 +955,41 @@ int main(int argc, char* argv[]){
       return 1;
    }
 
+   if (packetSize > 0 && statsd_setPacketSize(stats, packetSize) != STATSD_SUCCESS){
+      fprintf(stderr, "Invalid packet size %d\n", packetSize);
+      return 1;
+   }
+
+   if (tagList != NULL){
+      //Keep the list whole for forwarded lines, it is split up below
+      lineTags = (char*)malloc(strlen(tagList) + 1);
+      if (lineTags){
+         strcpy(lineTags, tagList);
+      }
+
+      const char* tags[MAX_TAGS];
+      int count = 0;
+      for (char* tag = strtok(tagList, ","); tag && count < MAX_TAGS; tag = strtok(NULL, ",")){
+         tags[count++] = tag;
+      }
+
+      if (statsd_setTags(stats, tags, count) != STATSD_SUCCESS){
+         fprintf(stderr, "Invalid tags %s\n", tagList);
+         return 1;
+      }
+   }
+
+   if (inputPath != NULL){
+#if defined (_WIN32)
+      fprintf(stderr, "Reading stats from a file is not supported on windows\n");
+      ret = 1;
+#else
+      ret = streamStats(stats);
+#endif
+      statsd_free(stats);
+      return ret;
+   }
+
    switch(type){
       case STATSD_COUNT:
          ret = statsd_count(stats, NULL, value, samplerate);
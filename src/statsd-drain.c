@@ -0,0 +1,218 @@
+/*************************************************************************************
+Copyright (C) 2012, 2013 James Slocum
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+OR OTHER DEALINGS IN THE SOFTWARE.
+**************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <config.h>
+#include "statsd.h"
+
+#if !defined (_WIN32)
+   #include <signal.h>
+#endif
+
+#define STRING_MATCH 0
+
+#define DEFAULT_RING "statsd"
+#define DEFAULT_SERVER "127.0.0.1"
+#define DEFAULT_DROPPED "statsd.drain.dropped"
+#define DEFAULT_INTERVAL 1
+
+//How often ring drops are sent to the server, in seconds
+#define REPORT_INTERVAL 10
+
+#if !defined (_WIN32)
+
+static const char* ringName = DEFAULT_RING;
+static int ringSize = 0;
+static const char* server = DEFAULT_SERVER;
+static int port = STATSD_PORT;
+static int packetSize = 0;
+static int interval = DEFAULT_INTERVAL;
+static const char* droppedBucket = DEFAULT_DROPPED;
+
+static volatile sig_atomic_t stopping = 0;
+
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usageAndExit(char* prog, FILE* where, int returnCode){
+   fprintf(where, "%s version %s [%s]\n", prog, VERSION, PACKAGE_BUGREPORT);
+   fprintf(where, "  usage:\n");
+   fprintf(where, "  -h --help : print this help message\n");
+   fprintf(where, "  -r --ring : the name of the ring in /dev/shm (default = %s)\n", DEFAULT_RING);
+   fprintf(where, "  -z --size : the size of the ring in bytes, if it has to be created\n");
+   fprintf(where, "     (default = 1048576)\n");
+   fprintf(where, "  -s --server : the server to forward to (default = %s)\n", DEFAULT_SERVER);
+   fprintf(where, "  -p --port : the port of the server (default = %d)\n", STATSD_PORT);
+   fprintf(where, "  -P --packet-size : the largest datagram to send\n");
+   fprintf(where, "  -i --interval : milliseconds to wait when the ring is empty (default = %d)\n", DEFAULT_INTERVAL);
+   fprintf(where, "  -d --dropped : the bucket to count stats dropped by a full ring in\n");
+   fprintf(where, "     (default = %s)\n", DEFAULT_DROPPED);
+   fprintf(where, "example:\n");
+   fprintf(where, "  %s -r statsd -s statsd.example.com -P 1432\n", prog);
+
+   exit(returnCode);
+}
+
+static void parseCommandLine(int argc, char* argv[]){
+   for (int i = 1; i < argc; i++){
+      //Every option but help takes a value
+      if (i + 1 >= argc && strcmp(argv[i], "-h") != STRING_MATCH && strcmp(argv[i], "--help") != STRING_MATCH){
+         usageAndExit(argv[0], stderr, 1);
+      }
+
+      if (strcmp(argv[i], "-r") == STRING_MATCH || strcmp(argv[i], "--ring") == STRING_MATCH){
+         ringName = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-z") == STRING_MATCH || strcmp(argv[i], "--size") == STRING_MATCH){
+         ringSize = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-s") == STRING_MATCH || strcmp(argv[i], "--server") == STRING_MATCH){
+         server = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-p") == STRING_MATCH || strcmp(argv[i], "--port") == STRING_MATCH){
+         port = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-P") == STRING_MATCH || strcmp(argv[i], "--packet-size") == STRING_MATCH){
+         packetSize = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-i") == STRING_MATCH || strcmp(argv[i], "--interval") == STRING_MATCH){
+         interval = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-d") == STRING_MATCH || strcmp(argv[i], "--dropped") == STRING_MATCH){
+         droppedBucket = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-h") == STRING_MATCH || strcmp(argv[i], "--help") == STRING_MATCH) {
+         usageAndExit(argv[0], stdout, EXIT_SUCCESS);
+      }
+      else {
+         usageAndExit(argv[0], stderr, 1);
+      }
+   }
+}
+
+static void stop(int signum){
+   stopping = 1;
+}
+
+int main(int argc, char* argv[]){
+   parseCommandLine(argc, argv);
+
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = stop;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   Statsd* stats = NULL;
+   int ret = statsd_new(&stats, server, port, NULL, NULL);
+   if (ret != STATSD_SUCCESS){
+      fprintf(stderr, "Unable to forward to %s:%d (%d)\n", server, port, ret);
+      return 1;
+   }
+
+   if (packetSize > 0 && statsd_setPacketSize(stats, packetSize) != STATSD_SUCCESS){
+      fprintf(stderr, "Invalid packet size %d\n", packetSize);
+      statsd_free(stats);
+      return 1;
+   }
+
+   StatsdDrain* drain = NULL;
+   ret = statsd_openDrain(&drain, ringName, ringSize);
+   if (ret != STATSD_SUCCESS){
+      fprintf(stderr, "Unable to open the ring %s (%d)\n", ringName, ret);
+      statsd_free(stats);
+      return 1;
+   }
+
+   struct timespec wait = { interval / 1000, (interval % 1000) * 1000000L };
+   uint64_t forwarded = 0;
+   uint64_t reported = 0;
+
+   //Drops are counted from when the drain started, not over the whole
+   //life of the ring
+   statsd_getRingDropped(drain, &reported, NULL);
+   double nextReport = now() + REPORT_INTERVAL;
+
+   while (!stopping){
+      int records = 0;
+      statsd_drain(drain, stats, &records);
+      forwarded += records;
+
+      double time = now();
+      if (time >= nextReport){
+         uint64_t dropped = 0;
+         statsd_getRingDropped(drain, &dropped, NULL);
+         if (dropped > reported){
+            statsd_count64(stats, droppedBucket, (int64_t)(dropped - reported), NO_SAMPLE_RATE);
+            reported = dropped;
+         }
+         nextReport = time + REPORT_INTERVAL;
+      }
+
+      if (records == 0){
+         nanosleep(&wait, NULL);
+      }
+   }
+
+   //Pick up anything added while stopping
+   int records = 0;
+   statsd_drain(drain, stats, &records);
+   forwarded += records;
+
+   uint64_t ringDropped = 0;
+   uint64_t ringDroppedBytes = 0;
+   uint64_t forwardDropped = 0;
+   statsd_getRingDropped(drain, &ringDropped, &ringDroppedBytes);
+   statsd_getDropped(stats, &forwardDropped, NULL);
+
+   printf("records %llu\n", (unsigned long long)forwarded);
+   printf("ring_dropped %llu\n", (unsigned long long)ringDropped);
+   printf("ring_dropped_bytes %llu\n", (unsigned long long)ringDroppedBytes);
+   printf("forward_dropped %llu\n", (unsigned long long)forwardDropped);
+
+   statsd_closeDrain(drain);
+   statsd_free(stats);
+   return EXIT_SUCCESS;
+}
+
+#else
+
+int main(int argc, char* argv[]){
+   fprintf(stderr, "statsd-drain is not supported on windows\n");
+   return 1;
+}
+
+#endif
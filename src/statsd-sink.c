@@ -0,0 +1,871 @@
+/*************************************************************************************
+Copyright (C) 2012, 2013 James Slocum
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+OR OTHER DEALINGS IN THE SOFTWARE.
+**************************************************************************************/
+
+
+//recvmmsg() is a GNU extension
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+   #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <config.h>
+#include "statsd.h"
+
+#if !defined (_WIN32)
+   #include <unistd.h>
+   #include <signal.h>
+   #include <poll.h>
+   #include <fcntl.h>
+   #include <sys/types.h>
+   #include <sys/socket.h>
+   #include <sys/uio.h>
+   #include <sys/un.h>
+   #include <netinet/in.h>
+   #include <netdb.h>
+#endif
+
+#define STRING_MATCH 0
+
+//Datagrams read per recvmmsg() call, each with room for the largest
+//datagram a client can send
+#define RECEIVE_BATCH 64
+#define RECEIVE_SIZE STATSD_UNIX_MAX_PACKET_SIZE
+
+#define MAX_CONNECTIONS 64
+#define CONNECTION_BUFFER_SIZE 65536
+#define VALUE_MAX_SIZE 64
+#define DEFAULT_SEQUENCE "sequence"
+#define BUCKETS_INITIAL_CAPACITY 1024
+#define MEMBERS_INITIAL_CAPACITY 16
+
+#if !defined (_WIN32)
+
+/**
+   Everything received for one bucket of one type, folded together the way
+   the statsd daemon does between flushes.
+*/
+typedef struct {
+   char* name;
+   char type;
+   uint64_t hash;
+   uint64_t samples;
+
+   //Counts are summed (scaled up by their sample rate), gauges keep the
+   //last value
+   double value;
+
+   //Timings
+   double min;
+   double max;
+   double sum;
+
+   //Sets keep the hash of every distinct member
+   uint64_t* members;
+   int memberCount;
+   int memberCapacity;
+
+   //Sequence buckets track the range of sequence numbers seen
+   bool sequence;
+   uint64_t sequenceMin;
+   uint64_t sequenceMax;
+} Bucket;
+
+/**
+   A TCP client, and the part of a line it has not finished sending yet.
+*/
+typedef struct {
+   int fd;
+   char* buffer;
+   int length;
+} Connection;
+
+static const char* udpAddress = NULL;
+static const char* tcpAddress = NULL;
+static const char* unixPath = NULL;
+static double duration = 0;
+static double idle = 0;
+static const char* sequenceName = DEFAULT_SEQUENCE;
+static bool verbose = false;
+
+static volatile sig_atomic_t stopping = 0;
+
+static Bucket* buckets = NULL;
+static int bucketCount = 0;
+static int bucketCapacity = 0;
+
+static uint64_t lines = 0;
+static uint64_t malformed = 0;
+static uint64_t packets = 0;
+static uint64_t bytes = 0;
+static uint64_t connections = 0;
+
+static double firstReceived = 0;
+static double lastReceived = 0;
+
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usageAndExit(char* prog, FILE* where, int returnCode){
+   fprintf(where, "%s version %s [%s]\n", prog, VERSION, PACKAGE_BUGREPORT);
+   fprintf(where, "  usage:\n");
+   fprintf(where, "  -h --help : print this help message\n");
+   fprintf(where, "  -u --udp : listen for UDP on [host:]port (default = 8125)\n");
+   fprintf(where, "  -U --unix : listen on a unix domain datagram socket at this path\n");
+   fprintf(where, "  -t --tcp : listen for TCP on [host:]port\n");
+   fprintf(where, "  -d --duration : exit after this many seconds\n");
+   fprintf(where, "  -i --idle : exit after this many seconds without data, once\n");
+   fprintf(where, "     something has been received\n");
+   fprintf(where, "  -q --sequence : the bucket holding the sender's sequence numbers\n");
+   fprintf(where, "     (default = %s)\n", DEFAULT_SEQUENCE);
+   fprintf(where, "  -v --verbose : print every bucket at exit\n");
+   fprintf(where, "example:\n");
+   fprintf(where, "  %s -u 127.0.0.1:8125 -U /tmp/statsd.sock -t 8125 -i 2\n", prog);
+
+   exit(returnCode);
+}
+
+static void parseCommandLine(int argc, char* argv[]){
+   for (int i = 1; i < argc; i++){
+      //Every option takes a value
+      if (i + 1 >= argc && strcmp(argv[i], "-v") != STRING_MATCH && strcmp(argv[i], "--verbose") != STRING_MATCH &&
+            strcmp(argv[i], "-h") != STRING_MATCH && strcmp(argv[i], "--help") != STRING_MATCH){
+         usageAndExit(argv[0], stderr, 1);
+      }
+
+      if (strcmp(argv[i], "-u") == STRING_MATCH || strcmp(argv[i], "--udp") == STRING_MATCH){
+         udpAddress = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-U") == STRING_MATCH || strcmp(argv[i], "--unix") == STRING_MATCH){
+         unixPath = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-t") == STRING_MATCH || strcmp(argv[i], "--tcp") == STRING_MATCH){
+         tcpAddress = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-d") == STRING_MATCH || strcmp(argv[i], "--duration") == STRING_MATCH){
+         duration = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (strcmp(argv[i], "-i") == STRING_MATCH || strcmp(argv[i], "--idle") == STRING_MATCH){
+         idle = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (strcmp(argv[i], "-q") == STRING_MATCH || strcmp(argv[i], "--sequence") == STRING_MATCH){
+         sequenceName = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-v") == STRING_MATCH || strcmp(argv[i], "--verbose") == STRING_MATCH){
+         verbose = true;
+      }
+      else if (strcmp(argv[i], "-h") == STRING_MATCH || strcmp(argv[i], "--help") == STRING_MATCH) {
+         usageAndExit(argv[0], stdout, EXIT_SUCCESS);
+      }
+      else {
+         usageAndExit(argv[0], stderr, 1);
+      }
+   }
+
+   if (!udpAddress && !tcpAddress && !unixPath){
+      udpAddress = "8125";
+   }
+}
+
+static uint64_t hashBytes(const char* data, int length){
+   uint64_t hash = 14695981039346656037ULL;
+   for (int i = 0; i < length; i++){
+      hash ^= (unsigned char)data[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/**
+   Find the bucket for a name and type, adding it if it is new.
+
+   @return The bucket, or NULL if out of memory
+*/
+static Bucket* findBucket(const char* name, int length, char type){
+   if (bucketCount * 2 >= bucketCapacity){
+      int capacity = bucketCapacity ? bucketCapacity * 2 : BUCKETS_INITIAL_CAPACITY;
+      Bucket* grown = (Bucket*)calloc(capacity, sizeof(Bucket));
+      if (!grown){
+         return NULL;
+      }
+
+      for (int i = 0; i < bucketCapacity; i++){
+         if (!buckets[i].name){
+            continue;
+         }
+
+         int slot = buckets[i].hash & (capacity - 1);
+         while (grown[slot].name){
+            slot = (slot + 1) & (capacity - 1);
+         }
+         grown[slot] = buckets[i];
+      }
+
+      free(buckets);
+      buckets = grown;
+      bucketCapacity = capacity;
+   }
+
+   uint64_t hash = hashBytes(name, length) ^ (uint64_t)type;
+   int slot = hash & (bucketCapacity - 1);
+   while (buckets[slot].name){
+      Bucket* bucket = &buckets[slot];
+      if (bucket->hash == hash && bucket->type == type && strncmp(bucket->name, name, length) == STRING_MATCH && bucket->name[length] == '\0'){
+         return bucket;
+      }
+
+      slot = (slot + 1) & (bucketCapacity - 1);
+   }
+
+   Bucket* bucket = &buckets[slot];
+   bucket->name = (char*)malloc(length + 1);
+   if (!bucket->name){
+      return NULL;
+   }
+
+   memcpy(bucket->name, name, length);
+   bucket->name[length] = '\0';
+   bucket->type = type;
+   bucket->hash = hash;
+   bucketCount++;
+   return bucket;
+}
+
+/**
+   Add a member to a set bucket, unless it is already there.
+*/
+static void addMember(Bucket* bucket, uint64_t member){
+   if (bucket->memberCount * 2 >= bucket->memberCapacity){
+      int capacity = bucket->memberCapacity ? bucket->memberCapacity * 2 : MEMBERS_INITIAL_CAPACITY;
+      uint64_t* grown = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+      if (!grown){
+         return;
+      }
+
+      //Zero marks an empty slot, so member hashes are never zero
+      for (int i = 0; i < bucket->memberCapacity; i++){
+         if (bucket->members[i]){
+            int slot = bucket->members[i] & (capacity - 1);
+            while (grown[slot]){
+               slot = (slot + 1) & (capacity - 1);
+            }
+            grown[slot] = bucket->members[i];
+         }
+      }
+
+      free(bucket->members);
+      bucket->members = grown;
+      bucket->memberCapacity = capacity;
+   }
+
+   member |= 1;
+   int slot = member & (bucket->memberCapacity - 1);
+   while (bucket->members[slot]){
+      if (bucket->members[slot] == member){
+         return;
+      }
+      slot = (slot + 1) & (bucket->memberCapacity - 1);
+   }
+
+   bucket->members[slot] = member;
+   bucket->memberCount++;
+}
+
+/**
+   Check if a bucket is the sequence bucket, either by its full name or
+   by its last components (so the sender's namespace does not matter).
+*/
+static bool isSequence(const char* name, int length){
+   int sequenceLength = strlen(sequenceName);
+   if (length < sequenceLength || strncmp(name + length - sequenceLength, sequenceName, sequenceLength) != STRING_MATCH){
+      return false;
+   }
+
+   return length == sequenceLength || name[length - sequenceLength - 1] == '.';
+}
+
+/**
+   Parse one line, bucket:value|type[|@rate][|#tags], and fold it into
+   its bucket.
+*/
+static void parseLine(const char* line, int length){
+   if (length > 0 && line[length - 1] == '\r'){
+      length--;
+   }
+
+   if (length == 0){
+      return;
+   }
+
+   lines++;
+
+   const char* end = line + length;
+   const char* colon = (const char*)memchr(line, ':', length);
+   if (!colon || colon == line){
+      malformed++;
+      return;
+   }
+
+   const char* valueStart = colon + 1;
+   const char* bar = (const char*)memchr(valueStart, '|', end - valueStart);
+   if (!bar || bar == valueStart || bar - valueStart >= VALUE_MAX_SIZE){
+      malformed++;
+      return;
+   }
+
+   const char* typeStart = bar + 1;
+   const char* typeEnd = (const char*)memchr(typeStart, '|', end - typeStart);
+   if (!typeEnd){
+      typeEnd = end;
+   }
+
+   char type;
+   int typeLength = typeEnd - typeStart;
+   if (typeLength == 1 && (*typeStart == 'c' || *typeStart == 'g' || *typeStart == 's')){
+      type = *typeStart;
+   }
+   else if ((typeLength == 2 && strncmp(typeStart, "ms", 2) == STRING_MATCH) || (typeLength == 1 && *typeStart == 'h')){
+      type = 'm';
+   }
+   else {
+      malformed++;
+      return;
+   }
+
+   double sampleRate = 1.0;
+   for (const char* field = typeEnd; field < end; ){
+      const char* fieldEnd = (const char*)memchr(field + 1, '|', end - field - 1);
+      if (!fieldEnd){
+         fieldEnd = end;
+      }
+
+      if (field[1] == '@'){
+         char rate[VALUE_MAX_SIZE];
+         int rateLength = fieldEnd - field - 2;
+         if (rateLength <= 0 || rateLength >= VALUE_MAX_SIZE){
+            malformed++;
+            return;
+         }
+
+         memcpy(rate, field + 2, rateLength);
+         rate[rateLength] = '\0';
+
+         char* parsed = NULL;
+         sampleRate = strtod(rate, &parsed);
+         if (*parsed != '\0' || sampleRate <= 0 || sampleRate > 1){
+            malformed++;
+            return;
+         }
+      }
+
+      field = fieldEnd;
+   }
+
+   char value[VALUE_MAX_SIZE];
+   int valueLength = bar - valueStart;
+   memcpy(value, valueStart, valueLength);
+   value[valueLength] = '\0';
+
+   double number = 0;
+   if (type != 's'){
+      char* parsed = NULL;
+      number = strtod(value, &parsed);
+      if (*parsed != '\0'){
+         malformed++;
+         return;
+      }
+   }
+
+   int nameLength = colon - line;
+   Bucket* bucket = findBucket(line, nameLength, type);
+   if (!bucket){
+      return;
+   }
+
+   //Each sender numbers its own sequence bucket
+   if (bucket->samples == 0){
+      bucket->sequence = isSequence(line, nameLength);
+   }
+
+   if (bucket->sequence && number >= 0){
+      uint64_t sequence = (uint64_t)number;
+      if (bucket->samples == 0 || sequence < bucket->sequenceMin){
+         bucket->sequenceMin = sequence;
+      }
+      if (bucket->samples == 0 || sequence > bucket->sequenceMax){
+         bucket->sequenceMax = sequence;
+      }
+   }
+
+   switch (type){
+      case 'c':
+         bucket->value += number / sampleRate;
+         break;
+      case 'g':
+         //A leading sign makes a gauge a change to the last value
+         if (value[0] == '+' || value[0] == '-'){
+            bucket->value += number;
+         }
+         else {
+            bucket->value = number;
+         }
+         break;
+      case 's':
+         addMember(bucket, hashBytes(value, valueLength));
+         break;
+      case 'm':
+         if (bucket->samples == 0 || number < bucket->min){
+            bucket->min = number;
+         }
+         if (bucket->samples == 0 || number > bucket->max){
+            bucket->max = number;
+         }
+         bucket->sum += number;
+         break;
+   }
+
+   bucket->samples++;
+}
+
+static void parseLines(const char* data, int length){
+   const char* end = data + length;
+   while (data < end){
+      const char* newline = (const char*)memchr(data, '\n', end - data);
+      int lineLength = (newline ? newline : end) - data;
+      parseLine(data, lineLength);
+      data += lineLength + 1;
+   }
+}
+
+static void received(int length){
+   double time = now();
+   if (packets == 0){
+      firstReceived = time;
+   }
+
+   lastReceived = time;
+   packets++;
+   bytes += length;
+}
+
+/**
+   Split [host:]port into its parts. IPv6 hosts go in brackets, as in
+   [::1]:8125.
+
+   @return The port, with host set to NULL if there was none
+*/
+static const char* splitAddress(const char* address, char* host, int size, const char** hostOut){
+   const char* colon = strrchr(address, ':');
+   *hostOut = NULL;
+   if (!colon){
+      return address;
+   }
+
+   const char* start = address;
+   const char* end = colon;
+   if (*start == '[' && end > start && end[-1] == ']'){
+      start++;
+      end--;
+   }
+
+   int length = end - start;
+   if (length >= size){
+      length = size - 1;
+   }
+
+   memcpy(host, start, length);
+   host[length] = '\0';
+   *hostOut = host;
+   return colon + 1;
+}
+
+static int openInet(const char* address, int type){
+   char hostBuffer[256];
+   const char* host = NULL;
+   const char* port = splitAddress(address, hostBuffer, sizeof(hostBuffer), &host);
+
+   struct addrinfo hints;
+   struct addrinfo* results = NULL;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = type;
+   hints.ai_flags = AI_PASSIVE;
+
+   if (getaddrinfo(host, port, &hints, &results) != 0){
+      fprintf(stderr, "Unable to resolve %s\n", address);
+      exit(1);
+   }
+
+   //Prefer IPv6 for a wildcard address, it takes IPv4 too
+   struct addrinfo* chosen = results;
+   for (struct addrinfo* result = results; !host && result; result = result->ai_next){
+      if (result->ai_family == AF_INET6){
+         chosen = result;
+         break;
+      }
+   }
+
+   int fd = socket(chosen->ai_family, chosen->ai_socktype, chosen->ai_protocol);
+   int on = 1;
+   int off = 0;
+   int receiveBuffer = 8 << 20;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+   if (chosen->ai_family == AF_INET6){
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+   }
+
+   if (fd == -1 || bind(fd, chosen->ai_addr, chosen->ai_addrlen) != 0 || (type == SOCK_STREAM && listen(fd, MAX_CONNECTIONS) != 0)){
+      fprintf(stderr, "Unable to listen on %s: %s\n", address, strerror(errno));
+      exit(1);
+   }
+
+   freeaddrinfo(results);
+   fprintf(stderr, "listening on %s %s\n", type == SOCK_STREAM ? "tcp" : "udp", address);
+   return fd;
+}
+
+static int openUnix(const char* path){
+   struct sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(address.sun_path)){
+      fprintf(stderr, "The socket path %s is too long\n", path);
+      exit(1);
+   }
+
+   strcpy(address.sun_path, path);
+   unlink(path);
+
+   int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+   int receiveBuffer = 8 << 20;
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+   if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+      fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+      exit(1);
+   }
+
+   fprintf(stderr, "listening on unix %s\n", path);
+   return fd;
+}
+
+/**
+   Read every datagram waiting on a socket, RECEIVE_BATCH at a time.
+*/
+static void receiveDatagrams(int fd, char* buffers){
+#if defined (__linux__)
+   struct mmsghdr messages[RECEIVE_BATCH];
+   struct iovec pieces[RECEIVE_BATCH];
+
+   for (;;){
+      memset(messages, 0, sizeof(messages));
+      for (int i = 0; i < RECEIVE_BATCH; i++){
+         pieces[i].iov_base = buffers + (size_t)i * RECEIVE_SIZE;
+         pieces[i].iov_len = RECEIVE_SIZE;
+         messages[i].msg_hdr.msg_iov = &pieces[i];
+         messages[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      int count = recvmmsg(fd, messages, RECEIVE_BATCH, MSG_DONTWAIT, NULL);
+      if (count <= 0){
+         return;
+      }
+
+      for (int i = 0; i < count; i++){
+         received(messages[i].msg_len);
+         parseLines((const char*)pieces[i].iov_base, messages[i].msg_len);
+      }
+
+      if (count < RECEIVE_BATCH){
+         return;
+      }
+   }
+#else
+   for (;;){
+      ssize_t length = recv(fd, buffers, RECEIVE_SIZE, MSG_DONTWAIT);
+      if (length < 0){
+         return;
+      }
+
+      received(length);
+      parseLines(buffers, length);
+   }
+#endif
+}
+
+/**
+   Read what a TCP client sent, and parse every complete line of it.
+
+   @return false once the connection is closed
+*/
+static bool receiveStream(Connection* connection){
+   ssize_t length = recv(connection->fd, connection->buffer + connection->length, CONNECTION_BUFFER_SIZE - connection->length, MSG_DONTWAIT);
+   if (length <= 0){
+      if (length < 0 && (errno == EAGAIN || errno == EINTR)){
+         return true;
+      }
+
+      //Whatever is left is a line that was never finished
+      if (connection->length > 0){
+         parseLine(connection->buffer, connection->length);
+      }
+      return false;
+   }
+
+   received(length);
+
+   //Everything before the new data has already been searched for a newline
+   char* last = NULL;
+   for (char* search = connection->buffer + connection->length + length - 1; search >= connection->buffer + connection->length; search--){
+      if (*search == '\n'){
+         last = search;
+         break;
+      }
+   }
+   connection->length += length;
+
+   if (last){
+      int complete = last - connection->buffer + 1;
+      parseLines(connection->buffer, complete);
+      memmove(connection->buffer, connection->buffer + complete, connection->length - complete);
+      connection->length -= complete;
+   }
+   else if (connection->length == CONNECTION_BUFFER_SIZE){
+      //A line that will never fit
+      lines++;
+      malformed++;
+      connection->length = 0;
+   }
+
+   return true;
+}
+
+static void stop(int signum){
+   stopping = 1;
+}
+
+static void printReport(void){
+   double elapsed = lastReceived - firstReceived;
+
+   printf("packets %llu\n", (unsigned long long)packets);
+   printf("bytes %llu\n", (unsigned long long)bytes);
+   printf("lines %llu\n", (unsigned long long)lines);
+   printf("malformed %llu\n", (unsigned long long)malformed);
+   printf("connections %llu\n", (unsigned long long)connections);
+   printf("buckets %d\n", bucketCount);
+   printf("seconds %.3f\n", elapsed);
+   printf("lines_per_second %.0f\n", elapsed > 0 ? lines / elapsed : 0.0);
+
+   //Loss is what is missing from the range of each sender's sequence
+   uint64_t received = 0;
+   uint64_t expected = 0;
+   int senders = 0;
+   for (int i = 0; i < bucketCapacity; i++){
+      if (buckets[i].name && buckets[i].sequence){
+         received += buckets[i].samples;
+         expected += buckets[i].sequenceMax - buckets[i].sequenceMin + 1;
+         senders++;
+      }
+   }
+
+   if (senders > 0){
+      uint64_t lost = expected > received ? expected - received : 0;
+      printf("senders %d\n", senders);
+      printf("sequence_received %llu\n", (unsigned long long)received);
+      printf("sequence_expected %llu\n", (unsigned long long)expected);
+      printf("sequence_lost %llu\n", (unsigned long long)lost);
+      printf("loss_percent %.4f\n", 100.0 * lost / expected);
+   }
+
+   if (!verbose){
+      return;
+   }
+
+   for (int i = 0; i < bucketCapacity; i++){
+      Bucket* bucket = &buckets[i];
+      if (!bucket->name){
+         continue;
+      }
+
+      switch (bucket->type){
+         case 'c':
+            printf("count %s %.17g\n", bucket->name, bucket->value);
+            break;
+         case 'g':
+            printf("gauge %s %.17g\n", bucket->name, bucket->value);
+            break;
+         case 's':
+            printf("set %s %d\n", bucket->name, bucket->memberCount);
+            break;
+         case 'm':
+            printf("timing %s count=%llu min=%.17g max=%.17g mean=%.17g\n", bucket->name, (unsigned long long)bucket->samples,
+               bucket->min, bucket->max, bucket->sum / bucket->samples);
+            break;
+      }
+   }
+}
+
+int main(int argc, char* argv[]){
+   parseCommandLine(argc, argv);
+
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = stop;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   //Poll slots: UDP, unix, TCP listener, then the TCP clients
+   struct pollfd fds[3 + MAX_CONNECTIONS];
+   Connection clients[MAX_CONNECTIONS];
+   int clientCount = 0;
+   int listenerCount = 0;
+   int tcpListener = -1;
+
+   if (udpAddress){
+      fds[listenerCount].fd = openInet(udpAddress, SOCK_DGRAM);
+      fds[listenerCount++].events = POLLIN;
+   }
+   if (unixPath){
+      fds[listenerCount].fd = openUnix(unixPath);
+      fds[listenerCount++].events = POLLIN;
+   }
+   if (tcpAddress){
+      tcpListener = listenerCount;
+      fds[listenerCount].fd = openInet(tcpAddress, SOCK_STREAM);
+      fds[listenerCount++].events = POLLIN;
+   }
+
+   char* buffers = (char*)malloc((size_t)RECEIVE_BATCH * RECEIVE_SIZE);
+   if (!buffers){
+      fprintf(stderr, "Unable to allocate the receive buffers\n");
+      return 1;
+   }
+
+   double started = now();
+   while (!stopping){
+      double time = now();
+      if (duration > 0 && time - started >= duration){
+         break;
+      }
+      if (idle > 0 && packets > 0 && time - lastReceived >= idle){
+         break;
+      }
+
+      for (int i = 0; i < clientCount; i++){
+         fds[listenerCount + i].fd = clients[i].fd;
+         fds[listenerCount + i].events = POLLIN;
+      }
+
+      int ready = poll(fds, listenerCount + clientCount, 100);
+      if (ready <= 0){
+         continue;
+      }
+
+      for (int i = 0; i < listenerCount; i++){
+         if (!(fds[i].revents & POLLIN)){
+            continue;
+         }
+
+         if (i != tcpListener){
+            receiveDatagrams(fds[i].fd, buffers);
+            continue;
+         }
+
+         int client = accept(fds[i].fd, NULL, NULL);
+         if (client == -1){
+            continue;
+         }
+
+         if (clientCount == MAX_CONNECTIONS){
+            close(client);
+            continue;
+         }
+
+         clients[clientCount].fd = client;
+         clients[clientCount].length = 0;
+         clients[clientCount].buffer = (char*)malloc(CONNECTION_BUFFER_SIZE);
+         if (!clients[clientCount].buffer){
+            close(client);
+            continue;
+         }
+
+         clientCount++;
+         connections++;
+      }
+
+      for (int i = clientCount - 1; i >= 0; i--){
+         if (!(fds[listenerCount + i].revents & (POLLIN | POLLHUP | POLLERR))){
+            continue;
+         }
+
+         if (!receiveStream(&clients[i])){
+            close(clients[i].fd);
+            free(clients[i].buffer);
+            clients[i] = clients[--clientCount];
+         }
+      }
+   }
+
+   //Pick up anything that arrived while stopping
+   for (int i = 0; i < listenerCount; i++){
+      if (i != tcpListener){
+         receiveDatagrams(fds[i].fd, buffers);
+      }
+   }
+
+   for (int i = 0; i < clientCount; i++){
+      receiveStream(&clients[i]);
+      close(clients[i].fd);
+      free(clients[i].buffer);
+   }
+
+   if (unixPath){
+      unlink(unixPath);
+   }
+
+   printReport();
+   free(buffers);
+   return EXIT_SUCCESS;
+}
+
+#else
+
+int main(int argc, char* argv[]){
+   fprintf(stderr, "statsd-sink is not supported on windows\n");
+   return 1;
+}
+
+#endif
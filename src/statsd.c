@@ -20,10 +20,19 @@ OR OTHER DEALINGS IN THE SOFTWARE.
 **************************************************************************************/
 
 
+//sendmmsg() is a GNU extension
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+   #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <time.h>
 
 #if defined (_WIN32)
    #include <windows.h>
@@ -34,430 +43,7850 @@ OR OTHER DEALINGS IN THE SOFTWARE.
    #include <unistd.h>
    #include <sys/types.h>
    #include <sys/socket.h>
+   #include <sys/uio.h>
+   #include <sys/un.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <netinet/tcp.h>
+   #include <fcntl.h>
+   #include <poll.h>
    #include <arpa/inet.h>
    #include <netinet/in.h>
    #include <netdb.h>
+   #include <pthread.h>
+   #include <sched.h>
+#endif
+
+#if defined (__linux__)
+   #include <sys/timerfd.h>
+#endif
+
+#if defined (__x86_64__) || defined (__i386__)
+   #include <cpuid.h>
+   #define HAVE_TSC 1
+#endif
+
+//The io_uring backend talks to the kernel directly, so it only needs the
+//kernel headers and not liburing
+#if defined (__linux__) && defined (__has_include)
+   #if __has_include(<linux/io_uring.h>)
+      #include <linux/io_uring.h>
+      #include <sys/syscall.h>
+      #if defined (__NR_io_uring_setup)
+         #define HAVE_URING 1
+      #endif
+   #endif
 #endif
 
 #include "statsd.h"
 
-//Define the private functions
-static const char *networkToPresentation(int af, const void *src, char *dst, size_t size);
-static int sendToServer(Statsd* stats, const char* bucket, StatsType type, int delta, double sampleRate);
-static int buildStatString(char* stat, const char* nameSpace, const char* bucket, StatsType type, int delta, double sampleRate);
+#define STAT_MAX_SIZE 1024
+#define FLOAT_MAX_SIZE 32
+#define RATE_SUFFIX_SIZE 16
+#define SEND_CHUNK_SIZE 256
+#define AGGREGATE_DEFAULT_CAPACITY 64
+#define SET_DEFAULT_CAPACITY 16
+#define SET_EMPTY_SLOT INT64_MIN
 
-static const char *networkToPresentation(int af, const void *src, char *dst, size_t size){
-   return inet_ntop(af, src, dst, size);
-}
+//Timing histograms keep 16 linear sub buckets for every power of 2, which
+//keeps every value within 1/32 (about 3%) of the real one. Values are in
+//microseconds. The powers up to 2^47 get their own buckets, and anything
+//from 2^48us (about 9 years) on shares the last one.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 48
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define PERCENTILE_NAME_SIZE 16
+
+//Sets switch from exact members to a HyperLogLog sketch of 2^12 one byte
+//registers (about 1.6% standard error) once they pass the threshold.
+#define SET_DEFAULT_THRESHOLD 256
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+//Sample rates are turned into a threshold out of 2^32, which is compared
+//against 32 random bits. Rates outside of (0, 1) keep everything.
+#define SAMPLE_KEEP_ALL (1ULL << 32)
+
+//Two digit lookup table used to format integers two digits at a time
+static const char digitPairs[] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
+
+//A 64 bit fixed point number, f * 2^e, used to format doubles
+typedef struct {
+   uint64_t f;
+   int e;
+} DiyFp;
+
+//Normalized powers of 10 from 10^-348 to 10^340 in steps of 8, for Grisu
+static const DiyFp cachedPowers[] = {
+   { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 }, { 0x8b16fb203055ac76ULL, -1166 },
+   { 0xcf42894a5dce35eaULL, -1140 }, { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+   { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 }, { 0xbe5691ef416bd60cULL, -1007 },
+   { 0x8dd01fad907ffc3cULL, -980 }, { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+   { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 }, { 0x823c12795db6ce57ULL, -847 },
+   { 0xc21094364dfb5637ULL, -821 }, { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+   { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 }, { 0xb23867fb2a35b28eULL, -688 },
+   { 0x84c8d4dfd2c63f3bULL, -661 }, { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+   { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 }, { 0xf3e2f893dec3f126ULL, -529 },
+   { 0xb5b5ada8aaff80b8ULL, -502 }, { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+   { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 }, { 0xa6dfbd9fb8e5b88fULL, -369 },
+   { 0xf8a95fcf88747d94ULL, -343 }, { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+   { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 }, { 0xe45c10c42a2b3b06ULL, -210 },
+   { 0xaa242499697392d3ULL, -183 }, { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+   { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 }, { 0x9c40000000000000ULL, -50 },
+   { 0xe8d4a51000000000ULL, -24 }, { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+   { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 }, { 0xd5d238a4abe98068ULL, 109 },
+   { 0x9f4f2726179a2245ULL, 136 }, { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+   { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 }, { 0x924d692ca61be758ULL, 269 },
+   { 0xda01ee641a708deaULL, 295 }, { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+   { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 }, { 0xc83553c5c8965d3dULL, 428 },
+   { 0x952ab45cfa97a0b3ULL, 455 }, { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+   { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 }, { 0x88fcf317f22241e2ULL, 588 },
+   { 0xcc20ce9bd35c78a5ULL, 614 }, { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+   { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 }, { 0xbb764c4ca7a44410ULL, 747 },
+   { 0x8bab8eefb6409c1aULL, 774 }, { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+   { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 }, { 0x80444b5e7aa7cf85ULL, 907 },
+   { 0xbf21e44003acdd2dULL, 933 }, { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+   { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 }, { 0xaf87023b9bf0ee6bULL, 1066 }
+};
+
+//The wire suffix of every stat type, with its length
+static const struct {
+   const char* suffix;
+   int length;
+} statSuffixes[] = {
+   [STATSD_NONE] = { NULL, 0 },
+   [STATSD_COUNT] = { "|c", 2 },
+   [STATSD_GAUGE] = { "|g", 2 },
+   [STATSD_SET] = { "|s", 2 },
+   [STATSD_TIMING] = { "|ms", 3 },
+   [STATSD_BATCH] = { NULL, 0 }
+};
 
 /**
-   This is a helper function that will do the dirty work of sending
-   the stats to the statsd server. 
+   A log-linear histogram of timings with a fixed size, along with the
+   exact count, minimum and maximum.
+*/
+typedef struct _statsd_histogram_t {
+   uint64_t count;
+   uint64_t min;
+   uint64_t max;
+   uint32_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
 
-   @param[in] stats - The stats client object
-   @param[in] bucket - The optional bucket name, if this is null then
-      the defualt bucket name is used from the stats object.
-   @param[in] type - The type of stat being sent
-   @param[in] delta - The value to send
-   @param[in] sampleRate - The sample rate of this stat. If the value is
-      less then or equal to 0, or greater then or equal to 1, it is ignored.
+/**
+   A single aggregated bucket. Counts are folded into a running sum,
+   gauges keep the last value seen, sets keep every unique member
+   seen since the last flush, and timings are kept in a histogram.
+   With the flush scheduler on, a dirty aggregate is also linked into
+   a slot of the timer wheel, due at the end of its flush interval.
+*/
+typedef struct _statsd_aggregate_t {
+   uint64_t hash;
+   char* bucket;
+   StatsType type;
+   StatsdTags* tags;
+   int dirty;
 
-   @return STATSD_SUCCESS on success, STATSD_BAD_STATS_TYPE if the type is 
-      not recognized. STATSD_UDP_SEND if the sendto() failed.
+   double count;
+   int64_t gauge;
+   double realGauge;
+   int fractional;
+
+   int64_t* members;
+   int memberCount;
+   int memberCapacity;
+   int hasEmptySlotMember;
+   uint8_t* registers;
+   int sketching;
+
+   Histogram* histogram;
+
+   int interval;
+   uint64_t due;
+   int next;
+} Aggregate;
+
+/**
+   A growable buffer of newline terminated stat strings, split into
+   packets that each fit in a single datagram. Packet boundaries are
+   kept as offsets since the buffer can move when it grows.
 */
-static int sendToServer(Statsd* stats, const char* bucket, StatsType type, int delta, double sampleRate){
-   //See if we randomly fall under the sample rate
-   if (sampleRate > 0 && sampleRate < 1 && (double)((double)stats->random() / RAND_MAX) >= sampleRate){
-      return STATSD_SUCCESS;
-   }
- 
-   int dataLength = 0;
-   char data[256];
-   memset(&data, 0, 256);
+typedef struct _statsd_outbox_t {
+   char* data;
+   int length;
+   int capacity;
+   int packetStart;
 
-  
-   //If the user has not specified a bucket, we will use the defualt
-   //bucket instead.
-   if (!bucket){
-      bucket = stats->bucket;
-   }
-   
-   dataLength = buildStatString(data, stats->nameSpace, bucket, type, delta, sampleRate);
+   int* packetEnds;
+   int packetCount;
+   int packetCapacity;
 
-   if (dataLength < 0){
-      return -dataLength;
-   }
+   struct iovec* iov;
+   int iovCapacity;
+} Outbox;
 
-   //Send the packet
-   int sent = sendto(stats->socketFd, data, dataLength, 0, (const struct sockaddr*)&stats->destination, sizeof(struct sockaddr_in));
+/**
+   Open addressed hash table of aggregated buckets, keyed by the
+   bucket name and stat type. The timer wheel, when there is one, holds
+   the index of the first aggregate due in each slot.
+*/
+typedef struct _statsd_aggregator_t {
+   Aggregate* entries;
+   int capacity;
+   int used;
 
-   if (sent == -1){
-      return STATSD_UDP_SEND;
-   }
+   int timings;
+   double* percentiles;
+   char (*percentileNames)[PERCENTILE_NAME_SIZE];
+   int percentileCount;
+   int timingSamples;
 
-   return STATSD_SUCCESS;
-}
+   int cardinality;
+   int setThreshold;
+
+   int* wheel;
+   uint64_t wheelTick;
+   uint64_t wheelDeadline;
+
+   Outbox outbox;
+} Aggregator;
+
+#define SHARD_POINTS 160
 
 /**
-   This is a helper function that will build up a stats string and return its
-   length. 
+   A point on the consistent hash ring, owned by one of the servers.
+*/
+typedef struct _statsd_ring_point_t {
+   uint64_t hash;
+   int server;
+} RingPoint;
 
-   @param[in,out] stat - This is where the final string will be placed
-   @param[in] nameSpace - The namespace of the stat
-   @param[in] bucket - The bucket where to put the stat
-   @param[in] type - The type of stat being packed
-   @param[in] delta - The value of the stat
-   @param[in] sampleRate - The intervals at which this data was gathered
+/**
+   The servers of a sharded client. The first server is the client
+   itself, the others are clients of their own. Every server owns
+   SHARD_POINTS points on the ring, and a stat goes to the owner of the
+   first point at or after the hash of its name. Each server has its own
+   outbox, so stats are regrouped into full packets per server.
+*/
+typedef struct _statsd_shards_t {
+   Statsd** servers;
+   Outbox* outboxes;
+   int count;
 
-   @return The length of the stat string, or -1 on error
+   RingPoint* ring;
+   int ringSize;
+} Shards;
+
+//What happened to a datagram the socket did not take
+#define SEND_RETRY 0
+#define SEND_QUEUED 1
+#define SEND_DROPPED 2
+
+#define SPILL_DEFAULT_SIZE (1 << 16)
+#define BLOCK_DEFAULT_TIMEOUT 10
+
+/**
+   Datagrams that did not fit in the socket buffer, waiting to be sent.
+   Datagrams are taken from start and added at length, and the queue is
+   moved back to the front of the buffer when it runs out of room.
 */
-static int buildStatString(char* stat, const char* nameSpace, const char* bucket, StatsType type, int delta, double sampleRate){
-   char* statType = NULL;
-   char bucketName [128];
-   int statLength = 0;
+typedef struct _statsd_spill_t {
+   char* data;
+   int start;
+   int length;
+   int capacity;
+} Spill;
 
-   //Build up the bucket name, with the nameSpace.
-   if (nameSpace){
-      sprintf(bucketName, "%s.%s", nameSpace, bucket);
-   }
-   else {
-      sprintf(bucketName, "%s", bucket);
-   }
+//The client reports on itself at most this often, in seconds
+#define SELF_REPORT_INTERVAL 10
 
-   //Figure out what type of message to generate
-   switch(type){
-      case STATSD_COUNT:
-         statType = "c";
-         break;
-      case STATSD_GAUGE:
-         statType = "g";
-         break;
-      case STATSD_SET:
-         statType = "s";
-         break;
-      case STATSD_TIMING:
-         statType = "ms";
-         break;
-      default:
-         return -STATSD_BAD_STATS_TYPE;
-   }
+//How long the time stamp counter is measured for to find its rate
+#define TSC_CALIBRATION_MILLIS 10
 
-   //Do we have a sample rate?
-   if (sampleRate > 0.0 && sampleRate < 1.0){
-      sprintf(stat, "%s:%d|%s|@%.2f", bucketName, delta, statType, sampleRate);
-   }
-   else {
-      sprintf(stat, "%s:%d|%s", bucketName, delta, statType);
-   }
+/**
+   What the client last reported about itself, so that each report only
+   sends what changed since the one before it.
+*/
+typedef struct _statsd_self_report_t {
+   char* nameSpace;
+   time_t reportedAt;
+   StatsdInternalStats reported;
+} SelfReport;
 
-   statLength = strlen(stat);
-   return statLength;
-}
+#define CONCURRENT_DEFAULT_INTERVAL 1000
+#define CACHE_LINE_SIZE 64
 
+//The clock background threads time their waits on, so setting the wall
+//clock does not stall or hurry them. Darwin can't change the clock of a
+//condition variable.
+#if defined (__APPLE__)
+   #define WAIT_CLOCK CLOCK_REALTIME
+#else
+   #define WAIT_CLOCK CLOCK_MONOTONIC
+#endif
 
-//Implement the public functions
+//Who is working on the current buffer of a stage
+#define STAGE_IDLE 0
+#define STAGE_OWNER 1
+#define STAGE_FLUSHER 2
 
+#if !defined (_WIN32)
 /**
-   This is allocate the memory for a statsd object from the heap
-   initialize it with the givin values and return the newly constructed
-   object ready for use. 
+   A staging buffer that a single thread fills with newline terminated
+   stat strings. Once it is full it is handed off to the flusher thread,
+   which sends it and hands it back to the thread through its stage.
+*/
+typedef struct _statsd_stage_buffer_t {
+   struct _statsd_stage_buffer_t* next;
+   struct _statsd_stage_t* stage;
+   int length;
+   char data[];
+} StageBuffer;
 
-   @param[out] stats - This is where the statsd object will be placed.
-   @param[in] serverAddress - The hostname, or ip address of the statsd server
-   @param[in] port - The port number to use for statsd packets
-   @param[in] bucket - The unique bucket name to use for reporting stats
+/**
+   The per thread state of a concurrent client. The current buffer is
+   filled by the thread that owns the stage, but the flusher can take it
+   from a thread that has gone quiet, so either side first claims the
+   stage by swapping state from STAGE_IDLE. handOffs counts the buffers
+   taken from the stage, which tells the flusher if one has been sitting
+   there for a whole interval. The spare buffer is handed back with an
+   atomic exchange. Stages are aligned to a cache line so neighbouring
+   threads never share one.
+*/
+typedef struct _statsd_stage_t {
+   StageBuffer* current;
+   StageBuffer* spare;
+   int state;
+   unsigned handOffs;
+   unsigned seenHandOffs;
+   int inUse;
+   struct _statsd_concurrent_t* owner;
+   struct _statsd_stage_t* next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Stage;
 
-   @return STATSD_SUCCESS on success, or an error if something went wrong
-   @see StatsError
+/**
+   State of the concurrent mode. Full buffers are pushed onto a lock free
+   stack by the producing threads, and the flusher thread takes the whole
+   stack at once, so there is only ever one consumer.
 */
-int ADDCALL statsd_new(Statsd** stats, const char* serverAddress, int port, const char* nameSpace, const char* bucket){
-   Statsd* newStats = (Statsd*)malloc(sizeof(Statsd));
-   if (!newStats){
-      return STATSD_MALLOC;
-   }
+typedef struct _statsd_concurrent_t {
+   pthread_key_t key;
+   pthread_t flusher;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   int running;
+   int interval;
+   int packetSize;
+   Stage* stages;
 
-   memset(newStats, 0, sizeof(Statsd));
-   newStats->socketFd = -1;
-   *stats = newStats;
-   return statsd_init(*stats, serverAddress, port, nameSpace, bucket);
-}
+   struct iovec* iov;
+   int* parts;
+   int iovCapacity;
+   StageBuffer* queue __attribute__((aligned(CACHE_LINE_SIZE)));
+} Concurrent;
+
+#define STREAM_DEFAULT_CAPACITY (1 << 16)
+#define STREAM_MIN_BACKOFF 100
+#define STREAM_MAX_BACKOFF 30000
 
 /**
-   Free a statsd object created through a call to statsd_new()
+   State of the TCP transport. Stats are copied into a ring buffer as
+   newline terminated lines, and written to the non-blocking socket as
+   they fit. head and tail count every byte ever added and written, so
+   their difference is the data waiting to be written. When the
+   connection drops, the socket is reconnected after a delay that doubles
+   with every failure.
+*/
+typedef struct _statsd_stream_t {
+   char* ring;
+   uint64_t capacity;
+   uint64_t head;
+   uint64_t tail;
+   int partial;
+   int connecting;
+   int backoff;
+   uint64_t retryAt;
+   StatsdOverflow overflow;
+} Stream;
 
-   @param[in] statsd - The statsd object created by a call to
-      statsd_new(). 
+#define SHM_DEFAULT_CAPACITY (1 << 20)
+#define SHM_MIN_CAPACITY (1 << 16)
+#define SHM_MAX_CAPACITY (1 << 30)
+#define SHM_MAGIC 0x73746473
+#define SHM_VERSION 1
+#define SHM_ALIGN 8
+#define SHM_RECORD_BUSY 0x80000000u
+#define SHM_RECORD_SKIP 0x40000000u
+#define SHM_RECORD_LENGTH 0x3fffffffu
+#define SHM_OPEN_MILLIS 1000
+#define SHM_STALL_MILLIS 5000
+#define DRAIN_BUFFER_SIZE (1 << 16)
+
+/**
+   The start of a shared memory ring, which the ring itself follows. Any
+   number of processes append records and a single drain reads them. head
+   and tail count every byte ever reserved and read, and a producer
+   reserves space by moving head forward with a compare and swap, so
+   nothing on the sending side makes a system call. The drop counters
+   are shared by every producer.
 */
-void ADDCALL statsd_free(Statsd* statsd){
-   if(!statsd)
-      return;
+typedef struct _statsd_shm_header_t {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t capacity;
+   uint64_t dropped;
+   uint64_t droppedBytes;
+   uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+   uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE))) ShmHeader;
 
-   statsd_release(statsd);
-   free(statsd);
-}
+/**
+   A mapping of a shared memory ring. Each record in the ring is one
+   datagram, starting on an 8 byte boundary with a 32 bit word that holds
+   its length. The word is 0 until the record is reserved, has the busy
+   bit while the record is being copied in, and is cleared by the drain
+   along with the rest of the record once it has been read. A record that
+   would run past the end of the ring goes at the start instead, and the
+   space it leaves is marked with a skip record.
+*/
+typedef struct _statsd_shm_t {
+   ShmHeader* header;
+   char* ring;
+   uint64_t capacity;
+   size_t mappedSize;
+} ShmRing;
 
 /**
-   Free the resources in a statsd object initialized through a
-      call to statsd_init()
+   The reading end of a shared memory ring. Records are copied out into
+   the buffer as lines, and forwarded a buffer at a time. A record that
+   stays unfinished for SHM_STALL_MILLIS belongs to a producer that died
+   while writing it, and is thrown away.
+*/
+struct _statsd_drain_t {
+   ShmRing ring;
+   char* buffer;
+   int bufferSize;
+   uint64_t stalledAt;
+   uint64_t stalledSince;
+   int stalled;
+};
+#endif
 
-   @param[in] statsd - The statsd object initialized by a call
-      to statsd_init().
+#if defined (HAVE_URING)
+#define URING_DEFAULT_DEPTH 64
+#define URING_MAX_DEPTH 4096
+
+/**
+   State of the io_uring send backend. Every datagram is copied into one of
+   depth buffers, carved out of a single block that is registered with the
+   kernel along with the socket, and sent with a fixed buffer write. The
+   buffers that are not in flight are kept on a stack, and go back on it as
+   the completions are reaped. The ring layout comes from the kernel.
 */
-void ADDCALL statsd_release(Statsd* statsd){
-   if(!statsd)
-      return;
+typedef struct _statsd_uring_t {
+   int fd;
+   unsigned* sqHead;
+   unsigned* sqTail;
+   unsigned sqMask;
+   unsigned* sqArray;
+   struct io_uring_sqe* sqes;
+   unsigned* cqHead;
+   unsigned* cqTail;
+   unsigned cqMask;
+   struct io_uring_cqe* cqes;
 
-   if (statsd->socketFd > 0){
-      close(statsd->socketFd);
-      statsd->socketFd = -1;
-   }
+   void* sqRing;
+   size_t sqRingSize;
+   void* cqRing;
+   size_t cqRingSize;
+   size_t sqesSize;
+
+   char* buffers;
+   int bufferSize;
+   int depth;
+   int* free;
+   int freeCount;
+   int* lengths;
+} Uring;
+#endif
+
+#define SCHEDULER_DEFAULT_LATENCY 100
+#define SCHEDULER_DEFAULT_INTERVAL 1000
+#define WHEEL_SLOTS 512
+#define WHEEL_TICK 10
+#define NO_DEADLINE UINT64_MAX
+
+#if !defined (_WIN32)
+/**
+   A flush interval for one bucket, overriding the interval of its type.
+*/
+typedef struct _statsd_bucket_interval_t {
+   char* bucket;
+   StatsType type;
+   int interval;
+} BucketInterval;
+
+/**
+   State of the flush scheduler. The batch is sent once it holds threshold
+   bytes or its first stat is maxLatency milliseconds old. Aggregates are
+   flushed on the boundaries of their interval by a hashed timer wheel of
+   WHEEL_SLOTS slots, WHEEL_TICK milliseconds each, kept in the aggregator.
+   wakeAt is the deadline the timer fd or the background thread is waiting
+   for, so they are only woken early when something is due sooner.
+*/
+typedef struct _statsd_scheduler_t {
+   int maxLatency;
+   int threshold;
+   uint64_t batchDeadline;
+   int intervals[STATSD_TIMING + 1];
+   BucketInterval* overrides;
+   int overrideCount;
+
+   uint64_t wakeAt;
+   int timerFd;
+
+   int background;
+   int running;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+} Scheduler;
+#endif
+
+//Define the private functions
+static const char *networkToPresentation(int af, const void *src, char *dst, size_t size);
+static int sendToServer(Statsd* stats, const char* bucket, StatsType type, int64_t delta, double sampleRate, const StatsdTags* tags);
+static int sendDoubleToServer(Statsd* stats, const char* bucket, StatsType type, double value, double sampleRate, const StatsdTags* tags);
+static int sendStat(Statsd* stats, const char* data, int length);
+static int sendDatagram(Statsd* stats, const char* data, int length);
+static int openInetSocket(Statsd* stats, const char* server, int port);
+static int openUnixSocket(Statsd* stats, const char* path);
+static int recoverSocket(Statsd* stats, int error);
+static void setNonBlocking(int socketFd);
+static int formatInteger(char* out, long long value);
+static DiyFp multiplyDiyFp(DiyFp x, DiyFp y);
+static void roundDigits(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance);
+static int grisuDigits(double value, char* digits, int* exponent);
+static int formatDouble(char* out, double value);
+static const char* sampleRateSuffix(double sampleRate, int* length);
+static uint64_t sampleThreshold(double sampleRate);
+static uint64_t seedSampler(void);
+static uint32_t nextSample(Statsd* stats, const char* bucket, uint64_t bucketHash);
+static int sampledOut(Statsd* stats, const char* bucket, uint64_t bucketHash, uint64_t threshold);
+static int buildStatString(char* stat, int size, const char* nameSpace, const char* bucket, StatsType type, long long delta, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags);
+static int buildStatValue(char* stat, int size, const char* nameSpace, const char* bucket, StatsType type, const char* value, int valueLength, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags);
+static int formatMillis(char* out, uint64_t micros);
+static int tagsLength(const StatsdTags* defaults, const StatsdTags* tags);
+static void writeTags(char* out, const StatsdTags* defaults, const StatsdTags* tags);
+static int sameTags(const StatsdTags* a, const StatsdTags* b);
+static int copyTags(const StatsdTags* tags, StatsdTags** copy);
+static int sendTiming(Statsd* stats, const char* bucket, uint64_t micros, double sampleRate, const StatsdTags* tags);
+static uint64_t readClock(StatsdClock clock);
+static uint64_t clockMicros(StatsdClock clock, uint64_t elapsed);
+#if defined (HAVE_TSC)
+static int invariantTsc(void);
+static double calibrateTsc(void);
+#endif
+static int buildMetricString(char* stat, int size, const StatsdMetric* metric, long long value);
+static int buildMetricValue(char* stat, int size, const StatsdMetric* metric, const char* value, int valueLength);
+static int batchValue(Statsd* statsd, StatsType type, const char* bucket, const char* value, int valueLength, double sampleRate, const StatsdTags* tags);
+static int batchMetricValue(StatsdMetric* metric, const char* value, int valueLength);
+static int sendPackets(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report);
+static int sendDirect(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report);
+static uint64_t hashName(const char* name, int length);
+static int compareRingPoints(const void* a, const void* b);
+static Statsd* findShard(const Shards* shards, const char* line, int length);
+static int sendSharded(Statsd* stats, const struct iovec* iov, const int* parts, int count, StatsdSendReport* report);
+static void drainQueues(Statsd* stats);
+static void freeShards(Shards* shards);
+static int wouldBlock(int error);
+static void countStat(Statsd* stats, uint64_t* counter, uint64_t amount);
+static uint64_t countLines(const struct iovec* pieces, int count, uint64_t* bytes);
+static void countSent(Statsd* stats, const struct iovec* pieces, int count, int datagram);
+static void countCall(Statsd* stats, uint64_t started, int failed);
+static uint64_t monotonicNanos(void);
+static void reportSelf(Statsd* stats);
+static void countDropped(Statsd* stats, const struct iovec* pieces, int count);
+static int sendFailed(Statsd* stats, const struct iovec* pieces, int count, int error, int attempt);
+static int spillDatagram(Statsd* stats, const struct iovec* pieces, int count);
+static int drainSpill(Statsd* stats);
+static void freeSpill(Statsd* stats);
+static int splitLines(const char* lines, int length, int packetSize, struct iovec* iov, int max);
+static int reserveIov(struct iovec** iov, int** parts, int* capacity, int count);
+static int outboxReserve(Outbox* outbox, int length);
+static int outboxCommit(Outbox* outbox, int length, int packetSize);
+static int outboxStat(Outbox* outbox, const char* nameSpace, const char* bucket, StatsType type, long long value, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags, int packetSize);
+static int outboxValue(Outbox* outbox, const char* nameSpace, const char* bucket, StatsType type, const char* value, int valueLength, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags, int packetSize);
+static int sendOutbox(Statsd* stats, Outbox* outbox, StatsdSendReport* report);
+static int outboxPackets(Outbox* outbox);
+static void outboxClear(Outbox* outbox);
+static uint64_t hashBucket(const char* bucket, StatsType type);
+static int growAggregator(Aggregator* aggregator);
+static Aggregate* findAggregate(Aggregator* aggregator, const char* bucket, StatsType type, const StatsdTags* tags);
+static int addSetMember(Aggregate* entry, int64_t member);
+static int aggregate(Statsd* stats, const char* bucket, StatsType type, int64_t value, double sampleRate, const StatsdTags* tags);
+static int aggregateDouble(Statsd* stats, const char* bucket, StatsType type, double value, double sampleRate, const StatsdTags* tags);
+static uint64_t mixHash(uint64_t value);
+static void sketchMember(Aggregate* entry, int64_t member);
+static int startSketch(Aggregate* entry);
+static uint64_t estimateCardinality(const Aggregate* entry);
+static int histogramIndex(uint64_t value);
+static uint64_t histogramValue(int index);
+static uint64_t histogramPercentile(const Histogram* histogram, double percentile);
+static uint64_t millisToMicros(int64_t millis);
+static uint64_t realMillisToMicros(double millis);
+static int recordTiming(Aggregate* entry, uint64_t micros, double sampleRate);
+static int flushTiming(Statsd* stats, Aggregate* entry);
+static int flushEntry(Statsd* stats, Aggregate* entry);
+static int sendAggregates(Statsd* stats, int ret);
+static int flushAggregates(Statsd* stats);
+static void freeAggregator(Aggregator* aggregator);
+static void markDirty(Statsd* stats, Aggregate* entry);
+static void linkWheel(Aggregator* aggregator, Aggregate* entry);
+static void rebuildWheel(Aggregator* aggregator);
+static void lockClient(Statsd* stats);
+static void unlockClient(Statsd* stats);
+#if !defined (_WIN32)
+static Stage* registerStage(Concurrent* concurrent);
+static void releaseStage(void* data);
+static StageBuffer* takeBuffer(Stage* stage, int packetSize);
+static void handOff(Concurrent* concurrent, StageBuffer* buffer);
+static void claimStage(Stage* stage, int claimant);
+static int tryClaimStage(Stage* stage, int claimant);
+static void unclaimStage(Stage* stage);
+static void collectStages(Concurrent* concurrent, int force);
+static int stageStat(Statsd* stats, const char* stat, int length);
+static void sendStaged(Statsd* stats, StageBuffer* buffers);
+static void initWaitCond(pthread_cond_t* cond);
+static void waitDeadline(struct timespec* deadline, uint64_t millis);
+static void* flusherThread(void* data);
+static uint64_t monotonicMillis(void);
+static void streamConnect(Statsd* stats);
+static void streamDisconnect(Statsd* stats);
+static int streamAppend(Statsd* stats, const struct iovec* pieces, int count);
+static void streamWrite(Statsd* stats);
+static int streamSend(Statsd* stats, const struct iovec* iov, const int* parts, int count, int force, StatsdSendReport* report);
+static int openRing(ShmRing* ring, const char* name, uint64_t capacity);
+static void closeRing(ShmRing* ring);
+static int ringAppend(ShmRing* ring, const struct iovec* pieces, int count);
+static void ringRelease(ShmRing* ring, uint64_t from, uint64_t to);
+static int shmSend(Statsd* stats, const struct iovec* iov, const int* parts, int count, StatsdSendReport* report);
+#endif
+static int openShm(Statsd* stats, const char* name);
+#if defined (HAVE_URING)
+static int uringSetup(Statsd* stats, int depth);
+static void uringFree(Statsd* stats);
+static int uringEnter(Statsd* stats, int wait);
+static int uringReap(Statsd* stats, int* firstError);
+static int uringSend(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report);
+#endif
+#if !defined (_WIN32)
+static int startWheel(Statsd* stats);
+static int aggregateInterval(const Scheduler* scheduler, const Aggregate* entry);
+static void scheduleAggregate(Statsd* stats, Aggregate* entry, uint64_t now);
+static int scheduleBatch(Statsd* stats);
+static int runDue(Statsd* stats, uint64_t now);
+static uint64_t nextDeadline(Statsd* stats);
+static void armScheduler(Statsd* stats, uint64_t deadline);
+static void* schedulerThread(void* data);
+#endif
+static int openTcpSocket(Statsd* stats, const char* server, int port);
+
+static const char *networkToPresentation(int af, const void *src, char *dst, size_t size){
+   return inet_ntop(af, src, dst, size);
 }
 
 /**
-   This will initialize (or reinitialize) a statsd object that
-   has already been created by a call to statsd_new() or has been
-   allocated statically on the stack. 
+   Open a UDP socket connected to a host name, IPv4 or IPv6 address.
 
-   @param[in,out] statsd - A previously allocated statsd object
-   @param[in] server - The hostname or ip address of the server
-   @param[in] port - The port number that the packets will be sent to
-   @param[in] bucket - The default bucket name that will be used for 
-      the stats
+   @param[in,out] stats - The stats client object
+   @param[in] server - The host name or address of the server
+   @param[in] port - The port of the server
 
-   @return SCTE_SUCCESS on success, or an error otherwise
-   @see StatsError
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the name
+      could not be looked up, STATSD_SOCKET if no socket could be opened,
+      STATSD_NTOP if the address could not be made readable.
 */
-int ADDCALL statsd_init(Statsd* statsd, const char* server, int port, const char* nameSpace, const char* bucket){
+static int openInetSocket(Statsd* stats, const char* server, int port){
    //Do a DNS lookup (or IP address conversion) for the serverAddress
    struct addrinfo hints, *result = NULL;
    memset(&hints, 0, sizeof(hints));
 
-   //Set the hints to narrow downs the DNS entry we want
-   hints.ai_family = AF_INET;
+   //Set the hints to narrow downs the DNS entry we want. Both IPv4 and
+   //IPv6 addresses are accepted.
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_DGRAM;
 
    int addrinfoStatus = getaddrinfo(server, NULL, &hints, &result);
    if (addrinfoStatus != 0){
       return STATSD_BAD_SERVER_ADDRESS;
    }
 
-   //Copy the result into the UDP destination socket structure
-   memcpy(&statsd->destination, result->ai_addr, sizeof(struct sockaddr_in));
-   statsd->destination.sin_port = htons((short)port);
+   //Open and connect a socket to the first address that works. Connecting
+   //the datagram socket means the route to the server is looked up once,
+   //instead of on every send.
+   for (struct addrinfo* address = result; address; address = address->ai_next){
+      if (address->ai_addrlen > sizeof(stats->destination)){
+         continue;
+      }
 
-   statsd->serverAddress = server;
-   statsd->port = port;
-   statsd->nameSpace = nameSpace;
-   statsd->bucket = bucket;
-   statsd->random = rand;
+      memcpy(&stats->destination, address->ai_addr, address->ai_addrlen);
+      stats->destinationLength = address->ai_addrlen;
+      if (address->ai_family == AF_INET6){
+         ((struct sockaddr_in6*)&stats->destination)->sin6_port = htons((unsigned short)port);
+      }
+      else {
+         ((struct sockaddr_in*)&stats->destination)->sin_port = htons((unsigned short)port);
+      }
+
+      stats->socketFd = socket(address->ai_family, SOCK_DGRAM, 0);
+      if (stats->socketFd == -1){
+         continue;
+      }
+
+      setNonBlocking(stats->socketFd);
+
+      if (connect(stats->socketFd, (const struct sockaddr*)&stats->destination, stats->destinationLength) == 0){
+         break;
+      }
+
+      close(stats->socketFd);
+      stats->socketFd = -1;
+   }
 
    //Free the result now that we have copied the data out of it.
    freeaddrinfo(result);
 
-   //Store the IP address in readable form
-   if (networkToPresentation(AF_INET, &statsd->destination.sin_addr, statsd->ipAddress, sizeof(statsd->ipAddress)) == NULL){
-      return STATSD_NTOP;
+   if (stats->socketFd == -1){
+      return STATSD_SOCKET;
    }
-  
-   // Check to see if there is already an open socket, and close it
-   if (statsd->socketFd > 0){
-      close(statsd->socketFd);
-      statsd->socketFd = -1;
+
+   //Store the IP address in readable form
+   const void* address = &((struct sockaddr_in*)&stats->destination)->sin_addr;
+   if (stats->destination.ss_family == AF_INET6){
+      address = &((struct sockaddr_in6*)&stats->destination)->sin6_addr;
    }
 
-   //Open up the socket file descriptor
-   statsd->socketFd = socket(AF_INET, SOCK_DGRAM, 0);
-   if (statsd->socketFd == -1){
-      return STATSD_SOCKET;
+   if (networkToPresentation(stats->destination.ss_family, address, stats->ipAddress, sizeof(stats->ipAddress)) == NULL){
+      return STATSD_NTOP;
    }
-   
+
    return STATSD_SUCCESS;
 }
 
 /**
-   Increment the bucket value by 1
+   Open a datagram socket connected to a unix domain socket path. The
+   server does not have to be listening yet, the socket is connected again
+   the first time a send fails.
 
-   @param[in] stats - The statsd client object
-   @param[in] bucket - The optional bucket name. If this is not
-      provided, the default bucket will be used from the statsd
-      object.
+   @param[in,out] stats - The stats client object
+   @param[in] path - The path of the server's socket
 
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the path
+      is empty or too long, STATSD_SOCKET if the socket could not be opened.
 */
-int ADDCALL statsd_increment(Statsd* stats, const char* bucket){
-   return sendToServer(stats, bucket, STATSD_COUNT, 1, 1);   
-}
+static int openUnixSocket(Statsd* stats, const char* path){
+#if defined (_WIN32)
+   return STATSD_BAD_SERVER_ADDRESS;
+#else
+   struct sockaddr_un* address = (struct sockaddr_un*)&stats->destination;
+   size_t pathLength = strlen(path);
+   if (pathLength == 0 || pathLength >= sizeof(address->sun_path) || pathLength >= sizeof(stats->ipAddress)){
+      return STATSD_BAD_SERVER_ADDRESS;
+   }
 
-/**
-   Decrement the bucket value by 1
+   memset(address, 0, sizeof(struct sockaddr_un));
+   address->sun_family = AF_UNIX;
+   memcpy(address->sun_path, path, pathLength + 1);
+   stats->destinationLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + pathLength + 1);
 
-   @param[in] stats - The statsd client object
-   @param[in] bucket - The optional bucket name. If this is not
-      provided, the defualt bucket will be used from the statsd
-      object.
-   
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
-*/
-int ADDCALL statsd_decrement(Statsd* stats, const char* bucket){
-   return sendToServer(stats, bucket, STATSD_COUNT, -1, 1);   
-}
+   stats->socketFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+   if (stats->socketFd == -1){
+      return STATSD_SOCKET;
+   }
 
-/**
-   Add a count value to the bucket
+   setNonBlocking(stats->socketFd);
 
-   @param[in] stats - The statsd client object.
-   @param[in] bucket - The optional bucket name. If this is
-      not provided, the default bucket will be used from the
-      statsd object.
-   @param[in] count - The value to increment (or decrement) the bucket
-      by. If the value is negative, it will be decremented.
-   @param[in] sampleRate - The sample rate of this statistic. If you specify
-      a value 0 or less, or 1 or more then this value is ignored. Otherwise
-      this value is sent on to the server.
+   //A missing or restarting server is not an error here, sending will
+   //try to connect again.
+   connect(stats->socketFd, (const struct sockaddr*)&stats->destination, stats->destinationLength);
 
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
-*/
-int ADDCALL statsd_count(Statsd* stats, const char* bucket, int count, double sampleRate){
-   return sendToServer(stats, bucket, STATSD_COUNT, count, sampleRate);
+   memcpy(stats->ipAddress, path, pathLength + 1);
+   return STATSD_SUCCESS;
+#endif
 }
 
 /**
-   Sets the value of a bucket to an arbitrary value
+   Set up the TCP transport. The server is looked up once, and the
+   connection is started without waiting for it to complete.
 
-   @param[in] stats - The statsd client object.
-   @param[in] bucket - The optional bucket name. If this is
-      not provided, the default bucket will be used from the 
-      statsd object.
-   @param[in] value - The value to set the bucket to.
+   @param[in,out] stats - The stats client object
+   @param[in] server - The host name or address of the server
+   @param[in] port - The port of the server
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the name
+      could not be looked up, STATSD_MALLOC if the buffer could not be
+      allocated, STATSD_NTOP if the address could not be made readable.
+*/
+static int openTcpSocket(Statsd* stats, const char* server, int port){
+#if defined (_WIN32)
+   return STATSD_BAD_SERVER_ADDRESS;
+#else
+   struct addrinfo hints, *result = NULL;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   if (getaddrinfo(server, NULL, &hints, &result) != 0){
+      return STATSD_BAD_SERVER_ADDRESS;
+   }
+
+   if (result->ai_addrlen > sizeof(stats->destination)){
+      freeaddrinfo(result);
+      return STATSD_BAD_SERVER_ADDRESS;
+   }
+
+   memcpy(&stats->destination, result->ai_addr, result->ai_addrlen);
+   stats->destinationLength = result->ai_addrlen;
+   freeaddrinfo(result);
+
+   const void* address = &((struct sockaddr_in*)&stats->destination)->sin_addr;
+   if (stats->destination.ss_family == AF_INET6){
+      ((struct sockaddr_in6*)&stats->destination)->sin6_port = htons((unsigned short)port);
+      address = &((struct sockaddr_in6*)&stats->destination)->sin6_addr;
+   }
+   else {
+      ((struct sockaddr_in*)&stats->destination)->sin_port = htons((unsigned short)port);
+   }
+
+   if (networkToPresentation(stats->destination.ss_family, address, stats->ipAddress, sizeof(stats->ipAddress)) == NULL){
+      return STATSD_NTOP;
+   }
+
+   Stream* stream = (Stream*)calloc(1, sizeof(Stream));
+   if (!stream){
+      return STATSD_MALLOC;
+   }
+
+   stream->ring = (char*)malloc(STREAM_DEFAULT_CAPACITY);
+   if (!stream->ring){
+      free(stream);
+      return STATSD_MALLOC;
+   }
+
+   stream->capacity = STREAM_DEFAULT_CAPACITY;
+   stream->backoff = STREAM_MIN_BACKOFF;
+   stream->overflow = STATSD_OVERFLOW_DROP_NEWEST;
+   stats->stream = stream;
+
+   streamConnect(stats);
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Set up the shared memory transport. The ring is created if no producer
+   or drain has made it yet, so the drain does not have to be running.
+
+   @param[in,out] stats - The stats client object
+   @param[in] name - The name of the ring in /dev/shm
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the name
+      is not a valid ring name, STATSD_SOCKET if the ring could not be
+      opened, STATSD_MALLOC if out of memory.
+*/
+static int openShm(Statsd* stats, const char* name){
+#if defined (_WIN32)
+   return STATSD_BAD_SERVER_ADDRESS;
+#else
+   ShmRing* shm = (ShmRing*)calloc(1, sizeof(ShmRing));
+   if (!shm){
+      return STATSD_MALLOC;
+   }
+
+   int ret = openRing(shm, name, SHM_DEFAULT_CAPACITY);
+   if (ret != STATSD_SUCCESS){
+      free(shm);
+      return ret;
+   }
+
+   snprintf(stats->ipAddress, sizeof(stats->ipAddress), "%s", name);
+   stats->shm = shm;
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Put a socket in non-blocking mode, so a full socket buffer is reported
+   instead of stalling the caller.
+*/
+static void setNonBlocking(int socketFd){
+#if defined (_WIN32)
+   u_long enabled = 1;
+   ioctlsocket(socketFd, FIONBIO, &enabled);
+#else
+   fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+/**
+   Try to recover the socket after a send failed, and say if the send
+   should be tried again. A connected UDP socket reports an earlier ICMP
+   port unreachable on the next send (usually because the server was
+   restarted), and that send does not go out. A unix domain socket has to
+   be connected again when the server was not there yet, or has been
+   restarted and bound a new socket to the same path.
+
+   @param[in] stats - The stats client object
+   @param[in] error - The errno of the failed send
+
+   @return 1 if the send should be tried again, 0 otherwise
+*/
+static int recoverSocket(Statsd* stats, int error){
+#if !defined (_WIN32)
+   if (stats->destination.ss_family == AF_UNIX){
+      if (error != ECONNREFUSED && error != ENOTCONN && error != ENOENT && error != EDESTADDRREQ){
+         return 0;
+      }
+
+      //Connecting a datagram socket again replaces the old peer
+      return connect(stats->socketFd, (const struct sockaddr*)&stats->destination, stats->destinationLength) == 0;
+   }
+#endif
+
+   return error == ECONNREFUSED;
+}
+
+/**
+   This is a helper function that will do the dirty work of sending
+   the stats to the statsd server. 
+
+   @param[in] stats - The stats client object
+   @param[in] bucket - The optional bucket name, if this is null then
+      the defualt bucket name is used from the stats object.
+   @param[in] type - The type of stat being sent
+   @param[in] delta - The value to send
+   @param[in] sampleRate - The sample rate of this stat. If the value is
+      less then or equal to 0, or greater then or equal to 1, it is ignored.
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_STATS_TYPE if the type is 
+      not recognized. STATSD_UDP_SEND if the send() failed.
+*/
+static int sendToServer(Statsd* stats, const char* bucket, StatsType type, int64_t delta, double sampleRate, const StatsdTags* tags){
+   int dataLength = 0;
+   char data[STAT_MAX_SIZE];
+
+   //If the user has not specified a bucket, we will use the defualt
+   //bucket instead.
+   if (!bucket){
+      bucket = stats->bucket;
+   }
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(stats, bucket, 0, sampleThreshold(sampleRate))){
+      return STATSD_SUCCESS;
+   }
+
+   //Fold the stat into the local aggregates instead of sending it
+   //right away. Timings are only aggregated if asked for.
+   if (stats->aggregator && (type != STATSD_TIMING || stats->aggregator->timings)){
+      lockClient(stats);
+      int ret = aggregate(stats, bucket, type, delta, sampleRate, tags);
+      unlockClient(stats);
+      return ret;
+   }
+   
+   dataLength = buildStatString(data, sizeof(data), stats->nameSpace, bucket, type, delta, sampleRate, stats->tags, tags);
+
+   if (dataLength < 0){
+      return -dataLength;
+   }
+
+   countStat(stats, &stats->counters.serialized, 1);
+   return sendStat(stats, data, dataLength);
+}
+
+/**
+   The same as sendToServer(), for a floating point value. The value is
+   written in the shortest form that reads back as the same double.
+
+   @param[in] stats - The stats client object
+   @param[in] bucket - The bucket, or NULL for the default bucket
+   @param[in] type - The type of stat being sent
+   @param[in] value - The value to send
+   @param[in] sampleRate - The sample rate of this stat
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, STATSD_BAD_STATS_TYPE if the type is not recognized,
+      STATSD_UDP_SEND if the send() failed.
+*/
+static int sendDoubleToServer(Statsd* stats, const char* bucket, StatsType type, double value, double sampleRate, const StatsdTags* tags){
+   if (!isfinite(value)){
+      return STATSD_BAD_VALUE;
+   }
+
+   if (!bucket){
+      bucket = stats->bucket;
+   }
+
+   if (sampledOut(stats, bucket, 0, sampleThreshold(sampleRate))){
+      return STATSD_SUCCESS;
+   }
+
+   if (stats->aggregator && (type != STATSD_TIMING || stats->aggregator->timings)){
+      lockClient(stats);
+      int ret = aggregateDouble(stats, bucket, type, value, sampleRate, tags);
+      unlockClient(stats);
+      return ret;
+   }
+
+   char data[STAT_MAX_SIZE];
+   char digits[FLOAT_MAX_SIZE];
+   int valueLength = formatDouble(digits, value);
+   int dataLength = buildStatValue(data, sizeof(data), stats->nameSpace, bucket, type, digits, valueLength, sampleRate, stats->tags, tags);
+   if (dataLength < 0){
+      return -dataLength;
+   }
+
+   countStat(stats, &stats->counters.serialized, 1);
+   return sendStat(stats, data, dataLength);
+}
+
+/**
+   Send a single stat string to the server in its own datagram, or
+   stage it for the flusher thread in concurrent mode.
+
+   @param[in] stats - The stats client object
+   @param[in] data - The stat string
+   @param[in] length - The length of the stat string
+
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if the send() failed.
+*/
+static int sendStat(Statsd* stats, const char* data, int length){
+#if !defined (_WIN32)
+   //In concurrent mode the flusher thread owns the socket
+   if (stats->concurrent){
+      return stageStat(stats, data, length);
+   }
+#endif
+
+   lockClient(stats);
+   int ret = sendDatagram(stats, data, length);
+   unlockClient(stats);
+   return ret;
+}
+
+/**
+   Send a timing measured in microseconds. It goes on the wire in
+   fractional milliseconds, or into the timing histogram when timings are
+   aggregated, without being rounded to a whole millisecond first. The
+   caller has already made the sampling decision.
+
+   @param[in] stats - The stats client object
+   @param[in] bucket - The bucket of the timing
+   @param[in] micros - The timing in microseconds
+   @param[in] sampleRate - The sample rate the timing was gathered at
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the timing could not
+      be aggregated, STATSD_UDP_SEND if the send() failed.
+*/
+static int sendTiming(Statsd* stats, const char* bucket, uint64_t micros, double sampleRate, const StatsdTags* tags){
+   if (stats->aggregator && stats->aggregator->timings){
+      lockClient(stats);
+      Aggregate* entry = findAggregate(stats->aggregator, bucket, STATSD_TIMING, tags);
+      if (!entry || recordTiming(entry, micros, sampleRate) != STATSD_SUCCESS){
+         unlockClient(stats);
+         return STATSD_MALLOC;
+      }
+
+      markDirty(stats, entry);
+      unlockClient(stats);
+      return STATSD_SUCCESS;
+   }
+
+   char data[STAT_MAX_SIZE];
+   char value[24];
+   int valueLength = formatMillis(value, micros);
+   int dataLength = buildStatValue(data, sizeof(data), stats->nameSpace, bucket, STATSD_TIMING, value, valueLength, sampleRate, stats->tags, tags);
+   if (dataLength < 0){
+      return -dataLength;
+   }
+
+   countStat(stats, &stats->counters.serialized, 1);
+   return sendStat(stats, data, dataLength);
+}
+
+/**
+   Send a single datagram on the connected socket.
+
+   @param[in] stats - The stats client object
+   @param[in] data - The datagram
+   @param[in] length - The length of the datagram
+
+   @return STATSD_SUCCESS on success, STATSD_DROPPED if the socket had no
+      room for it, STATSD_UDP_SEND if the send failed.
+   @see sendPackets
+*/
+static int sendDatagram(Statsd* stats, const char* data, int length){
+   struct iovec piece = { (void*)data, (size_t)length };
+
+   //A single stat goes straight to its server, several are regrouped
+   if (stats->shards){
+      if (length > 1 && memchr(data, '\n', length - 1)){
+         return sendSharded(stats, &piece, NULL, 1, NULL);
+      }
+
+      stats = findShard(stats->shards, data, length);
+   }
+
+#if !defined (_WIN32)
+   if (stats->shm){
+      return shmSend(stats, &piece, NULL, 1, NULL);
+   }
+
+   if (stats->stream){
+      return streamSend(stats, &piece, NULL, 1, 0, NULL);
+   }
+#endif
+
+   return sendDirect(stats, &piece, NULL, 1, NULL);
+}
+
+/**
+   Write the decimal form of an integer.
+
+   @param[out] out - Where to write the digits, must have room for 20 bytes
+   @param[in] value - The integer to format
+
+   @return The number of bytes written
+*/
+static int formatInteger(char* out, long long value){
+   char digits[20];
+   char* end = digits + sizeof(digits);
+   char* start = end;
+   unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+   while (magnitude >= 100){
+      start -= 2;
+      memcpy(start, digitPairs + (magnitude % 100) * 2, 2);
+      magnitude /= 100;
+   }
+
+   if (magnitude >= 10){
+      start -= 2;
+      memcpy(start, digitPairs + magnitude * 2, 2);
+   }
+   else {
+      *--start = (char)('0' + magnitude);
+   }
+
+   if (value < 0){
+      *--start = '-';
+   }
+
+   memcpy(out, start, end - start);
+   return (int)(end - start);
+}
+
+/**
+   Write a number of microseconds as decimal milliseconds, with up to 3
+   decimal places and no trailing zeros.
+
+   @param[out] out - Where to write the digits, must have room for 24 bytes
+   @param[in] micros - The number of microseconds
+
+   @return The number of bytes written
+*/
+static int formatMillis(char* out, uint64_t micros){
+   int length = formatInteger(out, (long long)(micros / 1000));
+   unsigned int fraction = (unsigned int)(micros % 1000);
+
+   if (fraction){
+      char digits[3];
+      int count = 3;
+      digits[0] = (char)('0' + fraction / 100);
+      digits[1] = (char)('0' + fraction / 10 % 10);
+      digits[2] = (char)('0' + fraction % 10);
+      while (digits[count - 1] == '0'){
+         count--;
+      }
+
+      out[length++] = '.';
+      memcpy(out + length, digits, count);
+      length += count;
+   }
+
+   return length;
+}
+
+/**
+   Multiply two 64 bit fixed point numbers, keeping the rounded upper 64
+   bits of the product.
+*/
+static DiyFp multiplyDiyFp(DiyFp x, DiyFp y){
+   const uint64_t mask = 0xFFFFFFFFULL;
+   uint64_t a = x.f >> 32, b = x.f & mask;
+   uint64_t c = y.f >> 32, d = y.f & mask;
+   uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+   uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask) + (1ULL << 31);
+
+   DiyFp product = { ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64 };
+   return product;
+}
+
+/**
+   Nudge the last digit of a Grisu result down while that brings it closer
+   to the exact value and keeps it inside the rounding interval.
+*/
+static void roundDigits(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance){
+   while (rest < distance && delta - rest >= tenKappa &&
+          (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)){
+      digits[length - 1]--;
+      rest += tenKappa;
+   }
+}
+
+/**
+   Find the shortest digits of a positive, finite double that read back as
+   the same double, with the Grisu2 algorithm of Florian Loitsch. The value
+   is digits * 10^exponent.
+
+   @param[in] value - The value, greater then 0
+   @param[out] digits - Where to write the digits, must have room for 18
+   @param[out] exponent - The power of 10 of the last digit
+
+   @return The number of digits
+*/
+static int grisuDigits(double value, char* digits, int* exponent){
+   static const uint64_t powersOf10[] = {
+      1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+      100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+      10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+      100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+   };
+
+   //Split the double into a significand and a binary exponent
+   uint64_t bits;
+   memcpy(&bits, &value, sizeof(bits));
+   int biased = (int)((bits >> 52) & 0x7FF);
+   DiyFp v = { bits & 0xFFFFFFFFFFFFFULL, biased - 1075 };
+   if (biased){
+      v.f |= 1ULL << 52;
+   }
+   else {
+      v.e = -1074;
+   }
+
+   //The boundaries halfway to the neighbouring doubles, normalized to
+   //the same exponent
+   DiyFp plus = { (v.f << 1) + 1, v.e - 1 };
+   int shift = __builtin_clzll(plus.f);
+   plus.f <<= shift;
+   plus.e -= shift;
+
+   DiyFp minus = { (v.f << 1) - 1, v.e - 1 };
+   if (v.f == (1ULL << 52) && biased > 1){
+      minus.f = (v.f << 2) - 1;
+      minus.e = v.e - 2;
+   }
+   minus.f <<= minus.e - plus.e;
+   minus.e = plus.e;
+
+   shift = __builtin_clzll(v.f);
+   v.f <<= shift;
+   v.e -= shift;
+
+   //Scale by a cached power of 10 so the upper boundary lands in
+   //[2^-60, 2^-32) times 2^64
+   double estimate = (-61 - plus.e) * 0.30102999566398114 + 347;
+   int k = (int)estimate;
+   if (estimate - k > 0.0){
+      k++;
+   }
+
+   int index = (k >> 3) + 1;
+   DiyFp power = cachedPowers[index];
+   *exponent = 348 - index * 8;
+
+   DiyFp w = multiplyDiyFp(v, power);
+   DiyFp upper = multiplyDiyFp(plus, power);
+   DiyFp lower = multiplyDiyFp(minus, power);
+   upper.f--;
+   lower.f++;
+
+   //Generate digits of the upper boundary until the rest falls inside
+   //the rounding interval
+   uint64_t delta = upper.f - lower.f;
+   uint64_t distance = upper.f - w.f;
+   int oneShift = -upper.e;
+   uint64_t oneMask = (1ULL << oneShift) - 1;
+   uint32_t integral = (uint32_t)(upper.f >> oneShift);
+   uint64_t fraction = upper.f & oneMask;
+
+   int kappa = 0;
+   while (kappa < 10 && integral >= powersOf10[kappa]){
+      kappa++;
+   }
+
+   int length = 0;
+   while (kappa > 0){
+      uint32_t digit = (uint32_t)(integral / powersOf10[kappa - 1]);
+      integral %= (uint32_t)powersOf10[kappa - 1];
+      if (digit || length){
+         digits[length++] = (char)('0' + digit);
+      }
+      kappa--;
+
+      uint64_t rest = ((uint64_t)integral << oneShift) + fraction;
+      if (rest <= delta){
+         *exponent += kappa;
+         roundDigits(digits, length, delta, rest, powersOf10[kappa] << oneShift, distance);
+         return length;
+      }
+   }
+
+   for (;;){
+      fraction *= 10;
+      delta *= 10;
+      char digit = (char)(fraction >> oneShift);
+      if (digit || length){
+         digits[length++] = (char)('0' + digit);
+      }
+      fraction &= oneMask;
+      kappa--;
+
+      if (fraction < delta){
+         *exponent += kappa;
+         roundDigits(digits, length, delta, fraction, 1ULL << oneShift, -kappa < 20 ? distance * powersOf10[-kappa] : 0);
+         return length;
+      }
+   }
+}
+
+/**
+   Write the shortest decimal form of a double that reads back as the same
+   double. Whole numbers below 2^53 are written as integers, numbers from
+   1e-6 up to 1e21 in plain decimal notation, and anything else with an
+   exponent ("1.5e-7", "2e+21").
+
+   @param[out] out - Where to write the number, must have room for
+      FLOAT_MAX_SIZE bytes
+   @param[in] value - The number, which must be finite
+
+   @return The number of bytes written
+*/
+static int formatDouble(char* out, double value){
+   //Most values are whole numbers, which don't need Grisu
+   if (value > -9007199254740992.0 && value < 9007199254740992.0 && value == (double)(long long)value){
+      return formatInteger(out, (long long)value);
+   }
+
+   char* start = out;
+   if (value < 0){
+      *out++ = '-';
+      value = -value;
+   }
+
+   char digits[18];
+   int exponent = 0;
+   int length = grisuDigits(value, digits, &exponent);
+
+   //The number is 0.digits * 10^point
+   int point = length + exponent;
+   if (point > 0 && point <= 21){
+      //1234e-2 -> 12.34, 1234e5 -> 123400000
+      if (length > point){
+         memcpy(out, digits, point);
+         out += point;
+         *out++ = '.';
+         memcpy(out, digits + point, length - point);
+         out += length - point;
+      }
+      else {
+         memcpy(out, digits, length);
+         memset(out + length, '0', point - length);
+         out += point;
+      }
+   }
+   else if (point <= 0 && point > -6){
+      //1234e-6 -> 0.001234
+      *out++ = '0';
+      *out++ = '.';
+      memset(out, '0', -point);
+      out += -point;
+      memcpy(out, digits, length);
+      out += length;
+   }
+   else {
+      //1234e30 -> 1.234e+33
+      *out++ = digits[0];
+      if (length > 1){
+         *out++ = '.';
+         memcpy(out, digits + 1, length - 1);
+         out += length - 1;
+      }
+
+      *out++ = 'e';
+      *out++ = point - 1 < 0 ? '-' : '+';
+      out += formatInteger(out, point - 1 < 0 ? 1 - point : point - 1);
+   }
+
+   return (int)(out - start);
+}
+
+/**
+   Get the "|@rate" suffix for a sample rate. Rates are written with up to
+   6 decimal places and no trailing zeros. The suffix for the last rate
+   used by each thread is kept, since most callers use the same rate over
+   and over.
+
+   @param[in] sampleRate - The sample rate, between 0 and 1
+   @param[out] length - The length of the suffix
+
+   @return The suffix, valid until the thread asks for another rate
+*/
+static const char* sampleRateSuffix(double sampleRate, int* length){
+   static __thread double cachedRate = -1.0;
+   static __thread char cachedSuffix[RATE_SUFFIX_SIZE];
+   static __thread int cachedLength = 0;
+
+   if (sampleRate != cachedRate){
+      long millionths = (long)(sampleRate * 1000000.0 + 0.5);
+      if (millionths < 1){
+         millionths = 1;
+      }
+
+      if (millionths >= 1000000){
+         memcpy(cachedSuffix, "|@1", 3);
+         cachedLength = 3;
+      }
+      else {
+         memcpy(cachedSuffix, "|@0.", 4);
+         cachedLength = 4;
+         for (long scale = 100000; millionths > 0; scale /= 10){
+            cachedSuffix[cachedLength++] = (char)('0' + millionths / scale);
+            millionths %= scale;
+         }
+      }
+
+      cachedRate = sampleRate;
+   }
+
+   *length = cachedLength;
+   return cachedSuffix;
+}
+
+//Every thread has its own sampling RNG, seeded the first time it is used,
+//and its own key for keyed sampling (0 when no key is set).
+static __thread uint64_t samplerState = 0;
+static __thread uint64_t samplerKey = 0;
+static uint64_t samplerSeeds = 0;
+
+/**
+   Turn a sample rate into the threshold a 32 bit random number has to
+   fall under for a stat to be kept.
+
+   @param[in] sampleRate - The sample rate of the stat
+
+   @return The threshold, or SAMPLE_KEEP_ALL if the rate is not between 0 and 1
+*/
+static uint64_t sampleThreshold(double sampleRate){
+   if (sampleRate > 0 && sampleRate < 1){
+      return (uint64_t)(sampleRate * (double)SAMPLE_KEEP_ALL);
+   }
+
+   return SAMPLE_KEEP_ALL;
+}
+
+/**
+   Come up with a seed for a thread's sampling RNG. The clock, the process
+   id, the address of the thread's state and a global counter are mixed
+   together, so every thread in every process gets a different sequence.
+
+   @return A non zero seed
+*/
+static uint64_t seedSampler(void){
+   uint64_t seed = (uint64_t)(uintptr_t)&samplerState;
+   seed ^= __atomic_add_fetch(&samplerSeeds, 1, __ATOMIC_RELAXED) << 48;
+
+#if defined (_WIN32)
+   seed ^= (uint64_t)GetTickCount64() << 16;
+   seed ^= (uint64_t)GetCurrentProcessId() << 32;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   seed ^= (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+   seed ^= (uint64_t)getpid() << 32;
+#endif
+
+   seed = mixHash(seed);
+   return seed ? seed : 1;
+}
+
+/**
+   Get the next 32 bit number used for a sampling decision. A random
+   function set on the client takes priority. In keyed mode, when the
+   thread has a key, the number is a hash of the key and the bucket, so the
+   same key is always kept or dropped together. Otherwise it comes from the
+   thread's own xorshift64* generator, which needs no locking.
+
+   @param[in] stats - The statsd client
+   @param[in] bucket - The bucket of the stat
+   @param[in] bucketHash - The hash of the bucket, or 0 to hash it here
+
+   @return 32 uniformly distributed bits
+*/
+static uint32_t nextSample(Statsd* stats, const char* bucket, uint64_t bucketHash){
+   if (stats->random){
+      return (uint32_t)(((uint64_t)stats->random() << 32) / ((uint64_t)RAND_MAX + 1));
+   }
+
+   if (stats->sampling == STATSD_SAMPLE_KEYED && samplerKey){
+      if (!bucketHash){
+         bucketHash = hashBucket(bucket ? bucket : "", STATSD_NONE);
+      }
+      return (uint32_t)(mixHash(bucketHash ^ samplerKey) >> 32);
+   }
+
+   uint64_t state = samplerState;
+   if (!state){
+      state = seedSampler();
+   }
+
+   state ^= state >> 12;
+   state ^= state << 25;
+   state ^= state >> 27;
+   samplerState = state;
+   return (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/**
+   Decide if a stat is dropped because of its sample rate.
+
+   @param[in] stats - The statsd client
+   @param[in] bucket - The bucket of the stat
+   @param[in] bucketHash - The hash of the bucket, or 0 if it is not known
+   @param[in] threshold - The threshold from sampleThreshold()
+
+   @return 1 if the stat should be dropped, 0 if it should be sent
+*/
+static inline int sampledOut(Statsd* stats, const char* bucket, uint64_t bucketHash, uint64_t threshold){
+   if (threshold < SAMPLE_KEEP_ALL && nextSample(stats, bucket, bucketHash) >= threshold){
+      countStat(stats, &stats->counters.sampledOut, 1);
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+   This is a helper function that will build up a stats string and return its
+   length. The string is written straight into the output with no
+   intermediate copies, and is not null terminated.
+
+   @param[out] stat - This is where the final string will be placed
+   @param[in] size - The number of bytes available at stat
+   @param[in] nameSpace - The namespace of the stat
+   @param[in] bucket - The bucket where to put the stat
+   @param[in] type - The type of stat being packed
+   @param[in] delta - The value of the stat
+   @param[in] sampleRate - The intervals at which this data was gathered
+   @param[in] defaults - The client's default tags, or NULL
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return The length of the stat string, -STATSD_BAD_STATS_TYPE if the
+      type is not recognized, or -STATSD_BATCH_FULL if the stat does not
+      fit in size bytes.
+*/
+static int buildStatString(char* stat, int size, const char* nameSpace, const char* bucket, StatsType type, long long delta, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags){
+   char value[20];
+   int valueLength = formatInteger(value, delta);
+   return buildStatValue(stat, size, nameSpace, bucket, type, value, valueLength, sampleRate, defaults, tags);
+}
+
+/**
+   Build a stat string around a value that is already formatted. This is
+   what buildStatString() does once it has the digits of its integer.
+
+   @param[out] stat - This is where the final string will be placed
+   @param[in] size - The number of bytes available at stat
+   @param[in] nameSpace - The namespace of the stat
+   @param[in] bucket - The bucket where to put the stat
+   @param[in] type - The type of stat being packed
+   @param[in] value - The formatted value of the stat
+   @param[in] valueLength - The length of the value
+   @param[in] sampleRate - The intervals at which this data was gathered
+   @param[in] defaults - The client's default tags, or NULL
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return The length of the stat string, -STATSD_BAD_STATS_TYPE if the
+      type is not recognized, or -STATSD_BATCH_FULL if the stat does not
+      fit in size bytes.
+*/
+static inline int buildStatValue(char* stat, int size, const char* nameSpace, const char* bucket, StatsType type, const char* value, int valueLength, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags){
+   if (type <= STATSD_NONE || type >= STATSD_BATCH){
+      return -STATSD_BAD_STATS_TYPE;
+   }
+
+   int nameSpaceLength = nameSpace ? (int)strlen(nameSpace) : 0;
+   int bucketLength = (int)strlen(bucket);
+
+   const char* rate = NULL;
+   int rateLength = 0;
+   if (sampleRate > 0.0 && sampleRate < 1.0){
+      rate = sampleRateSuffix(sampleRate, &rateLength);
+   }
+
+   int statLength = (nameSpace ? nameSpaceLength + 1 : 0) + bucketLength + 1 + valueLength + statSuffixes[type].length + rateLength + tagsLength(defaults, tags);
+   if (statLength > size){
+      return -STATSD_BATCH_FULL;
+   }
+
+   //Build up the bucket name, with the nameSpace.
+   char* out = stat;
+   if (nameSpace){
+      memcpy(out, nameSpace, nameSpaceLength);
+      out += nameSpaceLength;
+      *out++ = '.';
+   }
+
+   memcpy(out, bucket, bucketLength);
+   out += bucketLength;
+   *out++ = ':';
+
+   memcpy(out, value, valueLength);
+   out += valueLength;
+
+   memcpy(out, statSuffixes[type].suffix, statSuffixes[type].length);
+   out += statSuffixes[type].length;
+
+   if (rate){
+      memcpy(out, rate, rateLength);
+      out += rateLength;
+   }
+
+   writeTags(out, defaults, tags);
+   return statLength;
+}
+
+/**
+   The number of bytes the tags of a stat take on the wire.
+
+   @param[in] defaults - The client's default tags, or NULL
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return The length of the "|#..." suffix, 0 if there are no tags
+*/
+static inline int tagsLength(const StatsdTags* defaults, const StatsdTags* tags){
+   int length = defaults ? defaults->length : 0;
+   if (tags && tags->length){
+      //The stat's own tags follow the defaults after a comma instead of "|#"
+      length += length ? tags->length - 1 : tags->length;
+   }
+
+   return length;
+}
+
+/**
+   Write the tags of a stat, the client's default tags followed by the
+   stat's own. Both were serialized when they were set, so this is at
+   most two copies.
+
+   @param[out] out - Where to write the tags, with room for tagsLength()
+   @param[in] defaults - The client's default tags, or NULL
+   @param[in] tags - The stat's own tags, or NULL
+*/
+static inline void writeTags(char* out, const StatsdTags* defaults, const StatsdTags* tags){
+   int length = 0;
+   if (defaults && defaults->length){
+      memcpy(out, defaults->data, defaults->length);
+      length = defaults->length;
+   }
+
+   if (tags && tags->length){
+      if (length){
+         out[length++] = ',';
+         memcpy(out + length, tags->data + 2, tags->length - 2);
+      }
+      else {
+         memcpy(out, tags->data, tags->length);
+      }
+   }
+}
+
+/**
+   Check that two sets of tags are the same. No tags and an empty set are
+   the same.
+*/
+static int sameTags(const StatsdTags* a, const StatsdTags* b){
+   int lengthA = a ? a->length : 0;
+   int lengthB = b ? b->length : 0;
+   return lengthA == lengthB && (lengthA == 0 || memcmp(a->data, b->data, lengthA) == 0);
+}
+
+/**
+   Make a private copy of a set of tags, for something that can outlive
+   the caller's handle.
+
+   @param[in] tags - The tags to copy, or NULL
+   @param[out] copy - The copy, or NULL if there are no tags
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if out of memory
+*/
+static int copyTags(const StatsdTags* tags, StatsdTags** copy){
+   *copy = NULL;
+   if (!tags || tags->length == 0){
+      return STATSD_SUCCESS;
+   }
+
+   StatsdTags* newTags = (StatsdTags*)malloc(sizeof(StatsdTags) + tags->length + 1);
+   if (!newTags){
+      return STATSD_MALLOC;
+   }
+
+   char* data = (char*)(newTags + 1);
+   memcpy(data, tags->data, tags->length + 1);
+   newTags->data = data;
+   newTags->length = tags->length;
+   *copy = newTags;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Build a stat string for a registered metric. The bucket name and the
+   suffix were serialized when the metric was registered, so only the
+   value needs to be formatted.
+
+   @param[out] stat - This is where the final string will be placed
+   @param[in] size - The number of bytes available at stat
+   @param[in] metric - The registered metric
+   @param[in] value - The value of the stat
+
+   @return The length of the stat string, or -STATSD_BATCH_FULL if the
+      stat does not fit in size bytes.
+*/
+static int buildMetricString(char* stat, int size, const StatsdMetric* metric, long long value){
+   char digits[20];
+   int valueLength = formatInteger(digits, value);
+   return buildMetricValue(stat, size, metric, digits, valueLength);
+}
+
+/**
+   Build a stat string for a registered metric around a value that is
+   already formatted.
+
+   @param[out] stat - This is where the final string will be placed
+   @param[in] size - The number of bytes available at stat
+   @param[in] metric - The registered metric
+   @param[in] digits - The formatted value of the stat
+   @param[in] valueLength - The length of the value
+
+   @return The length of the stat string, or -STATSD_BATCH_FULL if the
+      stat does not fit in size bytes.
+*/
+static inline int buildMetricValue(char* stat, int size, const StatsdMetric* metric, const char* digits, int valueLength){
+   int statLength = metric->prefixLength + valueLength + metric->suffixLength;
+   if (statLength > size){
+      return -STATSD_BATCH_FULL;
+   }
+
+   memcpy(stat, metric->prefix, metric->prefixLength);
+   memcpy(stat + metric->prefixLength, digits, valueLength);
+   memcpy(stat + metric->prefixLength + valueLength, metric->suffix, metric->suffixLength);
+   return statLength;
+}
+
+/**
+   Add a stat with a value that is already formatted to the batch buffer,
+   sending the batch first if it is full. In concurrent mode the stat is
+   staged for the flusher thread instead. The sampling decision has
+   already been made.
+
+   @param[in] statsd - The statsd client object
+   @param[in] type - The type of the stat
+   @param[in] bucket - The bucket of the stat
+   @param[in] value - The formatted value of the stat
+   @param[in] valueLength - The length of the value
+   @param[in] sampleRate - The sample rate of the stat
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if a full batch could
+      not be sent, STATSD_BATCH_FULL if the stat is larger then the packet
+      size, STATSD_BAD_STATS_TYPE if the type is not recognized.
+*/
+static int batchValue(Statsd* statsd, StatsType type, const char* bucket, const char* value, int valueLength, double sampleRate, const StatsdTags* tags){
+#if !defined (_WIN32)
+   if (statsd->concurrent){
+      char statsString[STAT_MAX_SIZE];
+      int strLength = buildStatValue(statsString, sizeof(statsString), statsd->nameSpace, bucket, type, value, valueLength, sampleRate, statsd->tags, tags);
+      if (strLength < 0){
+         return -strLength;
+      }
+
+      countStat(statsd, &statsd->counters.serialized, 1);
+      countStat(statsd, &statsd->counters.batched, 1);
+      return stageStat(statsd, statsString, strLength);
+   }
+#endif
+
+   //Build the stat straight into the batch, leaving room for the newline
+   lockClient(statsd);
+   int ret = STATSD_SUCCESS;
+   int strLength = buildStatValue(statsd->batch + statsd->batchIndex, statsd->packetSize - statsd->batchIndex - 1, statsd->nameSpace, bucket, type, value, valueLength, sampleRate, statsd->tags, tags);
+   if (strLength == -STATSD_BATCH_FULL && statsd->batchIndex > 0){
+      ret = statsd_sendBatch(statsd);
+      if (ret != STATSD_SUCCESS){
+         statsd_resetBatch(statsd);
+      }
+
+      strLength = buildStatValue(statsd->batch, statsd->packetSize - 1, statsd->nameSpace, bucket, type, value, valueLength, sampleRate, statsd->tags, tags);
+   }
+
+   if (strLength < 0){
+      unlockClient(statsd);
+      return -strLength;
+   }
+
+   statsd->batchIndex += strLength;
+   statsd->batch[statsd->batchIndex++] = '\n';
+   statsd->batch[statsd->batchIndex] = '\0';
+   statsd->counters.serialized++;
+   statsd->counters.batched++;
+
+#if !defined (_WIN32)
+   if (statsd->scheduler){
+      int scheduled = scheduleBatch(statsd);
+      if (ret == STATSD_SUCCESS){
+         ret = scheduled;
+      }
+   }
+#endif
+
+   unlockClient(statsd);
+   return ret;
+}
+
+/**
+   Add a value that is already formatted for a registered metric to the
+   batch buffer, like batchValue().
+
+   @param[in] metric - The metric handle
+   @param[in] value - The formatted value of the stat
+   @param[in] valueLength - The length of the value
+
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if a full batch could
+      not be sent, STATSD_BATCH_FULL if the stat is larger then the packet
+      size.
+*/
+static int batchMetricValue(StatsdMetric* metric, const char* value, int valueLength){
+   Statsd* statsd = metric->statsd;
+
+#if !defined (_WIN32)
+   if (statsd->concurrent){
+      char statsString[STAT_MAX_SIZE];
+      int strLength = buildMetricValue(statsString, sizeof(statsString), metric, value, valueLength);
+      if (strLength < 0){
+         return -strLength;
+      }
+
+      countStat(statsd, &statsd->counters.serialized, 1);
+      countStat(statsd, &statsd->counters.batched, 1);
+      return stageStat(statsd, statsString, strLength);
+   }
+#endif
+
+   //Build the stat straight into the batch, leaving room for the newline
+   lockClient(statsd);
+   int ret = STATSD_SUCCESS;
+   int strLength = buildMetricValue(statsd->batch + statsd->batchIndex, statsd->packetSize - statsd->batchIndex - 1, metric, value, valueLength);
+   if (strLength == -STATSD_BATCH_FULL && statsd->batchIndex > 0){
+      ret = statsd_sendBatch(statsd);
+      if (ret != STATSD_SUCCESS){
+         statsd_resetBatch(statsd);
+      }
+
+      strLength = buildMetricValue(statsd->batch, statsd->packetSize - 1, metric, value, valueLength);
+   }
+
+   if (strLength < 0){
+      unlockClient(statsd);
+      return -strLength;
+   }
+
+   statsd->batchIndex += strLength;
+   statsd->batch[statsd->batchIndex++] = '\n';
+   statsd->batch[statsd->batchIndex] = '\0';
+   statsd->counters.serialized++;
+   statsd->counters.batched++;
+
+#if !defined (_WIN32)
+   if (statsd->scheduler){
+      int scheduled = scheduleBatch(statsd);
+      if (ret == STATSD_SUCCESS){
+         ret = scheduled;
+      }
+   }
+#endif
+
+   unlockClient(statsd);
+   return ret;
+}
+
+/**
+   Send a list of datagrams. A sharded client splits them up between its
+   servers, otherwise they are sent as they are.
+
+   @return STATSD_SUCCESS if every datagram was sent or queued,
+      STATSD_DROPPED if any were dropped because the socket had no room,
+      STATSD_UDP_SEND if any failed for another reason.
+   @see sendDirect
+*/
+static int sendPackets(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report){
+   if (stats->shards){
+      return sendSharded(stats, iov, parts, count, report);
+   }
+
+   return sendDirect(stats, iov, parts, count, report);
+}
+
+/**
+   Send a list of datagrams to the client's own server, using as few system
+   calls as possible. Clients using shared memory, a TCP stream or io_uring
+   are handed to their own transport. Otherwise on Linux the datagrams are
+   given to the kernel in chunks with sendmmsg(), elsewhere they are sent
+   one at a time with sendmsg(). A datagram the socket does not take is
+   handled by the backpressure policy, and the rest are still sent.
+   Datagrams waiting in the spill queue are sent first, and new ones line
+   up behind them until it is empty.
+
+   @param[in] stats - The statsd client object
+   @param[in] iov - The pieces of every datagram, in order
+   @param[in] parts - The number of pieces in each datagram. If this is NULL
+      every datagram is a single piece.
+   @param[in] count - The number of datagrams
+   @param[out] report - Optional, filled in with the result of every datagram
+
+   @return STATSD_SUCCESS if every datagram was sent or queued,
+      STATSD_DROPPED if any were dropped because the socket had no room,
+      STATSD_UDP_SEND if any failed for another reason.
+*/
+static int sendDirect(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report){
+#if !defined (_WIN32)
+   if (stats->shm){
+      return shmSend(stats, iov, parts, count, report);
+   }
+
+   if (stats->stream){
+      return streamSend(stats, iov, parts, count, 1, report);
+   }
+#endif
+
+#if defined (HAVE_URING)
+   if (stats->uring){
+      return uringSend(stats, iov, parts, count, report);
+   }
+#endif
+
+   int sent = 0;
+   int calls = 0;
+   int firstError = 0;
+   int packet = 0;
+   int attempt = 0;
+   int ret = STATSD_SUCCESS;
+
+   if (stats->spill){
+      calls += drainSpill(stats);
+   }
+
+   while (packet < count){
+      int pieces = parts ? parts[packet] : 1;
+      int result;
+      int error = ENOBUFS;
+
+      if (stats->spill && stats->spill->length > 0){
+         result = spillDatagram(stats, iov, pieces);
+      }
+      else {
+#if defined (__linux__)
+         struct mmsghdr messages[SEND_CHUNK_SIZE];
+         int chunk = count - packet < SEND_CHUNK_SIZE ? count - packet : SEND_CHUNK_SIZE;
+         struct iovec* piece = iov;
+
+         memset(messages, 0, chunk * sizeof(struct mmsghdr));
+         for (int i = 0; i < chunk; i++){
+            messages[i].msg_hdr.msg_iov = piece;
+            messages[i].msg_hdr.msg_iovlen = parts ? parts[packet + i] : 1;
+            piece += messages[i].msg_hdr.msg_iovlen;
+         }
+
+         uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+         int done = sendmmsg(stats->socketFd, messages, chunk, 0);
+         countCall(stats, started, done <= 0);
+         calls++;
+
+         if (done > 0){
+            for (int i = 0; i < done; i++){
+               if (report && report->status && packet < report->statusSize){
+                  report->status[packet] = 1;
+               }
+
+               countSent(stats, messages[i].msg_hdr.msg_iov, messages[i].msg_hdr.msg_iovlen, 1);
+
+               iov += messages[i].msg_hdr.msg_iovlen;
+               packet++;
+            }
+
+            sent += done;
+            attempt = 0;
+            continue;
+         }
+#else
+         struct msghdr message;
+         memset(&message, 0, sizeof(message));
+         message.msg_iov = iov;
+         message.msg_iovlen = pieces;
+
+         uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+         int done = sendmsg(stats->socketFd, &message, 0) != -1;
+         countCall(stats, started, !done);
+         calls++;
+
+         if (done){
+            if (report && report->status && packet < report->statusSize){
+               report->status[packet] = 1;
+            }
+
+            countSent(stats, iov, pieces, 1);
+
+            iov += pieces;
+            packet++;
+            sent++;
+            attempt = 0;
+            continue;
+         }
+#endif
+
+         //sendmmsg() stops at the first datagram that fails, and only
+         //reports the error when it is the first one in the chunk.
+         error = errno;
+         result = sendFailed(stats, iov, pieces, error, attempt++);
+         if (result == SEND_RETRY){
+            continue;
+         }
+      }
+
+      if (result == SEND_QUEUED){
+         sent++;
+      }
+      else {
+         if (!firstError){
+            firstError = error;
+         }
+
+         //Running out of room is reported unless something worse happened
+         if (!wouldBlock(error)){
+            ret = STATSD_UDP_SEND;
+         }
+         else if (ret == STATSD_SUCCESS){
+            ret = STATSD_DROPPED;
+         }
+      }
+
+      if (report && report->status && packet < report->statusSize){
+         report->status[packet] = result == SEND_QUEUED;
+      }
+
+      iov += pieces;
+      packet++;
+      attempt = 0;
+   }
+
+   if (report){
+      report->packets = count;
+      report->sent = sent;
+      report->calls = calls;
+      report->firstError = firstError;
+   }
+
+   return ret;
+}
+
+/**
+   Check if a send error means the socket is out of room, rather then
+   something being wrong with it.
+*/
+static int wouldBlock(int error){
+   return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS;
+}
+
+/**
+   Add dropped stats to the client's counters. Each newline terminated
+   line in the pieces counts as one metric. A client sending to a shared
+   memory ring also adds them to the ring's counters, for the drain to
+   report.
+
+   @param[in] stats - The statsd client object
+   @param[in] pieces - The pieces of the dropped datagram
+   @param[in] count - The number of pieces
+*/
+static void countDropped(Statsd* stats, const struct iovec* pieces, int count){
+   uint64_t bytes = 0;
+   uint64_t metrics = countLines(pieces, count, &bytes);
+
+   //A datagram's last line does not need a newline
+   const struct iovec* last = count > 0 ? &pieces[count - 1] : NULL;
+   metrics += last && last->iov_len > 0 && ((const char*)last->iov_base)[last->iov_len - 1] != '\n';
+
+   __atomic_add_fetch(&stats->droppedMetrics, metrics, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats->droppedBytes, bytes, __ATOMIC_RELAXED);
+
+#if !defined (_WIN32)
+   if (stats->shm){
+      __atomic_add_fetch(&stats->shm->header->dropped, metrics, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&stats->shm->header->droppedBytes, bytes, __ATOMIC_RELAXED);
+   }
+#endif
+}
+
+/**
+   Decide what happens to a datagram the socket did not take. A connection
+   problem is fixed and the send tried again. When the socket is out of
+   room the backpressure policy either waits for room, moves the datagram
+   to the spill queue, or drops it. Anything else drops it.
+
+   @param[in] stats - The statsd client object
+   @param[in] pieces - The pieces of the datagram
+   @param[in] count - The number of pieces
+   @param[in] error - The errno of the failed send
+   @param[in] attempt - The number of times the datagram has already been retried
+
+   @return SEND_RETRY if the datagram should be sent again, SEND_QUEUED
+      if it was put in the spill queue, SEND_DROPPED if it was dropped.
+*/
+static int sendFailed(Statsd* stats, const struct iovec* pieces, int count, int error, int attempt){
+   if (attempt == 0 && recoverSocket(stats, error)){
+      return SEND_RETRY;
+   }
+
+   if (wouldBlock(error)){
+#if !defined (_WIN32)
+      if (stats->backpressure == STATSD_BACKPRESSURE_BLOCK && attempt < 2){
+         struct pollfd ready = { stats->socketFd, POLLOUT, 0 };
+         if (poll(&ready, 1, stats->blockTimeout) > 0){
+            return SEND_RETRY;
+         }
+      }
+#endif
+
+      if (stats->backpressure == STATSD_BACKPRESSURE_SPILL){
+         return spillDatagram(stats, pieces, count);
+      }
+   }
+
+   countDropped(stats, pieces, count);
+   return SEND_DROPPED;
+}
+
+/**
+   Put a datagram at the end of the spill queue. Each datagram is stored
+   as its length followed by its bytes.
+
+   @param[in] stats - The statsd client object
+   @param[in] pieces - The pieces of the datagram
+   @param[in] count - The number of pieces
+
+   @return SEND_QUEUED if it was queued, SEND_DROPPED if the queue is full.
+*/
+static int spillDatagram(Statsd* stats, const struct iovec* pieces, int count){
+   Spill* spill = stats->spill;
+   int length = 0;
+   for (int i = 0; i < count; i++){
+      length += (int)pieces[i].iov_len;
+   }
+
+   int needed = (int)sizeof(int) + length;
+   if (spill->length + needed > spill->capacity && spill->start > 0){
+      memmove(spill->data, spill->data + spill->start, spill->length - spill->start);
+      spill->length -= spill->start;
+      spill->start = 0;
+   }
+
+   if (spill->length + needed > spill->capacity){
+      countDropped(stats, pieces, count);
+      return SEND_DROPPED;
+   }
+
+   memcpy(spill->data + spill->length, &length, sizeof(int));
+   spill->length += sizeof(int);
+   for (int i = 0; i < count; i++){
+      memcpy(spill->data + spill->length, pieces[i].iov_base, pieces[i].iov_len);
+      spill->length += pieces[i].iov_len;
+   }
+
+   return SEND_QUEUED;
+}
+
+/**
+   Send as much of the spill queue as the socket will take, oldest first.
+   A datagram that fails for any reason other then a lack of room is
+   dropped.
+
+   @param[in] stats - The statsd client object
+
+   @return The number of system calls made
+*/
+static int drainSpill(Statsd* stats){
+   Spill* spill = stats->spill;
+   int calls = 0;
+
+   while (spill->start < spill->length){
+      int length;
+      memcpy(&length, spill->data + spill->start, sizeof(int));
+      char* data = spill->data + spill->start + sizeof(int);
+
+      uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+      int sent = send(stats->socketFd, data, length, 0);
+      countCall(stats, started, sent == -1);
+      calls++;
+
+      struct iovec piece = { data, (size_t)length };
+      if (sent == -1){
+         int error = errno;
+         if (wouldBlock(error)){
+            break;
+         }
+
+         if (calls == 1 && recoverSocket(stats, error)){
+            continue;
+         }
+
+         countDropped(stats, &piece, 1);
+      }
+      else {
+         countSent(stats, &piece, 1, 1);
+      }
+
+      spill->start += sizeof(int) + length;
+   }
+
+   if (spill->start == spill->length){
+      spill->start = 0;
+      spill->length = 0;
+   }
+
+   return calls;
+}
+
+/**
+   Make a last attempt to send the spill queue and free it. Whatever can't
+   be sent is counted as dropped.
+
+   @param[in] stats - The statsd client object
+*/
+static void freeSpill(Statsd* stats){
+   Spill* spill = stats->spill;
+   if (!spill){
+      return;
+   }
+
+   drainSpill(stats);
+   while (spill->start < spill->length){
+      int length;
+      memcpy(&length, spill->data + spill->start, sizeof(int));
+      struct iovec piece = { spill->data + spill->start + sizeof(int), (size_t)length };
+      countDropped(stats, &piece, 1);
+      spill->start += sizeof(int) + length;
+   }
+
+   free(spill->data);
+   free(spill);
+   stats->spill = NULL;
+}
+
+/**
+   FNV-1a hash of a name that is not null terminated, mixed so that
+   similar names end up far apart on the hash ring.
+*/
+static uint64_t hashName(const char* name, int length){
+   uint64_t hash = 14695981039346656037ULL;
+   for (int i = 0; i < length; i++){
+      hash ^= (unsigned char)name[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return mixHash(hash);
+}
+
+static int compareRingPoints(const void* a, const void* b){
+   uint64_t first = ((const RingPoint*)a)->hash;
+   uint64_t second = ((const RingPoint*)b)->hash;
+   return first < second ? -1 : first > second;
+}
+
+/**
+   Find the server that owns a stat. The stat's name (everything before
+   the first ':', including the namespace) is hashed and looked up on the
+   ring.
+
+   @param[in] shards - The servers of the client
+   @param[in] line - The stat string
+   @param[in] length - The length of the stat string
+
+   @return The client of the server that owns the stat
+*/
+static Statsd* findShard(const Shards* shards, const char* line, int length){
+   const char* colon = (const char*)memchr(line, ':', length);
+   uint64_t hash = hashName(line, colon ? (int)(colon - line) : length);
+
+   int low = 0;
+   int high = shards->ringSize;
+   while (low < high){
+      int middle = (low + high) / 2;
+      if (shards->ring[middle].hash < hash){
+         low = middle + 1;
+      }
+      else {
+         high = middle;
+      }
+   }
+
+   return shards->servers[shards->ring[low == shards->ringSize ? 0 : low].server];
+}
+
+/**
+   Split datagrams up between the servers of a sharded client. Every line
+   is copied to the outbox of the server that owns it, and each outbox is
+   then sent to its server in full packets.
+
+   @param[in] stats - The statsd client object
+   @param[in] iov - The pieces of every datagram, in order
+   @param[in] parts - The number of pieces in each datagram. If this is NULL
+      every datagram is a single piece.
+   @param[in] count - The number of datagrams
+   @param[out] report - Optional, filled in with the packets sent to all of
+      the servers. Every datagram's status is the overall result.
+
+   @return STATSD_SUCCESS if every packet was sent or queued, otherwise
+      the worst error from any of the servers.
+*/
+static int sendSharded(Statsd* stats, const struct iovec* iov, const int* parts, int count, StatsdSendReport* report){
+   Shards* shards = stats->shards;
+   int pieces = 0;
+   for (int i = 0; i < count; i++){
+      pieces += parts ? parts[i] : 1;
+   }
+
+   int ret = STATSD_SUCCESS;
+   for (int i = 0; i < pieces && ret == STATSD_SUCCESS; i++){
+      const char* data = (const char*)iov[i].iov_base;
+      const char* end = data + iov[i].iov_len;
+
+      while (data < end){
+         const char* newline = (const char*)memchr(data, '\n', end - data);
+         int length = (int)((newline ? newline : end) - data);
+
+         if (length > 0){
+            Statsd* server = findShard(shards, data, length);
+            Outbox* outbox = &shards->outboxes[server == stats ? 0 : server->shardIndex];
+
+            if (outboxReserve(outbox, length + 1) != STATSD_SUCCESS){
+               ret = STATSD_MALLOC;
+               break;
+            }
+
+            memcpy(outbox->data + outbox->length, data, length);
+            if (outboxCommit(outbox, length, stats->packetSize) != STATSD_SUCCESS){
+               ret = STATSD_MALLOC;
+               break;
+            }
+         }
+
+         data += length + 1;
+      }
+   }
+
+   int packets = 0;
+   int sent = 0;
+   int calls = 0;
+   int firstError = 0;
+
+   for (int i = 0; i < shards->count; i++){
+      Outbox* outbox = &shards->outboxes[i];
+      if (outbox->length == 0){
+         continue;
+      }
+
+      int shardPackets = ret == STATSD_MALLOC ? -1 : outboxPackets(outbox);
+      if (shardPackets < 0){
+         ret = STATSD_MALLOC;
+         outboxClear(outbox);
+         continue;
+      }
+
+      StatsdSendReport shardReport;
+      memset(&shardReport, 0, sizeof(shardReport));
+      int shardRet = sendDirect(shards->servers[i], outbox->iov, NULL, shardPackets, &shardReport);
+      outboxClear(outbox);
+
+      packets += shardReport.packets;
+      sent += shardReport.sent;
+      calls += shardReport.calls;
+      if (!firstError){
+         firstError = shardReport.firstError;
+      }
+
+      //Keep the worst result: any failure beats a full socket
+      if (shardRet != STATSD_SUCCESS && ret != STATSD_UDP_SEND && ret != STATSD_MALLOC){
+         ret = shardRet;
+      }
+   }
+
+   if (report){
+      report->packets = packets;
+      report->sent = sent;
+      report->calls = calls;
+      report->firstError = firstError;
+      for (int i = 0; report->status && i < count && i < report->statusSize; i++){
+         report->status[i] = ret == STATSD_SUCCESS;
+      }
+   }
+
+   return ret;
+}
+
+/**
+   Give every queue that waits on a socket (the TCP transport's ring
+   buffer and the spill queue) a chance to send, for the client and each
+   of its servers.
+
+   @param[in] stats - The statsd client object
+*/
+static void drainQueues(Statsd* stats){
+   int count = stats->shards ? stats->shards->count : 1;
+   for (int i = 0; i < count; i++){
+      Statsd* server = stats->shards ? stats->shards->servers[i] : stats;
+
+#if !defined (_WIN32)
+      if (server->stream){
+         streamWrite(server);
+      }
+#endif
+
+      if (server->spill){
+         drainSpill(server);
+      }
+   }
+}
+
+/**
+   Free the servers of a sharded client, except for the client itself.
+*/
+static void freeShards(Shards* shards){
+   if (!shards){
+      return;
+   }
+
+   for (int i = 0; i < shards->count; i++){
+      if (i > 0){
+         statsd_free(shards->servers[i]);
+      }
+
+      free(shards->outboxes[i].data);
+      free(shards->outboxes[i].packetEnds);
+      free(shards->outboxes[i].iov);
+   }
+
+   free(shards->servers);
+   free(shards->outboxes);
+   free(shards->ring);
+   free(shards);
+}
+
+/**
+   Add to one of the client's internal counters. Stats can come from any
+   thread in concurrent mode, otherwise a plain add is enough.
+
+   @param[in] stats - The statsd client object
+   @param[in] counter - The counter, one of the fields of stats->counters
+   @param[in] amount - How much to add
+*/
+static inline void countStat(Statsd* stats, uint64_t* counter, uint64_t amount){
+   if (stats->concurrent){
+      __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+   }
+   else {
+      *counter += amount;
+   }
+}
+
+/**
+   Count the newlines in a list of pieces.
+
+   @param[in] pieces - The pieces to count
+   @param[in] count - The number of pieces
+   @param[out] bytes - Optional, the total length of the pieces is added
+      to it
+
+   @return The number of newlines
+*/
+static uint64_t countLines(const struct iovec* pieces, int count, uint64_t* bytes){
+   uint64_t lines = 0;
+
+   for (int i = 0; i < count; i++){
+      const char* data = (const char*)pieces[i].iov_base;
+      for (size_t c = 0; c < pieces[i].iov_len; c++){
+         lines += data[c] == '\n';
+      }
+
+      if (bytes){
+         *bytes += pieces[i].iov_len;
+      }
+   }
+
+   return lines;
+}
+
+/**
+   Count a datagram, or a write on the TCP transport, that was sent.
+
+   @param[in] stats - The statsd client object that sent it
+   @param[in] pieces - The pieces that were sent
+   @param[in] count - The number of pieces
+   @param[in] datagram - 1 if the pieces are a whole datagram, whose last
+      line may not end in a newline, 0 for part of a stream.
+*/
+static void countSent(Statsd* stats, const struct iovec* pieces, int count, int datagram){
+   uint64_t bytes = 0;
+   uint64_t metrics = countLines(pieces, count, &bytes);
+
+   if (datagram && count > 0){
+      const struct iovec* last = &pieces[count - 1];
+      metrics += last->iov_len > 0 && ((const char*)last->iov_base)[last->iov_len - 1] != '\n';
+   }
+
+   countStat(stats, &stats->counters.sent, metrics);
+   countStat(stats, &stats->counters.packets, 1);
+   countStat(stats, &stats->counters.bytes, bytes);
+}
+
+/**
+   Count a send system call, and how long it took if send timing is on.
+
+   @param[in] stats - The statsd client object that made the call
+   @param[in] started - When the call started, from monotonicNanos(), or 0
+      if it was not timed
+   @param[in] failed - 1 if the call returned an error
+*/
+static void countCall(Statsd* stats, uint64_t started, int failed){
+   countStat(stats, &stats->counters.calls, 1);
+   if (failed){
+      countStat(stats, &stats->counters.failedCalls, 1);
+   }
+
+   if (started){
+      //Bucket 0 is under 1us, bucket i is [2^(i-1), 2^i) microseconds
+      uint64_t micros = (monotonicNanos() - started) / 1000;
+      int index = micros ? 64 - __builtin_clzll(micros) : 0;
+      if (index >= STATSD_LATENCY_BUCKETS){
+         index = STATSD_LATENCY_BUCKETS - 1;
+      }
+
+      countStat(stats, &stats->counters.sendLatency[index], 1);
+   }
+}
+
+/**
+   A monotonic clock in nanoseconds, for timing system calls.
+*/
+static uint64_t monotonicNanos(void){
+#if defined (_WIN32)
+   LARGE_INTEGER frequency;
+   LARGE_INTEGER counter;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+   return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+//Nanoseconds per tick of the time stamp counter, 0 until it is calibrated
+static double tscNanos = 0.0;
+
+/**
+   Read the clock a timer runs on. The result is only meaningful as the
+   difference of two reads, see clockMicros().
+
+   @param[in] clock - The clock to read
+
+   @return The clock's current reading, in its own units
+*/
+static inline uint64_t readClock(StatsdClock clock){
+#if defined (HAVE_TSC)
+   if (clock == STATSD_CLOCK_TSC){
+      return __builtin_ia32_rdtsc();
+   }
+#else
+   (void)clock;
+#endif
+
+   return monotonicNanos();
+}
+
+/**
+   Turn the difference between two reads of a clock into microseconds.
+
+   @param[in] clock - The clock that was read
+   @param[in] elapsed - The difference between the two readings
+
+   @return The elapsed time in microseconds
+*/
+static inline uint64_t clockMicros(StatsdClock clock, uint64_t elapsed){
+#if defined (HAVE_TSC)
+   if (clock == STATSD_CLOCK_TSC){
+      double nanos;
+      __atomic_load(&tscNanos, &nanos, __ATOMIC_RELAXED);
+      return (uint64_t)((double)elapsed * nanos) / 1000;
+   }
+#else
+   (void)clock;
+#endif
+
+   return elapsed / 1000;
+}
+
+#if defined (HAVE_TSC)
+/**
+   Check that the processor has an invariant time stamp counter, one that
+   ticks at a constant rate whatever the power state of the core.
+
+   @return 1 if it does, 0 if not
+*/
+static int invariantTsc(void){
+   unsigned int eax, ebx, ecx, edx;
+   if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)){
+      return 0;
+   }
+
+   return (edx & (1u << 8)) != 0;
+}
+
+/**
+   Measure the rate of the time stamp counter against the monotonic clock
+   over TSC_CALIBRATION_MILLIS.
+
+   @return The number of nanoseconds per tick, or 0 if the counter did
+      not move
+*/
+static double calibrateTsc(void){
+   uint64_t startNanos = monotonicNanos();
+   uint64_t startTicks = __builtin_ia32_rdtsc();
+
+#if defined (_WIN32)
+   Sleep(TSC_CALIBRATION_MILLIS);
+#else
+   struct timespec pause = { 0, TSC_CALIBRATION_MILLIS * 1000000L };
+   while (nanosleep(&pause, &pause) == -1 && errno == EINTR);
+#endif
+
+   uint64_t ticks = __builtin_ia32_rdtsc() - startTicks;
+   uint64_t nanos = monotonicNanos() - startNanos;
+   if (ticks == 0){
+      return 0.0;
+   }
+
+   return (double)nanos / (double)ticks;
+}
+#endif
+
+/**
+   Send the client's own counters to its server, as counts of what changed
+   since the last report. Does nothing if self reporting is off, or if the
+   last report was less then SELF_REPORT_INTERVAL seconds ago.
+
+   @param[in] stats - The statsd client object
+*/
+static void reportSelf(Statsd* stats){
+   SelfReport* self = stats->selfReport;
+   time_t now = time(NULL);
+   if (!self || now - self->reportedAt < SELF_REPORT_INTERVAL){
+      return;
+   }
+
+   StatsdInternalStats current;
+   statsd_getInternalStats(stats, &current);
+
+   const StatsdInternalStats* last = &self->reported;
+   const struct {
+      const char* name;
+      uint64_t value;
+   } counts[] = {
+      { "sampled_out", current.sampledOut - last->sampledOut },
+      { "serialized", current.serialized - last->serialized },
+      { "batched", current.batched - last->batched },
+      { "sent", current.sent - last->sent },
+      { "packets", current.packets - last->packets },
+      { "bytes", current.bytes - last->bytes },
+      { "calls", current.calls - last->calls },
+      { "failed_calls", current.failedCalls - last->failedCalls },
+      { "dropped", current.dropped - last->dropped },
+      { "dropped_bytes", current.droppedBytes - last->droppedBytes }
+   };
+
+   char lines[STAT_MAX_SIZE * 2];
+   int length = 0;
+   for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++){
+      if (counts[i].value == 0){
+         continue;
+      }
+
+      int lineLength = buildStatString(lines + length, sizeof(lines) - length - 1, self->nameSpace, counts[i].name, STATSD_COUNT, (long long)counts[i].value, NO_SAMPLE_RATE, stats->tags, NULL);
+      if (lineLength > 0){
+         length += lineLength;
+         lines[length++] = '\n';
+      }
+   }
+
+   //How full the batches sent since the last report were, in percent
+   uint64_t batches = current.batches - last->batches;
+   if (batches > 0){
+      long long fill = (long long)((current.batchBytes - last->batchBytes) * 100 / (batches * stats->packetSize));
+      int lineLength = buildStatString(lines + length, sizeof(lines) - length - 1, self->nameSpace, "batch_fill", STATSD_GAUGE, fill, NO_SAMPLE_RATE, stats->tags, NULL);
+      if (lineLength > 0){
+         length += lineLength;
+         lines[length++] = '\n';
+      }
+   }
+
+   self->reportedAt = now;
+   self->reported = current;
+
+   if (length > 0){
+      struct iovec iov[8];
+      int count = splitLines(lines, length, stats->packetSize, iov, 8);
+      sendPackets(stats, iov, NULL, count < 8 ? count : 8, NULL);
+   }
+}
+
+/**
+   Split a block of newline separated stat strings on line boundaries
+   into datagrams no larger then the packet size. A single line that is
+   larger then that is put in a datagram of its own.
+
+   @param[in] lines - The stat strings
+   @param[in] length - The length of the block
+   @param[in] packetSize - The largest datagram to build
+   @param[out] iov - Filled in with up to max datagrams
+   @param[in] max - The number of entries iov can hold
+
+   @return The number of datagrams the block needs, which can be more
+      then max.
+*/
+static int splitLines(const char* lines, int length, int packetSize, struct iovec* iov, int max){
+   int count = 0;
+   int start = 0;
+   int end = 0;
+
+   while (end < length){
+      const char* newline = (const char*)memchr(lines + end, '\n', length - end);
+      int lineEnd = newline ? (int)(newline - lines) + 1 : length;
+
+      if (end > start && lineEnd - start > packetSize){
+         if (count < max){
+            iov[count].iov_base = (void*)(lines + start);
+            iov[count].iov_len = end - start;
+         }
+
+         count++;
+         start = end;
+      }
+
+      end = lineEnd;
+   }
+
+   if (end > start){
+      if (count < max){
+         iov[count].iov_base = (void*)(lines + start);
+         iov[count].iov_len = end - start;
+      }
+
+      count++;
+   }
+
+   return count;
+}
+
+/**
+   Make sure an iovec array (and its matching parts array, if there is
+   one) has room for at least count entries.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if out of memory
+*/
+static int reserveIov(struct iovec** iov, int** parts, int* capacity, int count){
+   if (count <= *capacity){
+      return STATSD_SUCCESS;
+   }
+
+   int size = *capacity ? *capacity : 16;
+   while (size < count){
+      size *= 2;
+   }
+
+   struct iovec* newIov = (struct iovec*)realloc(*iov, size * sizeof(struct iovec));
+   if (!newIov){
+      return STATSD_MALLOC;
+   }
+   *iov = newIov;
+
+   if (parts){
+      int* newParts = (int*)realloc(*parts, size * sizeof(int));
+      if (!newParts){
+         return STATSD_MALLOC;
+      }
+      *parts = newParts;
+   }
+
+   *capacity = size;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Make sure an outbox has room for at least length more bytes.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the outbox could
+      not be grown.
+*/
+static int outboxReserve(Outbox* outbox, int length){
+   if (outbox->length + length <= outbox->capacity){
+      return STATSD_SUCCESS;
+   }
+
+   int capacity = outbox->capacity ? outbox->capacity * 2 : STAT_MAX_SIZE * 4;
+   while (outbox->length + length > capacity){
+      capacity *= 2;
+   }
+
+   char* data = (char*)realloc(outbox->data, capacity);
+   if (!data){
+      return STATSD_MALLOC;
+   }
+
+   outbox->data = data;
+   outbox->capacity = capacity;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Accept a stat string that has been written at the end of an outbox,
+   and terminate it with a newline. If it does not fit in the current
+   packet a new packet is started with it.
+
+   @param[in,out] outbox - The outbox the stat was written to
+   @param[in] length - The length of the stat string
+   @param[in] packetSize - The largest packet to build
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the packet list
+      could not be grown.
+*/
+static int outboxCommit(Outbox* outbox, int length, int packetSize){
+   if (outbox->length > outbox->packetStart && outbox->length - outbox->packetStart + length + 1 > packetSize){
+      if (outbox->packetCount == outbox->packetCapacity){
+         int capacity = outbox->packetCapacity ? outbox->packetCapacity * 2 : 16;
+         int* packetEnds = (int*)realloc(outbox->packetEnds, capacity * sizeof(int));
+         if (!packetEnds){
+            return STATSD_MALLOC;
+         }
+
+         outbox->packetEnds = packetEnds;
+         outbox->packetCapacity = capacity;
+      }
+
+      outbox->packetEnds[outbox->packetCount++] = outbox->length;
+      outbox->packetStart = outbox->length;
+   }
+
+   outbox->length += length;
+   outbox->data[outbox->length++] = '\n';
+   return STATSD_SUCCESS;
+}
+
+/**
+   Build a stat string straight into the end of an outbox.
+
+   @return STATSD_SUCCESS on success, or the error from building or
+      adding the stat.
+*/
+static int outboxStat(Outbox* outbox, const char* nameSpace, const char* bucket, StatsType type, long long value, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags, int packetSize){
+   char digits[20];
+   int valueLength = formatInteger(digits, value);
+   return outboxValue(outbox, nameSpace, bucket, type, digits, valueLength, sampleRate, defaults, tags, packetSize);
+}
+
+/**
+   Add a stat with a value that is already formatted to an outbox, like
+   outboxStat().
+
+   @param[in,out] outbox - The outbox
+   @param[in] nameSpace - The namespace of the stat
+   @param[in] bucket - The bucket of the stat
+   @param[in] type - The type of the stat
+   @param[in] value - The formatted value of the stat
+   @param[in] valueLength - The length of the value
+   @param[in] sampleRate - The sample rate of the stat
+   @param[in] defaults - The client's default tags, or NULL
+   @param[in] tags - The stat's own tags, or NULL
+   @param[in] packetSize - The largest packet the outbox may build
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the outbox could not
+      grow, STATSD_BATCH_FULL if the stat is too big.
+*/
+static int outboxValue(Outbox* outbox, const char* nameSpace, const char* bucket, StatsType type, const char* value, int valueLength, double sampleRate, const StatsdTags* defaults, const StatsdTags* tags, int packetSize){
+   if (outboxReserve(outbox, STAT_MAX_SIZE + 1) != STATSD_SUCCESS){
+      return STATSD_MALLOC;
+   }
+
+   int strLength = buildStatValue(outbox->data + outbox->length, STAT_MAX_SIZE, nameSpace, bucket, type, value, valueLength, sampleRate, defaults, tags);
+   if (strLength < 0){
+      return -strLength;
+   }
+
+   return outboxCommit(outbox, strLength, packetSize);
+}
+
+/**
+   Send every packet in an outbox and empty it. The buffers are kept
+   for the next time the outbox is filled.
+
+   @return STATSD_SUCCESS if every packet was sent, STATSD_UDP_SEND if
+      any of them failed, STATSD_MALLOC if out of memory.
+*/
+static int sendOutbox(Statsd* stats, Outbox* outbox, StatsdSendReport* report){
+   if (outbox->length == 0){
+      return STATSD_SUCCESS;
+   }
+
+   int count = outboxPackets(outbox);
+   if (count < 0){
+      return STATSD_MALLOC;
+   }
+
+   int ret = sendPackets(stats, outbox->iov, NULL, count, report);
+   outboxClear(outbox);
+   return ret;
+}
+
+/**
+   Point the outbox's iov at each of its packets.
+
+   @return The number of packets, or -1 if the iov could not be grown.
+*/
+static int outboxPackets(Outbox* outbox){
+   int count = outbox->packetCount + 1;
+   if (reserveIov(&outbox->iov, NULL, &outbox->iovCapacity, count) != STATSD_SUCCESS){
+      return -1;
+   }
+
+   int start = 0;
+   for (int i = 0; i < count; i++){
+      int end = i < outbox->packetCount ? outbox->packetEnds[i] : outbox->length;
+      outbox->iov[i].iov_base = outbox->data + start;
+      outbox->iov[i].iov_len = end - start;
+      start = end;
+   }
+
+   return count;
+}
+
+/**
+   Empty an outbox, keeping its buffers for the next time it is filled.
+*/
+static void outboxClear(Outbox* outbox){
+   outbox->length = 0;
+   outbox->packetStart = 0;
+   outbox->packetCount = 0;
+}
+
+/**
+   FNV-1a hash of a bucket name, mixed with the stat type so the
+   same bucket name can be aggregated as more then one type.
+*/
+static uint64_t hashBucket(const char* bucket, StatsType type){
+   uint64_t hash = 14695981039346656037ULL;
+   for (const unsigned char* c = (const unsigned char*)bucket; *c; c++){
+      hash ^= *c;
+      hash *= 1099511628211ULL;
+   }
+
+   hash ^= (uint64_t)type;
+   hash *= 1099511628211ULL;
+   return hash;
+}
+
+/**
+   Double the size of the aggregate table and rehash all of the
+   entries into it.
+
+   @param[in,out] aggregator - The aggregate table to grow
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the new table
+      could not be allocated.
+*/
+static int growAggregator(Aggregator* aggregator){
+   int capacity = aggregator->capacity * 2;
+   Aggregate* entries = (Aggregate*)calloc(capacity, sizeof(Aggregate));
+   if (!entries){
+      return STATSD_MALLOC;
+   }
+
+   for (int i = 0; i < aggregator->capacity; i++){
+      Aggregate* old = &aggregator->entries[i];
+      if (!old->bucket){
+         continue;
+      }
+
+      int slot = (int)(old->hash & (capacity - 1));
+      while (entries[slot].bucket){
+         slot = (slot + 1) & (capacity - 1);
+      }
+
+      entries[slot] = *old;
+   }
+
+   free(aggregator->entries);
+   aggregator->entries = entries;
+   aggregator->capacity = capacity;
+
+   //The wheel links entries by their index, which the rehash changed
+   if (aggregator->wheel){
+      rebuildWheel(aggregator);
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Find the aggregate for a bucket, creating it if this is the first
+   time the bucket has been seen.
+
+   @param[in,out] aggregator - The aggregate table
+   @param[in] bucket - The bucket name
+   @param[in] type - The type of the stat
+   @param[in] tags - The stat's own tags, or NULL. They are copied.
+
+   @return The aggregate entry, or NULL if memory could not be allocated
+*/
+static Aggregate* findAggregate(Aggregator* aggregator, const char* bucket, StatsType type, const StatsdTags* tags){
+   if ((aggregator->used + 1) * 4 > aggregator->capacity * 3){
+      if (growAggregator(aggregator) != STATSD_SUCCESS){
+         return NULL;
+      }
+   }
+
+   //The same bucket with different tags is a different aggregate
+   uint64_t hash = hashBucket(bucket, type);
+   if (tags && tags->length){
+      hash ^= hashName(tags->data, tags->length);
+   }
+
+   int mask = aggregator->capacity - 1;
+
+   for (int slot = (int)(hash & mask);; slot = (slot + 1) & mask){
+      Aggregate* entry = &aggregator->entries[slot];
+      if (!entry->bucket){
+         size_t length = strlen(bucket) + 1;
+         entry->bucket = (char*)malloc(length);
+         if (!entry->bucket){
+            return NULL;
+         }
+
+         if (copyTags(tags, &entry->tags) != STATSD_SUCCESS){
+            free(entry->bucket);
+            entry->bucket = NULL;
+            return NULL;
+         }
+
+         memcpy(entry->bucket, bucket, length);
+         entry->hash = hash;
+         entry->type = type;
+         aggregator->used++;
+         return entry;
+      }
+
+      if (entry->hash == hash && entry->type == type && strcmp(entry->bucket, bucket) == 0 && sameTags(entry->tags, tags)){
+         return entry;
+      }
+   }
+}
+
+/**
+   Add a member to the unique members of a set aggregate. Members that
+   have already been seen since the last flush are ignored. The member
+   table marks empty slots with SET_EMPTY_SLOT, so that value is kept in
+   a flag of its own.
+
+   @param[in,out] entry - The set aggregate
+   @param[in] member - The set member
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the member table
+      could not be grown.
+*/
+static int addSetMember(Aggregate* entry, int64_t member){
+   if (member == SET_EMPTY_SLOT){
+      if (!entry->hasEmptySlotMember){
+         entry->hasEmptySlotMember = 1;
+         entry->memberCount++;
+      }
+      return STATSD_SUCCESS;
+   }
+
+   if ((entry->memberCount + 1) * 4 > entry->memberCapacity * 3){
+      int capacity = entry->memberCapacity ? entry->memberCapacity * 2 : SET_DEFAULT_CAPACITY;
+      int64_t* members = (int64_t*)malloc(capacity * sizeof(int64_t));
+      if (!members){
+         return STATSD_MALLOC;
+      }
+
+      for (int i = 0; i < capacity; i++){
+         members[i] = SET_EMPTY_SLOT;
+      }
+
+      for (int i = 0; i < entry->memberCapacity; i++){
+         if (entry->members[i] == SET_EMPTY_SLOT){
+            continue;
+         }
+
+         int slot = (int)(((uint64_t)entry->members[i] * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+         while (members[slot] != SET_EMPTY_SLOT){
+            slot = (slot + 1) & (capacity - 1);
+         }
+
+         members[slot] = entry->members[i];
+      }
+
+      free(entry->members);
+      entry->members = members;
+      entry->memberCapacity = capacity;
+   }
+
+   int mask = entry->memberCapacity - 1;
+   for (int slot = (int)(((uint64_t)(int64_t)member * 0x9E3779B97F4A7C15ULL) >> 32) & mask;; slot = (slot + 1) & mask){
+      if (entry->members[slot] == member){
+         return STATSD_SUCCESS;
+      }
+
+      if (entry->members[slot] == SET_EMPTY_SLOT){
+         entry->members[slot] = member;
+         entry->memberCount++;
+         return STATSD_SUCCESS;
+      }
+   }
+}
+
+/**
+   Fold a stat into the local aggregate for its bucket. Sampled counts
+   are scaled by the sample rate so the flushed sum does not need to
+   carry a rate.
+
+   @param[in] stats - The statsd client object
+   @param[in] bucket - The bucket name
+   @param[in] type - The type of the stat
+   @param[in] value - The value of the stat
+   @param[in] sampleRate - The sample rate the stat was gathered at
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the aggregate
+      could not be allocated, STATSD_BAD_STATS_TYPE if the type can not
+      be aggregated.
+*/
+static int aggregate(Statsd* stats, const char* bucket, StatsType type, int64_t value, double sampleRate, const StatsdTags* tags){
+   Aggregate* entry = findAggregate(stats->aggregator, bucket, type, tags);
+   if (!entry){
+      return STATSD_MALLOC;
+   }
+
+   switch(type){
+      case STATSD_COUNT:
+         if (sampleRate > 0.0 && sampleRate < 1.0){
+            entry->count += value / sampleRate;
+         }
+         else {
+            entry->count += value;
+         }
+         break;
+      case STATSD_GAUGE:
+         entry->gauge = value;
+         entry->fractional = 0;
+         break;
+      case STATSD_SET:
+         if (entry->sketching){
+            sketchMember(entry, value);
+            break;
+         }
+
+         if (addSetMember(entry, value) != STATSD_SUCCESS){
+            return STATSD_MALLOC;
+         }
+
+         //Past the threshold the exact members are traded for a sketch
+         if (stats->aggregator->cardinality && entry->memberCount > stats->aggregator->setThreshold){
+            if (startSketch(entry) != STATSD_SUCCESS){
+               return STATSD_MALLOC;
+            }
+         }
+         break;
+      case STATSD_TIMING:
+         if (recordTiming(entry, millisToMicros(value), sampleRate) != STATSD_SUCCESS){
+            return STATSD_MALLOC;
+         }
+         break;
+      default:
+         return STATSD_BAD_STATS_TYPE;
+   }
+
+   markDirty(stats, entry);
+   return STATSD_SUCCESS;
+}
+
+/**
+   Fold a floating point stat into the local aggregate for its bucket.
+   Counts and gauges that were given a fraction are flushed with one.
+   Set members are whole numbers, so a fractional member is truncated.
+
+   @param[in] stats - The statsd client object
+   @param[in] bucket - The bucket name
+   @param[in] type - The type of the stat
+   @param[in] value - The value of the stat, a finite number
+   @param[in] sampleRate - The sample rate the stat was gathered at
+   @param[in] tags - The stat's own tags, or NULL
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the aggregate
+      could not be allocated, STATSD_BAD_STATS_TYPE if the type can not
+      be aggregated.
+*/
+static int aggregateDouble(Statsd* stats, const char* bucket, StatsType type, double value, double sampleRate, const StatsdTags* tags){
+   if (type == STATSD_SET){
+      return aggregate(stats, bucket, type, (int64_t)value, sampleRate, tags);
+   }
+
+   Aggregate* entry = findAggregate(stats->aggregator, bucket, type, tags);
+   if (!entry){
+      return STATSD_MALLOC;
+   }
+
+   switch(type){
+      case STATSD_COUNT:
+         if (sampleRate > 0.0 && sampleRate < 1.0){
+            value /= sampleRate;
+         }
+         entry->count += value;
+         entry->fractional = 1;
+         break;
+      case STATSD_GAUGE:
+         entry->realGauge = value;
+         entry->fractional = 1;
+         break;
+      case STATSD_TIMING:
+         if (recordTiming(entry, realMillisToMicros(value), sampleRate) != STATSD_SUCCESS){
+            return STATSD_MALLOC;
+         }
+         break;
+      default:
+         return STATSD_BAD_STATS_TYPE;
+   }
+
+   markDirty(stats, entry);
+   return STATSD_SUCCESS;
+}
+
+/**
+   Scramble a value (a set member, a sampling key) into a well distributed
+   64 bit hash, using the splitmix64 finalizer.
+*/
+static uint64_t mixHash(uint64_t value){
+   uint64_t hash = value + 0x9E3779B97F4A7C15ULL;
+   hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+   return hash ^ (hash >> 31);
+}
+
+/**
+   Add a member to the HyperLogLog sketch of a set. The top bits of the
+   hash pick a register, which keeps the longest run of leading zeros
+   seen in the rest of the hash.
+*/
+static void sketchMember(Aggregate* entry, int64_t member){
+   uint64_t hash = mixHash((uint64_t)member);
+   int index = (int)(hash >> (64 - HLL_BITS));
+   uint64_t rest = (hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+   uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+
+   if (rank > entry->registers[index]){
+      entry->registers[index] = rank;
+   }
+}
+
+/**
+   Switch a set from exact members to a sketch, moving every member seen
+   so far into the sketch. The member table is kept for the next interval.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the sketch could
+      not be allocated.
+*/
+static int startSketch(Aggregate* entry){
+   if (!entry->registers){
+      entry->registers = (uint8_t*)calloc(HLL_REGISTERS, 1);
+      if (!entry->registers){
+         return STATSD_MALLOC;
+      }
+   }
+
+   for (int m = 0; m < entry->memberCapacity; m++){
+      if (entry->members[m] != SET_EMPTY_SLOT){
+         sketchMember(entry, entry->members[m]);
+         entry->members[m] = SET_EMPTY_SLOT;
+      }
+   }
+
+   if (entry->hasEmptySlotMember){
+      sketchMember(entry, SET_EMPTY_SLOT);
+      entry->hasEmptySlotMember = 0;
+   }
+
+   entry->memberCount = 0;
+   entry->sketching = 1;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Estimate the number of unique members in a set's sketch, using linear
+   counting while there are still empty registers and the estimate is small.
+*/
+static uint64_t estimateCardinality(const Aggregate* entry){
+   double sum = 0.0;
+   int zeros = 0;
+   for (int i = 0; i < HLL_REGISTERS; i++){
+      sum += 1.0 / (double)(1ULL << entry->registers[i]);
+      if (entry->registers[i] == 0){
+         zeros++;
+      }
+   }
+
+   double alpha = 0.7213 / (1.0 + 1.079 / HLL_REGISTERS);
+   double estimate = alpha * HLL_REGISTERS * HLL_REGISTERS / sum;
+
+   if (estimate <= 2.5 * HLL_REGISTERS && zeros > 0){
+      estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeros);
+   }
+
+   return (uint64_t)(estimate + 0.5);
+}
+
+/**
+   Find the histogram bucket of a value. Values below 32 each get their
+   own bucket, above that every power of 2 is split into 16 buckets, up
+   to the last bucket that holds everything from 2^48 on.
+*/
+static int histogramIndex(uint64_t value){
+   if (value < 2 * HISTOGRAM_SUB_BUCKETS){
+      return (int)value;
+   }
+
+   int highBit = 63 - __builtin_clzll(value);
+   if (highBit >= HISTOGRAM_MAX_BITS){
+      return HISTOGRAM_BUCKETS - 1;
+   }
+
+   int shift = highBit - HISTOGRAM_SUB_BITS;
+   return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+/**
+   The value in the middle of a histogram bucket.
+*/
+static uint64_t histogramValue(int index){
+   if (index < 2 * HISTOGRAM_SUB_BUCKETS){
+      return (uint64_t)index;
+   }
+
+   int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+   uint64_t low = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+   return low + ((1ULL << shift) >> 1);
+}
+
+/**
+   Estimate a percentile from a histogram. The estimate is clamped to the
+   exact minimum and maximum.
+
+   @param[in] histogram - The histogram, which must not be empty
+   @param[in] percentile - The percentile, between 0 and 100
+
+   @return The estimated value at the percentile
+*/
+static uint64_t histogramPercentile(const Histogram* histogram, double percentile){
+   uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+   if (rank < 1){
+      rank = 1;
+   }
+
+   uint64_t seen = 0;
+   uint64_t value = histogram->max;
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+      seen += histogram->buckets[i];
+      if (seen >= rank){
+         value = histogramValue(i);
+         break;
+      }
+   }
+
+   if (value < histogram->min){
+      return histogram->min;
+   }
+
+   if (value > histogram->max){
+      return histogram->max;
+   }
+
+   return value;
+}
+
+/**
+   Convert a timing in milliseconds to microseconds for the histogram.
+   Negative timings count as 0, and timings too long for 64 bits of
+   microseconds saturate so they land in the last bucket.
+*/
+static uint64_t millisToMicros(int64_t millis){
+   if (millis <= 0){
+      return 0;
+   }
+
+   return (uint64_t)millis >= UINT64_MAX / 1000 ? UINT64_MAX : (uint64_t)millis * 1000;
+}
+
+/**
+   The same as millisToMicros(), for a fractional timing. A double of
+   2^64 or more can't be converted to an integer, so those saturate too.
+*/
+static uint64_t realMillisToMicros(double millis){
+   if (!(millis > 0)){
+      return 0;
+   }
+
+   double micros = millis * 1000.0 + 0.5;
+   return micros >= 18446744073709551616.0 ? UINT64_MAX : (uint64_t)micros;
+}
+
+/**
+   Record a timing in an aggregate's histogram. A sampled timing counts
+   as 1/sampleRate observations.
+
+   @param[in,out] entry - The timing aggregate
+   @param[in] micros - The timing in microseconds
+   @param[in] sampleRate - The sample rate the timing was gathered at
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the histogram
+      could not be allocated.
+*/
+static int recordTiming(Aggregate* entry, uint64_t micros, double sampleRate){
+   if (!entry->histogram){
+      entry->histogram = (Histogram*)calloc(1, sizeof(Histogram));
+      if (!entry->histogram){
+         return STATSD_MALLOC;
+      }
+   }
+
+   Histogram* histogram = entry->histogram;
+   uint64_t value = micros;
+   uint32_t weight = 1;
+   if (sampleRate > 0.0 && sampleRate < 1.0){
+      weight = (uint32_t)(1.0 / sampleRate + 0.5);
+   }
+
+   if (histogram->count == 0 || value < histogram->min){
+      histogram->min = value;
+   }
+
+   if (histogram->count == 0 || value > histogram->max){
+      histogram->max = value;
+   }
+
+   histogram->count += weight;
+   histogram->buckets[histogramIndex(value)] += weight;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Write the summary of a timing histogram into the aggregator's outbox
+   and reset it. Depending on how timing aggregation was enabled this is
+   either a gauge for every percentile plus the count, minimum and maximum,
+   or a bounded number of representative timings with a sample rate that
+   makes the server count them as the real number of observations. Times
+   are written in milliseconds with their microseconds kept, as
+   sendTiming() does.
+
+   @param[in] stats - The statsd client object
+   @param[in,out] entry - The timing aggregate
+
+   @return STATSD_SUCCESS on success, or the first error from building
+      the stats.
+*/
+static int flushTiming(Statsd* stats, Aggregate* entry){
+   Aggregator* aggregator = stats->aggregator;
+   Histogram* histogram = entry->histogram;
+   Outbox* outbox = &aggregator->outbox;
+   int ret = STATSD_SUCCESS;
+   int status = STATSD_SUCCESS;
+   char value[24];
+   int valueLength;
+
+   if (!histogram || histogram->count == 0){
+      return STATSD_SUCCESS;
+   }
+
+   if (aggregator->timingSamples > 0){
+      //Send evenly spaced quantiles of the histogram, each standing
+      //in for count/samples observations.
+      uint64_t samples = aggregator->timingSamples;
+      double sampleRate = NO_SAMPLE_RATE;
+      if (histogram->count > samples){
+         sampleRate = (double)samples / histogram->count;
+      }
+      else {
+         samples = histogram->count;
+      }
+
+      for (uint64_t i = 0; i < samples; i++){
+         valueLength = formatMillis(value, histogramPercentile(histogram, (i + 0.5) * 100.0 / samples));
+         status = outboxValue(outbox, stats->nameSpace, entry->bucket, STATSD_TIMING, value, valueLength, sampleRate, stats->tags, entry->tags, stats->packetSize);
+         if (ret == STATSD_SUCCESS){
+            ret = status;
+         }
+      }
+   }
+   else {
+      size_t length = strlen(entry->bucket);
+      char name[STAT_MAX_SIZE];
+      if (length + PERCENTILE_NAME_SIZE > sizeof(name)){
+         return STATSD_BAD_BUCKET;
+      }
+
+      memcpy(name, entry->bucket, length);
+
+      for (int i = 0; i < aggregator->percentileCount; i++){
+         valueLength = formatMillis(value, histogramPercentile(histogram, aggregator->percentiles[i]));
+         strcpy(name + length, aggregator->percentileNames[i]);
+         status = outboxValue(outbox, stats->nameSpace, name, STATSD_GAUGE, value, valueLength, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         if (ret == STATSD_SUCCESS){
+            ret = status;
+         }
+      }
+
+      const char* names[] = { ".count", ".min", ".max" };
+      char values[3][24];
+      int lengths[] = {
+         formatInteger(values[0], (long long)histogram->count),
+         formatMillis(values[1], histogram->min),
+         formatMillis(values[2], histogram->max)
+      };
+
+      for (int i = 0; i < 3; i++){
+         strcpy(name + length, names[i]);
+         status = outboxValue(outbox, stats->nameSpace, name, STATSD_GAUGE, values[i], lengths[i], NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         if (ret == STATSD_SUCCESS){
+            ret = status;
+         }
+      }
+   }
+
+   memset(histogram, 0, sizeof(Histogram));
+   return ret;
+}
+
+/**
+   Write the lines of one updated bucket into the aggregator's outbox and
+   reset the aggregate for the next interval.
+
+   @param[in] stats - The statsd client object
+   @param[in,out] entry - The dirty aggregate
+
+   @return STATSD_SUCCESS on success, or the first error from building
+      the stats. The aggregate is reset either way.
+*/
+static int flushEntry(Statsd* stats, Aggregate* entry){
+   Aggregator* aggregator = stats->aggregator;
+   Outbox* outbox = &aggregator->outbox;
+
+   int status = STATSD_SUCCESS;
+   switch(entry->type){
+      case STATSD_COUNT:
+         if (entry->fractional){
+            char digits[FLOAT_MAX_SIZE];
+            int length = formatDouble(digits, entry->count);
+            status = outboxValue(outbox, stats->nameSpace, entry->bucket, STATSD_COUNT, digits, length, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         }
+         else {
+            status = outboxStat(outbox, stats->nameSpace, entry->bucket, STATSD_COUNT, (long long)(entry->count < 0 ? entry->count - 0.5 : entry->count + 0.5), NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         }
+         entry->count = 0;
+         entry->fractional = 0;
+         break;
+      case STATSD_GAUGE:
+         if (entry->fractional){
+            char digits[FLOAT_MAX_SIZE];
+            int length = formatDouble(digits, entry->realGauge);
+            status = outboxValue(outbox, stats->nameSpace, entry->bucket, STATSD_GAUGE, digits, length, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         }
+         else {
+            status = outboxStat(outbox, stats->nameSpace, entry->bucket, STATSD_GAUGE, entry->gauge, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+         }
+         break;
+      case STATSD_SET:
+         if (aggregator->cardinality){
+            uint64_t cardinality = entry->sketching ? estimateCardinality(entry) : (uint64_t)entry->memberCount;
+            status = outboxStat(outbox, stats->nameSpace, entry->bucket, STATSD_GAUGE, (long long)cardinality, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+            if (entry->registers){
+               memset(entry->registers, 0, HLL_REGISTERS);
+            }
+            entry->sketching = 0;
+         }
+
+         for (int m = 0; m < entry->memberCapacity; m++){
+            if (entry->members[m] == SET_EMPTY_SLOT){
+               continue;
+            }
+
+            if (aggregator->cardinality){
+               entry->members[m] = SET_EMPTY_SLOT;
+               continue;
+            }
+
+            int memberStatus = outboxStat(outbox, stats->nameSpace, entry->bucket, STATSD_SET, entry->members[m], NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+            if (status == STATSD_SUCCESS){
+               status = memberStatus;
+            }
+
+            entry->members[m] = SET_EMPTY_SLOT;
+         }
+
+         if (entry->hasEmptySlotMember && !aggregator->cardinality){
+            int memberStatus = outboxStat(outbox, stats->nameSpace, entry->bucket, STATSD_SET, SET_EMPTY_SLOT, NO_SAMPLE_RATE, stats->tags, entry->tags, stats->packetSize);
+            if (status == STATSD_SUCCESS){
+               status = memberStatus;
+            }
+         }
+         entry->hasEmptySlotMember = 0;
+         entry->memberCount = 0;
+         break;
+      case STATSD_TIMING:
+         status = flushTiming(stats, entry);
+         break;
+      default:
+         break;
+   }
+
+   entry->dirty = 0;
+   entry->next = -1;
+   return status;
+}
+
+/**
+   Send everything that has been written into the aggregator's outbox.
+
+   @param[in] stats - The statsd client object
+   @param[in] ret - The status of building the lines
+   @return ret if it was an error, otherwise the result of the send.
+*/
+static int sendAggregates(Statsd* stats, int ret){
+   Outbox* outbox = &stats->aggregator->outbox;
+   struct iovec built = { outbox->data, (size_t)outbox->length };
+   stats->counters.serialized += countLines(&built, 1, NULL);
+
+   int sent = sendOutbox(stats, outbox, NULL);
+   if (ret == STATSD_SUCCESS){
+      ret = sent;
+   }
+
+   return ret;
+}
+
+/**
+   Write one line per updated bucket into the aggregator's outbox, send
+   all of the packets at once, and reset the aggregates for the next
+   interval. This flushes every bucket, so the timer wheel is emptied.
+
+   @param[in] stats - The statsd client object
+   @return STATSD_SUCCESS on success, otherwise the first error that
+      happened while building or sending. Every bucket is reset either way.
+*/
+static int flushAggregates(Statsd* stats){
+   Aggregator* aggregator = stats->aggregator;
+   int ret = STATSD_SUCCESS;
+
+   for (int i = 0; i < aggregator->capacity; i++){
+      Aggregate* entry = &aggregator->entries[i];
+      if (!entry->bucket || !entry->dirty){
+         continue;
+      }
+
+      int status = flushEntry(stats, entry);
+      if (ret == STATSD_SUCCESS){
+         ret = status;
+      }
+   }
+
+   if (aggregator->wheel){
+      for (int i = 0; i < WHEEL_SLOTS; i++){
+         aggregator->wheel[i] = -1;
+      }
+
+      aggregator->wheelDeadline = NO_DEADLINE;
+   }
+
+   return sendAggregates(stats, ret);
+}
+
+/**
+   Free an aggregate table and all of the buckets in it.
+*/
+static void freeAggregator(Aggregator* aggregator){
+   if (!aggregator){
+      return;
+   }
+
+   for (int i = 0; i < aggregator->capacity; i++){
+      free(aggregator->entries[i].bucket);
+      free(aggregator->entries[i].tags);
+      free(aggregator->entries[i].members);
+      free(aggregator->entries[i].registers);
+      free(aggregator->entries[i].histogram);
+   }
+
+   free(aggregator->entries);
+   free(aggregator->wheel);
+   free(aggregator->percentiles);
+   free(aggregator->percentileNames);
+   free(aggregator->outbox.data);
+   free(aggregator->outbox.packetEnds);
+   free(aggregator->outbox.iov);
+   free(aggregator);
+}
+
+/**
+   Mark an aggregate as updated since the last flush. With the flush
+   scheduler on, the first update of an interval puts it on the wheel.
+*/
+static void markDirty(Statsd* stats, Aggregate* entry){
+#if !defined (_WIN32)
+   if (!entry->dirty && stats->aggregator->wheel){
+      scheduleAggregate(stats, entry, monotonicMillis());
+   }
+#endif
+
+   entry->dirty = 1;
+}
+
+/**
+   Link an aggregate into the slot of the timer wheel its due time falls
+   in. A due time more then a turn of the wheel away is simply passed over
+   until the turn it is due in. Slots that have already been run are never
+   used, so an aggregate is at most one tick late.
+*/
+static void linkWheel(Aggregator* aggregator, Aggregate* entry){
+   uint64_t tick = entry->due / WHEEL_TICK;
+   if (tick <= aggregator->wheelTick){
+      tick = aggregator->wheelTick + 1;
+   }
+
+   int slot = (int)(tick & (WHEEL_SLOTS - 1));
+   entry->next = aggregator->wheel[slot];
+   aggregator->wheel[slot] = (int)(entry - aggregator->entries);
+
+   if ((tick + 1) * WHEEL_TICK < aggregator->wheelDeadline){
+      aggregator->wheelDeadline = (tick + 1) * WHEEL_TICK;
+   }
+}
+
+/**
+   Put every updated aggregate back on an emptied timer wheel, at the
+   time it was already due.
+*/
+static void rebuildWheel(Aggregator* aggregator){
+   for (int i = 0; i < WHEEL_SLOTS; i++){
+      aggregator->wheel[i] = -1;
+   }
+
+   aggregator->wheelDeadline = NO_DEADLINE;
+   for (int i = 0; i < aggregator->capacity; i++){
+      Aggregate* entry = &aggregator->entries[i];
+      if (entry->bucket && entry->dirty){
+         linkWheel(aggregator, entry);
+      }
+   }
+}
+
+/**
+   Take the lock shared with the scheduler's background thread, if there
+   is one. It is recursive, since sending a stat can send the batch.
+*/
+static void lockClient(Statsd* stats){
+#if !defined (_WIN32)
+   if (stats->scheduler && stats->scheduler->background){
+      pthread_mutex_lock(&stats->scheduler->lock);
+   }
+#endif
+}
+
+/**
+   Release the lock taken by lockClient().
+*/
+static void unlockClient(Statsd* stats){
+#if !defined (_WIN32)
+   if (stats->scheduler && stats->scheduler->background){
+      pthread_mutex_unlock(&stats->scheduler->lock);
+   }
+#endif
+}
+
+#if !defined (_WIN32)
+/**
+   Find a stage for the calling thread. Stages left behind by threads
+   that have exited are reused before a new one is allocated. This is
+   the only place a producer thread takes the lock, and it only happens
+   the first time a thread records a stat.
+
+   @param[in] concurrent - The concurrent state of the client
+   @return The stage for the calling thread, or NULL if it could not
+      be allocated.
+*/
+static Stage* registerStage(Concurrent* concurrent){
+   Stage* stage = NULL;
+
+   pthread_mutex_lock(&concurrent->lock);
+   for (Stage* s = concurrent->stages; s; s = s->next){
+      if (!__atomic_load_n(&s->inUse, __ATOMIC_ACQUIRE)){
+         stage = s;
+         break;
+      }
+   }
+
+   if (!stage){
+      if (posix_memalign((void**)&stage, CACHE_LINE_SIZE, sizeof(Stage)) != 0){
+         pthread_mutex_unlock(&concurrent->lock);
+         return NULL;
+      }
+
+      memset(stage, 0, sizeof(Stage));
+      stage->owner = concurrent;
+      stage->next = concurrent->stages;
+      concurrent->stages = stage;
+   }
+
+   stage->inUse = 1;
+   pthread_mutex_unlock(&concurrent->lock);
+
+   pthread_setspecific(concurrent->key, stage);
+   return stage;
+}
+
+/**
+   Thread exit destructor for a stage. Any stats the thread staged are
+   handed to the flusher, and the stage is left for another thread.
+*/
+static void releaseStage(void* data){
+   Stage* stage = (Stage*)data;
+   claimStage(stage, STAGE_OWNER);
+   StageBuffer* buffer = stage->current;
+   stage->current = NULL;
+   unclaimStage(stage);
+
+   if (buffer){
+      if (buffer->length > 0){
+         handOff(stage->owner, buffer);
+      }
+      else {
+         free(buffer);
+      }
+   }
+
+   __atomic_store_n(&stage->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/**
+   Get an empty buffer for a stage, reusing the one the flusher handed
+   back if there is one.
+
+   @param[in] stage - The stage of the calling thread
+   @param[in] packetSize - The size of the buffer's data
+   @return An empty buffer, or NULL if it could not be allocated
+*/
+static StageBuffer* takeBuffer(Stage* stage, int packetSize){
+   StageBuffer* buffer = __atomic_exchange_n(&stage->spare, NULL, __ATOMIC_ACQUIRE);
+   if (!buffer){
+      buffer = (StageBuffer*)malloc(sizeof(StageBuffer) + packetSize);
+      if (!buffer){
+         return NULL;
+      }
+   }
+
+   buffer->stage = stage;
+   buffer->length = 0;
+   return buffer;
+}
+
+/**
+   Push a buffer onto the flusher queue. This is a lock free stack push,
+   any number of threads can push at once.
+*/
+static void handOff(Concurrent* concurrent, StageBuffer* buffer){
+   buffer->next = __atomic_load_n(&concurrent->queue, __ATOMIC_RELAXED);
+   while (!__atomic_compare_exchange_n(&concurrent->queue, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+   }
+}
+
+/**
+   Claim a stage's current buffer, waiting for the other side to finish
+   with it. Neither side holds a claim for more then a few instructions,
+   but the holder may have been preempted, so the waiter yields.
+*/
+static void claimStage(Stage* stage, int claimant){
+   while (!tryClaimStage(stage, claimant)){
+      sched_yield();
+   }
+}
+
+/**
+   Claim a stage's current buffer if nobody else is working on it.
+
+   @return 1 if the stage was claimed, 0 if it is busy
+*/
+static int tryClaimStage(Stage* stage, int claimant){
+   int expected = STAGE_IDLE;
+   return __atomic_compare_exchange_n(&stage->state, &expected, claimant, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+   Give up the claim on a stage, publishing what was done to its buffer.
+*/
+static void unclaimStage(Stage* stage){
+   __atomic_store_n(&stage->state, STAGE_IDLE, __ATOMIC_RELEASE);
+}
+
+/**
+   Take the partial buffers of the threads and push them onto the flusher
+   queue. Normally only buffers that have not been handed off since the
+   last collection are taken, and a thread that is busy staging a stat is
+   left for the next one. With force, every buffer with stats in it is
+   taken, waiting for busy threads. The caller holds the lock, which keeps
+   the list of stages from changing.
+
+   @param[in] concurrent - The concurrent state of the client
+   @param[in] force - Non zero to take every buffer right away
+*/
+static void collectStages(Concurrent* concurrent, int force){
+   for (Stage* stage = concurrent->stages; stage; stage = stage->next){
+      if (force){
+         claimStage(stage, STAGE_FLUSHER);
+      }
+      else if (!tryClaimStage(stage, STAGE_FLUSHER)){
+         continue;
+      }
+
+      StageBuffer* buffer = stage->current;
+      if (buffer && buffer->length > 0 && (force || stage->handOffs == stage->seenHandOffs)){
+         handOff(concurrent, buffer);
+         stage->current = NULL;
+         stage->handOffs++;
+      }
+
+      stage->seenHandOffs = stage->handOffs;
+      unclaimStage(stage);
+   }
+}
+
+/**
+   Copy a stat string into the calling thread's staging buffer. When the
+   buffer is full it is handed off. No locks are taken and no system calls
+   are made, unless the flusher is taking the buffer at that moment.
+
+   @param[in] stats - The statsd client object
+   @param[in] stat - The stat string built by buildStatString()
+   @param[in] length - The length of the stat string
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if a buffer could not
+      be allocated, STATSD_BATCH_FULL if the stat is larger then a buffer.
+*/
+static int stageStat(Statsd* stats, const char* stat, int length){
+   Concurrent* concurrent = stats->concurrent;
+   if (length + 1 > concurrent->packetSize){
+      return STATSD_BATCH_FULL;
+   }
+
+   Stage* stage = (Stage*)pthread_getspecific(concurrent->key);
+   if (!stage){
+      stage = registerStage(concurrent);
+      if (!stage){
+         return STATSD_MALLOC;
+      }
+   }
+
+   //The flusher takes the buffer of a thread that has gone quiet, so
+   //the buffer is only touched with the stage claimed
+   claimStage(stage, STAGE_OWNER);
+   StageBuffer* buffer = stage->current;
+   if (buffer && buffer->length + length + 1 > concurrent->packetSize){
+      handOff(concurrent, buffer);
+      stage->current = NULL;
+      stage->handOffs++;
+      buffer = NULL;
+   }
+
+   if (!buffer){
+      buffer = stage->current = takeBuffer(stage, concurrent->packetSize);
+      if (!buffer){
+         unclaimStage(stage);
+         return STATSD_MALLOC;
+      }
+   }
+
+   memcpy(buffer->data + buffer->length, stat, length);
+   buffer->length += length;
+   buffer->data[buffer->length++] = '\n';
+   unclaimStage(stage);
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Send a list of staged buffers, in the order they were handed off.
+   Neighbouring buffers that fit in a single datagram are gathered into
+   one, and all of the datagrams are sent at once. Each buffer is handed
+   back to its stage once sent, or freed if the stage already has a spare.
+
+   @param[in] stats - The statsd client object
+   @param[in] buffers - The buffers taken from the flusher queue, newest first
+*/
+static void sendStaged(Statsd* stats, StageBuffer* buffers){
+   Concurrent* concurrent = stats->concurrent;
+
+   //Reverse the stack so the oldest buffer is sent first
+   StageBuffer* ordered = NULL;
+   int count = 0;
+   while (buffers){
+      StageBuffer* next = buffers->next;
+      buffers->next = ordered;
+      ordered = buffers;
+      buffers = next;
+      count++;
+   }
+
+   if (count == 0){
+      return;
+   }
+
+   if (reserveIov(&concurrent->iov, &concurrent->parts, &concurrent->iovCapacity, count) == STATSD_SUCCESS){
+      int packets = 0;
+      int packetLength = 0;
+      int i = 0;
+
+      for (StageBuffer* buffer = ordered; buffer; buffer = buffer->next, i++){
+         if (packets == 0 || packetLength + buffer->length > concurrent->packetSize){
+            concurrent->parts[packets++] = 0;
+            packetLength = 0;
+         }
+
+         concurrent->iov[i].iov_base = buffer->data;
+         concurrent->iov[i].iov_len = buffer->length;
+         concurrent->parts[packets - 1]++;
+         packetLength += buffer->length;
+      }
+
+      sendPackets(stats, concurrent->iov, concurrent->parts, packets, NULL);
+   }
+
+   while (ordered){
+      StageBuffer* buffer = ordered;
+      ordered = ordered->next;
+
+      StageBuffer* expected = NULL;
+      buffer->length = 0;
+      if (!__atomic_compare_exchange_n(&buffer->stage->spare, &expected, buffer, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+         free(buffer);
+      }
+   }
+}
+
+/**
+   Initialize a condition variable whose timed waits run on WAIT_CLOCK.
+
+   @param[in] cond - The condition variable to initialize
+*/
+static void initWaitCond(pthread_cond_t* cond){
+   pthread_condattr_t attributes;
+   pthread_condattr_init(&attributes);
+#if !defined (__APPLE__)
+   pthread_condattr_setclock(&attributes, WAIT_CLOCK);
+#endif
+   pthread_cond_init(cond, &attributes);
+   pthread_condattr_destroy(&attributes);
+}
+
+/**
+   Work out the deadline for a timed wait on a condition variable set up
+   by initWaitCond().
+
+   @param[out] deadline - Where the deadline is stored
+   @param[in] millis - How long to wait in milliseconds
+*/
+static void waitDeadline(struct timespec* deadline, uint64_t millis){
+   clock_gettime(WAIT_CLOCK, deadline);
+   deadline->tv_sec += (time_t)(millis / 1000);
+   deadline->tv_nsec += (long)(millis % 1000) * 1000000L;
+   if (deadline->tv_nsec >= 1000000000L){
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+   }
+}
+
+/**
+   The background flusher. Once per interval (or whenever statsd_flush()
+   wakes it up) it takes the partial buffers that have not been handed
+   off for a whole interval, and sends everything that has been handed
+   off so far.
+*/
+static void* flusherThread(void* data){
+   Statsd* stats = (Statsd*)data;
+   Concurrent* concurrent = stats->concurrent;
+
+   pthread_mutex_lock(&concurrent->lock);
+   while (concurrent->running){
+      struct timespec deadline;
+      waitDeadline(&deadline, (uint64_t)concurrent->interval);
+      pthread_cond_timedwait(&concurrent->wake, &concurrent->lock, &deadline);
+      collectStages(concurrent, 0);
+
+      pthread_mutex_unlock(&concurrent->lock);
+      sendStaged(stats, __atomic_exchange_n(&concurrent->queue, NULL, __ATOMIC_ACQUIRE));
+      reportSelf(stats);
+      drainQueues(stats);
+      pthread_mutex_lock(&concurrent->lock);
+   }
+   pthread_mutex_unlock(&concurrent->lock);
+
+   return NULL;
+}
+#endif
+
+#if !defined (_WIN32)
+/**
+   Milliseconds from a clock that never goes backwards.
+*/
+static uint64_t monotonicMillis(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+   Open a non-blocking TCP socket and start connecting it. If the socket
+   can not even be created, the next attempt is scheduled.
+
+   @param[in] stats - The statsd client object
+*/
+static void streamConnect(Statsd* stats){
+   Stream* stream = stats->stream;
+
+   stats->socketFd = socket(stats->destination.ss_family, SOCK_STREAM, 0);
+   if (stats->socketFd == -1){
+      streamDisconnect(stats);
+      return;
+   }
+
+   //Lines are already gathered into large writes, so there is nothing to
+   //gain from holding back small ones.
+   int noDelay = 1;
+   setsockopt(stats->socketFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+   setNonBlocking(stats->socketFd);
+
+   if (connect(stats->socketFd, (const struct sockaddr*)&stats->destination, stats->destinationLength) == 0){
+      stream->connecting = 0;
+      stream->backoff = STREAM_MIN_BACKOFF;
+   }
+   else if (errno == EINPROGRESS){
+      stream->connecting = 1;
+   }
+   else {
+      streamDisconnect(stats);
+   }
+}
+
+/**
+   Close a broken connection and schedule the next attempt. If a line was
+   only partly written, the rest of it is thrown away, since the server
+   will never see its beginning.
+
+   @param[in] stats - The statsd client object
+*/
+static void streamDisconnect(Statsd* stats){
+   Stream* stream = stats->stream;
+
+   if (stats->socketFd != -1){
+      close(stats->socketFd);
+      stats->socketFd = -1;
+   }
+
+   if (stream->partial){
+      uint64_t mask = stream->capacity - 1;
+      uint64_t start = stream->tail;
+      while (stream->tail != stream->head && stream->ring[stream->tail & mask] != '\n'){
+         stream->tail++;
+      }
+      if (stream->tail != stream->head){
+         stream->tail++;
+      }
+
+      __atomic_add_fetch(&stats->droppedMetrics, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&stats->droppedBytes, stream->tail - start, __ATOMIC_RELAXED);
+      stream->partial = 0;
+   }
+
+   stream->connecting = 0;
+   stream->retryAt = monotonicMillis() + stream->backoff;
+   stream->backoff = stream->backoff * 2 > STREAM_MAX_BACKOFF ? STREAM_MAX_BACKOFF : stream->backoff * 2;
+}
+
+/**
+   Copy one datagram worth of stats into the ring buffer as newline
+   terminated lines. If there is no room, the overflow policy decides
+   whether the new stats or the oldest complete lines are dropped.
+
+   @param[in] stats - The statsd client object
+   @param[in] pieces - The pieces of the datagram
+   @param[in] count - The number of pieces
+
+   @return STATSD_SUCCESS if the stats were added, STATSD_DROPPED if they
+      were dropped.
+*/
+static int streamAppend(Statsd* stats, const struct iovec* pieces, int count){
+   Stream* stream = stats->stream;
+   uint64_t mask = stream->capacity - 1;
+   uint64_t length = 0;
+   const char* last = NULL;
+   for (int i = 0; i < count; i++){
+      if (pieces[i].iov_len > 0){
+         length += pieces[i].iov_len;
+         last = (const char*)pieces[i].iov_base + pieces[i].iov_len - 1;
+      }
+   }
+
+   if (!last){
+      return STATSD_SUCCESS;
+   }
+
+   int newline = *last != '\n';
+   length += newline;
+
+   uint64_t available = stream->capacity - (stream->head - stream->tail);
+   if (length > available && stream->overflow == STATSD_OVERFLOW_DROP_OLDEST && !stream->partial && length <= stream->capacity){
+      //Drop whole lines from the front until the new ones fit
+      uint64_t end = stream->tail + (length - available);
+      while (stream->ring[(end - 1) & mask] != '\n'){
+         end++;
+      }
+
+      uint64_t lines = 0;
+      for (uint64_t i = stream->tail; i < end; i++){
+         lines += stream->ring[i & mask] == '\n';
+      }
+
+      __atomic_add_fetch(&stats->droppedMetrics, lines, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&stats->droppedBytes, end - stream->tail, __ATOMIC_RELAXED);
+      stream->tail = end;
+      available = stream->capacity - (stream->head - stream->tail);
+   }
+
+   if (length > available){
+      countDropped(stats, pieces, count);
+      return STATSD_DROPPED;
+   }
+
+   for (int i = 0; i < count; i++){
+      const char* data = (const char*)pieces[i].iov_base;
+      size_t remaining = pieces[i].iov_len;
+      while (remaining > 0){
+         uint64_t offset = stream->head & mask;
+         size_t chunk = stream->capacity - offset < remaining ? stream->capacity - offset : remaining;
+         memcpy(stream->ring + offset, data, chunk);
+         stream->head += chunk;
+         data += chunk;
+         remaining -= chunk;
+      }
+   }
+
+   if (newline){
+      stream->ring[stream->head++ & mask] = '\n';
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Write as much of the ring buffer as the socket will take without
+   blocking, reconnecting first if the connection is down and the retry
+   delay has passed. The wrapped around ring is written with a single
+   gathered write.
+
+   @param[in] stats - The statsd client object
+*/
+static void streamWrite(Statsd* stats){
+   Stream* stream = stats->stream;
+   uint64_t mask = stream->capacity - 1;
+
+   if (stats->socketFd == -1){
+      if (monotonicMillis() < stream->retryAt){
+         return;
+      }
+
+      streamConnect(stats);
+      if (stats->socketFd == -1){
+         return;
+      }
+   }
+
+   if (stream->connecting){
+      struct pollfd ready = { stats->socketFd, POLLOUT, 0 };
+      if (poll(&ready, 1, 0) <= 0){
+         return;
+      }
+
+      int error = 0;
+      socklen_t errorLength = sizeof(error);
+      if (getsockopt(stats->socketFd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == -1 || error != 0){
+         streamDisconnect(stats);
+         return;
+      }
+
+      stream->connecting = 0;
+      stream->backoff = STREAM_MIN_BACKOFF;
+   }
+
+   while (stream->tail != stream->head){
+      uint64_t offset = stream->tail & mask;
+      uint64_t pending = stream->head - stream->tail;
+      struct iovec pieces[2];
+      struct msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = pieces;
+
+      pieces[0].iov_base = stream->ring + offset;
+      pieces[0].iov_len = stream->capacity - offset < pending ? stream->capacity - offset : pending;
+      pieces[1].iov_base = stream->ring;
+      pieces[1].iov_len = pending - pieces[0].iov_len;
+      message.msg_iovlen = pieces[1].iov_len > 0 ? 2 : 1;
+
+      uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+      ssize_t written = sendmsg(stats->socketFd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+      countCall(stats, started, written == -1);
+      if (written == -1){
+         if (errno == EINTR){
+            continue;
+         }
+
+         if (errno != EAGAIN && errno != EWOULDBLOCK){
+            streamDisconnect(stats);
+         }
+         break;
+      }
+
+      //Count the part of the ring that was written
+      if ((size_t)written < pieces[0].iov_len){
+         pieces[0].iov_len = written;
+         message.msg_iovlen = 1;
+      }
+      pieces[1].iov_len = written - pieces[0].iov_len;
+      countSent(stats, pieces, message.msg_iovlen, 0);
+
+      stream->tail += written;
+      stream->partial = stream->tail != stream->head && stream->ring[(stream->tail - 1) & mask] != '\n';
+   }
+}
+
+/**
+   Queue datagrams on the TCP transport. With force set (or once a full
+   packet is waiting) the ring buffer is written to the socket straight
+   away, otherwise single stats are left to gather into a larger write.
+
+   @param[in] stats - The statsd client object
+   @param[in] iov - The pieces of every datagram, in order
+   @param[in] parts - The number of pieces in each datagram. If this is NULL
+      every datagram is a single piece.
+   @param[in] count - The number of datagrams
+   @param[in] force - Write to the socket even if less then a packet is waiting
+   @param[out] report - Optional, filled in with the result of every datagram
+
+   @return STATSD_SUCCESS if everything was queued, STATSD_DROPPED if
+      anything had to be dropped.
+*/
+static int streamSend(Statsd* stats, const struct iovec* iov, const int* parts, int count, int force, StatsdSendReport* report){
+   Stream* stream = stats->stream;
+   int queued = 0;
+
+   for (int packet = 0; packet < count; packet++){
+      int pieces = parts ? parts[packet] : 1;
+      int ok = streamAppend(stats, iov, pieces) == STATSD_SUCCESS;
+      iov += pieces;
+      queued += ok;
+
+      if (report && report->status && packet < report->statusSize){
+         report->status[packet] = ok;
+      }
+   }
+
+   if (force || stream->head - stream->tail >= (uint64_t)stats->packetSize){
+      streamWrite(stats);
+   }
+
+   if (report){
+      report->packets = count;
+      report->sent = queued;
+      report->calls = 1;
+      report->firstError = queued < count ? ENOBUFS : 0;
+   }
+
+   return queued < count ? STATSD_DROPPED : STATSD_SUCCESS;
+}
+
+/**
+   Map a shared memory ring, creating it if it does not exist yet. Only
+   the process that creates the ring sets it up, and any other waits for
+   that to finish, so producers and the drain can start in any order.
+
+   @param[out] ring - The mapping
+   @param[in] name - The name of the ring. Leading slashes are skipped,
+      and the rest of the name can not have any.
+   @param[in] capacity - The size of the ring if it has to be created,
+      a power of 2
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the name
+      is not valid or the ring is not one this version can use,
+      STATSD_SOCKET if it could not be opened or mapped.
+*/
+static int openRing(ShmRing* ring, const char* name, uint64_t capacity){
+   char path[256];
+   while (*name == '/'){
+      name++;
+   }
+
+   if (!*name || strchr(name, '/') || strlen(name) + 2 > sizeof(path)){
+      return STATSD_BAD_SERVER_ADDRESS;
+   }
+   snprintf(path, sizeof(path), "/%s", name);
+
+   size_t mappedSize = sizeof(ShmHeader) + capacity;
+   int created = 1;
+   int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0660);
+   if (fd == -1 && errno == EEXIST){
+      created = 0;
+      fd = shm_open(path, O_RDWR, 0);
+   }
+   if (fd == -1){
+      return STATSD_SOCKET;
+   }
+
+   if (created && ftruncate(fd, (off_t)mappedSize) != 0){
+      close(fd);
+      shm_unlink(path);
+      return STATSD_SOCKET;
+   }
+
+   if (!created){
+      //The process that created the ring may not have sized it yet
+      struct stat info;
+      uint64_t giveUp = monotonicMillis() + SHM_OPEN_MILLIS;
+      while (fstat(fd, &info) == 0 && (size_t)info.st_size <= sizeof(ShmHeader) && monotonicMillis() < giveUp){
+         usleep(1000);
+      }
+
+      if (fstat(fd, &info) != 0 || (size_t)info.st_size <= sizeof(ShmHeader)){
+         close(fd);
+         return STATSD_SOCKET;
+      }
+      mappedSize = (size_t)info.st_size;
+   }
+
+   void* mapping = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (mapping == MAP_FAILED){
+      return STATSD_SOCKET;
+   }
+
+   ShmHeader* header = (ShmHeader*)mapping;
+   if (created){
+      header->version = SHM_VERSION;
+      header->capacity = capacity;
+
+      //Nobody uses the ring until the magic number says it is set up
+      __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+   }
+   else {
+      uint64_t giveUp = monotonicMillis() + SHM_OPEN_MILLIS;
+      while (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC && monotonicMillis() < giveUp){
+         usleep(1000);
+      }
+
+      uint64_t size = header->capacity;
+      if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || header->version != SHM_VERSION ||
+            (size & (size - 1)) != 0 || sizeof(ShmHeader) + size != mappedSize){
+         munmap(mapping, mappedSize);
+         return STATSD_BAD_SERVER_ADDRESS;
+      }
+   }
+
+   ring->header = header;
+   ring->ring = (char*)(header + 1);
+   ring->capacity = header->capacity;
+   ring->mappedSize = mappedSize;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Unmap a shared memory ring. The ring itself stays in /dev/shm, along
+   with anything still in it, for the next drain to pick up.
+
+   @param[in] ring - The mapping
+*/
+static void closeRing(ShmRing* ring){
+   if (ring->header){
+      munmap(ring->header, ring->mappedSize);
+      ring->header = NULL;
+   }
+}
+
+/**
+   Copy one datagram into a shared memory ring as a single record. Space
+   is reserved with a compare and swap on head, then the record is copied
+   in and published by storing its length, so any number of threads and
+   processes can append at once.
+
+   @param[in] ring - The mapping
+   @param[in] pieces - The pieces of the datagram
+   @param[in] count - The number of pieces
+
+   @return 1 if the datagram was added, 0 if the ring had no room for it
+*/
+static int ringAppend(ShmRing* ring, const struct iovec* pieces, int count){
+   ShmHeader* header = ring->header;
+   uint64_t mask = ring->capacity - 1;
+   uint64_t length = 0;
+   for (int i = 0; i < count; i++){
+      length += pieces[i].iov_len;
+   }
+
+   //One record can not take more then a quarter of the ring
+   uint64_t size = (sizeof(uint32_t) + length + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1);
+   if (size > ring->capacity / 4){
+      return 0;
+   }
+
+   uint64_t head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+   uint64_t skip;
+   do {
+      uint64_t offset = head & mask;
+      skip = offset + size > ring->capacity ? ring->capacity - offset : 0;
+
+      //The acquire pairs with the drain clearing the space it gives back
+      uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+      if (head + skip + size - tail > ring->capacity){
+         return 0;
+      }
+   } while (!__atomic_compare_exchange_n(&header->head, &head, head + skip + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+   if (skip){
+      __atomic_store_n((uint32_t*)(ring->ring + (head & mask)), SHM_RECORD_SKIP | (uint32_t)skip, __ATOMIC_RELEASE);
+      head += skip;
+   }
+
+   uint32_t* word = (uint32_t*)(ring->ring + (head & mask));
+   __atomic_store_n(word, SHM_RECORD_BUSY | (uint32_t)length, __ATOMIC_RELAXED);
+
+   char* out = (char*)(word + 1);
+   for (int i = 0; i < count; i++){
+      memcpy(out, pieces[i].iov_base, pieces[i].iov_len);
+      out += pieces[i].iov_len;
+   }
+
+   __atomic_store_n(word, (uint32_t)length, __ATOMIC_RELEASE);
+   return 1;
+}
+
+/**
+   Give the space between two positions back to the producers. It is
+   cleared first, so every record word a producer reserves starts at 0.
+
+   @param[in] ring - The mapping
+   @param[in] from - The drain's tail
+   @param[in] to - The new tail
+*/
+static void ringRelease(ShmRing* ring, uint64_t from, uint64_t to){
+   uint64_t offset = from & (ring->capacity - 1);
+   uint64_t length = to - from;
+   uint64_t first = length < ring->capacity - offset ? length : ring->capacity - offset;
+
+   memset(ring->ring + offset, 0, first);
+   memset(ring->ring, 0, length - first);
+   __atomic_store_n(&ring->header->tail, to, __ATOMIC_RELEASE);
+}
+
+/**
+   Send datagrams through the shared memory ring, one record each. No
+   system call is made, and a datagram the ring has no room for is
+   dropped.
+
+   @param[in] stats - The statsd client object
+   @param[in] iov - The pieces of every datagram, in order
+   @param[in] parts - The number of pieces in each datagram, or NULL if
+      every datagram is a single piece
+   @param[in] count - The number of datagrams
+   @param[out] report - Optional, filled in with the result of every datagram
+
+   @return STATSD_SUCCESS if everything was added, STATSD_DROPPED if
+      anything had to be dropped.
+*/
+static int shmSend(Statsd* stats, const struct iovec* iov, const int* parts, int count, StatsdSendReport* report){
+   int queued = 0;
+
+   for (int packet = 0; packet < count; packet++){
+      int pieces = parts ? parts[packet] : 1;
+      int ok = ringAppend(stats->shm, iov, pieces);
+      if (ok){
+         countSent(stats, iov, pieces, 1);
+      }
+      else {
+         countDropped(stats, iov, pieces);
+      }
+
+      if (report && report->status && packet < report->statusSize){
+         report->status[packet] = ok;
+      }
+
+      iov += pieces;
+      queued += ok;
+   }
+
+   if (report){
+      report->packets = count;
+      report->sent = queued;
+      report->calls = 0;
+      report->firstError = queued < count ? ENOBUFS : 0;
+   }
+
+   return queued < count ? STATSD_DROPPED : STATSD_SUCCESS;
+}
+#endif
+
+#if defined (HAVE_URING)
+/**
+   Set up an io_uring for the client's socket. The socket and the send
+   buffers are registered with the kernel, so sends skip looking up the
+   file and pinning the memory every time.
+
+   @param[in] stats - The statsd client object
+   @param[in] depth - The number of sends that can be in flight at once
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the kernel does
+      not support io_uring or refused to set it up, STATSD_MALLOC if out
+      of memory.
+*/
+static int uringSetup(Statsd* stats, int depth){
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+
+   int fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+   if (fd < 0){
+      return STATSD_BAD_MODE;
+   }
+
+   Uring* uring = (Uring*)calloc(1, sizeof(Uring));
+   if (!uring){
+      close(fd);
+      return STATSD_MALLOC;
+   }
+
+   uring->fd = fd;
+   uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+   uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   uring->sqes = (struct io_uring_sqe*)mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   stats->uring = uring;
+
+   if (uring->sqRing == MAP_FAILED || uring->cqRing == MAP_FAILED || uring->sqes == (struct io_uring_sqe*)MAP_FAILED){
+      uringFree(stats);
+      return STATSD_BAD_MODE;
+   }
+
+   char* sq = (char*)uring->sqRing;
+   char* cq = (char*)uring->cqRing;
+   uring->sqHead = (unsigned*)(sq + params.sq_off.head);
+   uring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+   uring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+   uring->sqArray = (unsigned*)(sq + params.sq_off.array);
+   uring->cqHead = (unsigned*)(cq + params.cq_off.head);
+   uring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+   uring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+   uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+   //The kernel rounds the depth up to a power of 2
+   uring->depth = (int)params.sq_entries;
+   uring->bufferSize = stats->packetSize;
+   uring->free = (int*)malloc(uring->depth * sizeof(int));
+   uring->lengths = (int*)malloc(uring->depth * sizeof(int));
+   if (posix_memalign((void**)&uring->buffers, 4096, (size_t)uring->depth * uring->bufferSize) != 0){
+      uring->buffers = NULL;
+   }
+
+   if (!uring->free || !uring->lengths || !uring->buffers){
+      uringFree(stats);
+      return STATSD_MALLOC;
+   }
+
+   for (int i = 0; i < uring->depth; i++){
+      uring->free[i] = i;
+   }
+   uring->freeCount = uring->depth;
+
+   //Older kernels count registered buffers against RLIMIT_MEMLOCK, and
+   //refuse them past it
+   struct iovec block = { uring->buffers, (size_t)uring->depth * uring->bufferSize };
+   if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &block, 1) != 0 ||
+         syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &stats->socketFd, 1) != 0){
+      uringFree(stats);
+      return STATSD_BAD_MODE;
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Wait for the sends still in flight, then tear down the io_uring.
+
+   @param[in] stats - The statsd client object
+*/
+static void uringFree(Statsd* stats){
+   Uring* uring = stats->uring;
+   if (!uring){
+      return;
+   }
+
+   if (uring->cqes){
+      while (uring->freeCount < uring->depth && uringEnter(stats, 1) >= 0){
+         uringReap(stats, NULL);
+      }
+   }
+
+   if (uring->sqRing && uring->sqRing != MAP_FAILED){
+      munmap(uring->sqRing, uring->sqRingSize);
+   }
+   if (uring->cqRing && uring->cqRing != MAP_FAILED){
+      munmap(uring->cqRing, uring->cqRingSize);
+   }
+   if (uring->sqes && uring->sqes != (struct io_uring_sqe*)MAP_FAILED){
+      munmap(uring->sqes, uring->sqesSize);
+   }
+
+   close(uring->fd);
+   free(uring->buffers);
+   free(uring->free);
+   free(uring->lengths);
+   free(uring);
+   stats->uring = NULL;
+}
+
+/**
+   Submit every queued send, and optionally wait for at least one to
+   complete. This is the only system call the backend makes.
+
+   @param[in] stats - The statsd client object
+   @param[in] wait - 1 to wait for a completion
+
+   @return The number of sends submitted, or -1 on error
+*/
+static int uringEnter(Statsd* stats, int wait){
+   Uring* uring = stats->uring;
+   unsigned queued = *uring->sqTail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+
+   uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+   int ret;
+   do {
+      ret = (int)syscall(__NR_io_uring_enter, uring->fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   } while (ret < 0 && errno == EINTR);
+   countCall(stats, started, ret < 0);
+
+   return ret;
+}
+
+/**
+   Reap every completed send, count it as sent or dropped, and put its
+   buffer back on the free stack. A failed send is dropped whatever the
+   backpressure policy, since its datagram has already left the caller.
+
+   @param[in] stats - The statsd client object
+   @param[out] firstError - Optional, set to the errno of the first failed
+      send if it is still 0
+
+   @return STATSD_SUCCESS if every send worked, STATSD_DROPPED if any were
+      dropped because the socket had no room, STATSD_UDP_SEND if any failed
+      for another reason.
+*/
+static int uringReap(Statsd* stats, int* firstError){
+   Uring* uring = stats->uring;
+   unsigned head = *uring->cqHead;
+   unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+   int ret = STATSD_SUCCESS;
+
+   for (; head != tail; head++){
+      struct io_uring_cqe* cqe = &uring->cqes[head & uring->cqMask];
+      int index = (int)cqe->user_data;
+      struct iovec piece = { uring->buffers + (size_t)index * uring->bufferSize, (size_t)uring->lengths[index] };
+
+      if (cqe->res >= 0){
+         countSent(stats, &piece, 1, 1);
+      }
+      else {
+         int error = -cqe->res;
+         countDropped(stats, &piece, 1);
+
+         //A unix domain socket is connected again for the next sends
+         recoverSocket(stats, error);
+
+         if (firstError && !*firstError){
+            *firstError = error;
+         }
+
+         if (!wouldBlock(error)){
+            ret = STATSD_UDP_SEND;
+         }
+         else if (ret == STATSD_SUCCESS){
+            ret = STATSD_DROPPED;
+         }
+      }
+
+      uring->free[uring->freeCount++] = index;
+   }
+
+   __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+   return ret;
+}
+
+/**
+   Queue datagrams on the io_uring and submit them with one system call.
+   Each datagram is copied into a free registered buffer, so the caller's
+   memory is not needed once this returns. When every buffer is in flight
+   this waits for a send to complete. A datagram larger then the buffers,
+   which were sized by the packet size when the backend was enabled, is
+   sent on its own with sendmsg().
+
+   @param[in] stats - The statsd client object
+   @param[in] iov - The pieces of every datagram, in order
+   @param[in] parts - The number of pieces in each datagram, or NULL if
+      every datagram is a single piece
+   @param[in] count - The number of datagrams
+   @param[out] report - Optional, filled in with the result of every
+      datagram. A queued datagram counts as sent, its completion is
+      reported by the call that reaps it.
+
+   @return STATSD_SUCCESS if everything was queued and every send reaped
+      worked, STATSD_DROPPED if anything was dropped because the socket had
+      no room, STATSD_UDP_SEND if anything failed for another reason.
+*/
+static int uringSend(Statsd* stats, struct iovec* iov, const int* parts, int count, StatsdSendReport* report){
+   Uring* uring = stats->uring;
+   int firstError = 0;
+   int calls = 0;
+   int sent = 0;
+   int ret = uringReap(stats, &firstError);
+
+   for (int packet = 0; packet < count; packet++){
+      int pieces = parts ? parts[packet] : 1;
+      size_t length = 0;
+      for (int i = 0; i < pieces; i++){
+         length += iov[i].iov_len;
+      }
+
+      int ok = 1;
+      if (length > (size_t)uring->bufferSize){
+         struct msghdr message;
+         memset(&message, 0, sizeof(message));
+         message.msg_iov = iov;
+         message.msg_iovlen = pieces;
+
+         uint64_t started = stats->timeSends ? monotonicNanos() : 0;
+         ok = sendmsg(stats->socketFd, &message, 0) != -1;
+         countCall(stats, started, !ok);
+         calls++;
+
+         if (ok){
+            countSent(stats, iov, pieces, 1);
+         }
+         else {
+            firstError = firstError ? firstError : errno;
+            countDropped(stats, iov, pieces);
+            ret = wouldBlock(errno) ? (ret == STATSD_SUCCESS ? STATSD_DROPPED : ret) : STATSD_UDP_SEND;
+         }
+      }
+      else {
+         //Every buffer is in flight, so wait for one to come back
+         while (uring->freeCount == 0){
+            calls++;
+            if (uringEnter(stats, 1) < 0){
+               break;
+            }
+
+            int reaped = uringReap(stats, &firstError);
+            ret = reaped == STATSD_UDP_SEND || ret == STATSD_SUCCESS ? reaped : ret;
+         }
+
+         if (uring->freeCount == 0){
+            firstError = firstError ? firstError : errno;
+            countDropped(stats, iov, pieces);
+            ret = STATSD_UDP_SEND;
+            ok = 0;
+         }
+         else {
+            int index = uring->free[--uring->freeCount];
+            char* buffer = uring->buffers + (size_t)index * uring->bufferSize;
+            char* out = buffer;
+            for (int i = 0; i < pieces; i++){
+               memcpy(out, iov[i].iov_base, iov[i].iov_len);
+               out += iov[i].iov_len;
+            }
+            uring->lengths[index] = (int)length;
+
+            //A write on a connected datagram socket sends one datagram
+            unsigned tail = *uring->sqTail;
+            struct io_uring_sqe* sqe = &uring->sqes[tail & uring->sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = (uint64_t)(uintptr_t)buffer;
+            sqe->len = (uint32_t)length;
+            sqe->buf_index = 0;
+            sqe->user_data = (uint64_t)index;
+            uring->sqArray[tail & uring->sqMask] = tail & uring->sqMask;
+            __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+         }
+      }
+
+      if (report && report->status && packet < report->statusSize){
+         report->status[packet] = ok;
+      }
+
+      sent += ok;
+      iov += pieces;
+   }
+
+   //Datagram sockets usually complete the sends inside the submit, so
+   //most of them are reaped right away
+   if (*uring->sqTail != __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE)){
+      calls++;
+      if (uringEnter(stats, 0) >= 0){
+         int reaped = uringReap(stats, &firstError);
+         ret = reaped == STATSD_UDP_SEND || ret == STATSD_SUCCESS ? reaped : ret;
+      }
+   }
+
+   if (report){
+      report->packets = count;
+      report->sent = sent;
+      report->calls = calls;
+      report->firstError = firstError;
+   }
+
+   return ret;
+}
+#endif
+
+#if !defined (_WIN32)
+/**
+   Give the aggregator a timer wheel, and put every bucket that has been
+   updated since the last flush on it.
+
+   @param[in] stats - The statsd client object
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if out of memory.
+*/
+static int startWheel(Statsd* stats){
+   Aggregator* aggregator = stats->aggregator;
+   if (aggregator->wheel){
+      return STATSD_SUCCESS;
+   }
+
+   aggregator->wheel = (int*)malloc(WHEEL_SLOTS * sizeof(int));
+   if (!aggregator->wheel){
+      return STATSD_MALLOC;
+   }
+
+   uint64_t now = monotonicMillis();
+   aggregator->wheelTick = now / WHEEL_TICK - 1;
+   for (int i = 0; i < WHEEL_SLOTS; i++){
+      aggregator->wheel[i] = -1;
+   }
+
+   aggregator->wheelDeadline = NO_DEADLINE;
+   for (int i = 0; i < aggregator->capacity; i++){
+      Aggregate* entry = &aggregator->entries[i];
+      if (entry->bucket && entry->dirty){
+         entry->interval = 0;
+         scheduleAggregate(stats, entry, now);
+      }
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   The flush interval of an aggregate, from the bucket's own interval if
+   it has one, otherwise from the interval of its type.
+*/
+static int aggregateInterval(const Scheduler* scheduler, const Aggregate* entry){
+   for (int i = 0; i < scheduler->overrideCount; i++){
+      const BucketInterval* override = &scheduler->overrides[i];
+      if ((override->type == STATSD_NONE || override->type == entry->type) && strcmp(override->bucket, entry->bucket) == 0){
+         return override->interval;
+      }
+   }
+
+   return scheduler->intervals[entry->type];
+}
+
+/**
+   Put an aggregate that was just updated for the first time since its
+   last flush on the timer wheel. It is due on the next multiple of its
+   interval, so every bucket with the same interval is flushed at once and
+   shares packets.
+
+   @param[in] stats - The statsd client object
+   @param[in,out] entry - The aggregate
+   @param[in] now - The current time, from monotonicMillis()
+*/
+static void scheduleAggregate(Statsd* stats, Aggregate* entry, uint64_t now){
+   Scheduler* scheduler = stats->scheduler;
+   Aggregator* aggregator = stats->aggregator;
+
+   if (!entry->interval){
+      entry->interval = aggregateInterval(scheduler, entry);
+   }
+
+   entry->due = (now / entry->interval + 1) * entry->interval;
+   linkWheel(aggregator, entry);
+
+   if (aggregator->wheelDeadline < scheduler->wakeAt){
+      armScheduler(stats, aggregator->wheelDeadline);
+   }
+}
+
+/**
+   Called after a stat was added to the batch. Sends the batch once it
+   passes the size threshold, and otherwise starts the deadline of a
+   batch that just got its first stat.
+
+   @param[in] stats - The statsd client object
+   @return STATSD_SUCCESS on success, or the error from sending the batch.
+*/
+static int scheduleBatch(Statsd* stats){
+   Scheduler* scheduler = stats->scheduler;
+   if (scheduler->threshold > 0 && stats->batchIndex >= scheduler->threshold){
+      return statsd_sendBatch(stats);
+   }
+
+   if (scheduler->batchDeadline == NO_DEADLINE){
+      scheduler->batchDeadline = monotonicMillis() + scheduler->maxLatency;
+      if (scheduler->batchDeadline < scheduler->wakeAt){
+         armScheduler(stats, scheduler->batchDeadline);
+      }
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Do everything the scheduler has due. The aggregates in every slot of
+   the timer wheel that has ended since the last run are flushed together,
+   except for the ones due in a later turn of the wheel, and the batch is
+   sent if its deadline has passed. A batch that could not be sent gets
+   another maxLatency before it is tried again.
+
+   @param[in] stats - The statsd client object
+   @param[in] now - The current time, from monotonicMillis()
+
+   @return STATSD_SUCCESS on success, or the first error from building or
+      sending.
+*/
+static int runDue(Statsd* stats, uint64_t now){
+   Scheduler* scheduler = stats->scheduler;
+   Aggregator* aggregator = stats->aggregator;
+   int ret = STATSD_SUCCESS;
+
+   if (aggregator && aggregator->wheel && now >= aggregator->wheelDeadline){
+      //Only whole ticks are run, and a wheel that fell more then a turn
+      //behind runs every slot once
+      uint64_t last = now / WHEEL_TICK - 1;
+      uint64_t tick = aggregator->wheelTick + 1;
+      if (last >= tick && last - tick >= WHEEL_SLOTS){
+         tick = last - WHEEL_SLOTS + 1;
+      }
+
+      for (; tick <= last; tick++){
+         int* head = &aggregator->wheel[tick & (WHEEL_SLOTS - 1)];
+         int index = *head;
+         *head = -1;
+
+         while (index >= 0){
+            Aggregate* entry = &aggregator->entries[index];
+            int next = entry->next;
+            if (entry->due > now){
+               entry->next = *head;
+               *head = index;
+            }
+            else {
+               int status = flushEntry(stats, entry);
+               if (ret == STATSD_SUCCESS){
+                  ret = status;
+               }
+            }
+
+            index = next;
+         }
+      }
+
+      aggregator->wheelTick = last;
+      aggregator->wheelDeadline = NO_DEADLINE;
+      for (tick = last + 1; tick <= last + WHEEL_SLOTS; tick++){
+         if (aggregator->wheel[tick & (WHEEL_SLOTS - 1)] >= 0){
+            aggregator->wheelDeadline = (tick + 1) * WHEEL_TICK;
+            break;
+         }
+      }
+
+      ret = sendAggregates(stats, ret);
+   }
+
+   if (now >= scheduler->batchDeadline){
+      int sent = statsd_sendBatch(stats);
+      if (ret == STATSD_SUCCESS){
+         ret = sent;
+      }
+
+      if (stats->batchIndex > 0){
+         scheduler->batchDeadline = now + scheduler->maxLatency;
+      }
+   }
+
+   reportSelf(stats);
+   drainQueues(stats);
+   armScheduler(stats, nextDeadline(stats));
+   return ret;
+}
+
+/**
+   The soonest the scheduler has anything to do, or NO_DEADLINE if it is
+   waiting for stats.
+*/
+static uint64_t nextDeadline(Statsd* stats){
+   uint64_t deadline = stats->scheduler->batchDeadline;
+   Aggregator* aggregator = stats->aggregator;
+   if (aggregator && aggregator->wheel && aggregator->wheelDeadline < deadline){
+      deadline = aggregator->wheelDeadline;
+   }
+
+   return deadline;
+}
+
+/**
+   Wake whatever runs the scheduler at a new deadline. The timer fd is
+   set to go off then, and the background thread is told to look again.
+
+   @param[in] stats - The statsd client object
+   @param[in] deadline - The time to wake up, or NO_DEADLINE
+*/
+static void armScheduler(Statsd* stats, uint64_t deadline){
+   Scheduler* scheduler = stats->scheduler;
+   scheduler->wakeAt = deadline;
+
+#if defined (__linux__)
+   if (scheduler->timerFd >= 0){
+      //An all zero time disarms the timer
+      struct itimerspec timer;
+      memset(&timer, 0, sizeof(timer));
+      if (deadline != NO_DEADLINE){
+         timer.it_value.tv_sec = (time_t)(deadline / 1000);
+         timer.it_value.tv_nsec = (long)(deadline % 1000) * 1000000L;
+      }
+
+      timerfd_settime(scheduler->timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+   }
+#endif
+
+   if (scheduler->background){
+      pthread_cond_signal(&scheduler->wake);
+   }
+}
+
+/**
+   The scheduler's background thread. It sleeps until the next deadline,
+   or until a stat brings the deadline closer, and runs whatever is due
+   with the client locked.
+*/
+static void* schedulerThread(void* data){
+   Statsd* stats = (Statsd*)data;
+   Scheduler* scheduler = stats->scheduler;
+
+   pthread_mutex_lock(&scheduler->lock);
+   while (scheduler->running){
+      uint64_t now = monotonicMillis();
+      uint64_t deadline = nextDeadline(stats);
+      if (deadline <= now){
+         runDue(stats, now);
+         continue;
+      }
+
+      if (deadline == NO_DEADLINE){
+         pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+         continue;
+      }
+
+      struct timespec until;
+      waitDeadline(&until, deadline - now);
+
+      pthread_cond_timedwait(&scheduler->wake, &scheduler->lock, &until);
+   }
+   pthread_mutex_unlock(&scheduler->lock);
+
+   return NULL;
+}
+#endif
+
+
+//Implement the public functions
+
+/**
+   This is allocate the memory for a statsd object from the heap
+   initialize it with the givin values and return the newly constructed
+   object ready for use. 
+
+   @param[out] stats - This is where the statsd object will be placed.
+   @param[in] serverAddress - The hostname, or ip address of the statsd server
+   @param[in] port - The port number to use for statsd packets
+   @param[in] bucket - The unique bucket name to use for reporting stats
+
+   @return STATSD_SUCCESS on success, or an error if something went wrong
+   @see StatsError
+*/
+int ADDCALL statsd_new(Statsd** stats, const char* serverAddress, int port, const char* nameSpace, const char* bucket){
+   Statsd* newStats = (Statsd*)malloc(sizeof(Statsd));
+   if (!newStats){
+      return STATSD_MALLOC;
+   }
+
+   memset(newStats, 0, sizeof(Statsd));
+   newStats->socketFd = -1;
+   *stats = newStats;
+   return statsd_init(*stats, serverAddress, port, nameSpace, bucket);
+}
+
+/**
+   Free a statsd object created through a call to statsd_new()
+
+   @param[in] statsd - The statsd object created by a call to
+      statsd_new(). 
+*/
+void ADDCALL statsd_free(Statsd* statsd){
+   if(!statsd)
+      return;
+
+   statsd_release(statsd);
+   free(statsd);
+}
+
+/**
+   Free the resources in a statsd object initialized through a
+      call to statsd_init(). Aggregated and batched stats that were
+      not sent yet are flushed first.
+
+   @param[in] statsd - The statsd object initialized by a call
+      to statsd_init().
+*/
+void ADDCALL statsd_release(Statsd* statsd){
+   if(!statsd)
+      return;
+
+   //Stop the flusher thread while the socket is still open so it
+   //can send what has been staged.
+   statsd_disableConcurrency(statsd);
+
+   //Stop the scheduler while there is still something to flush to
+   statsd_disableScheduler(statsd);
+
+   //Send what is still aggregated or batched, as disabling aggregation
+   //would, before the servers and the socket go away
+   statsd_flush(statsd);
+
+   statsd_disableSelfReport(statsd);
+
+   freeShards(statsd->shards);
+   statsd->shards = NULL;
+
+#if !defined (_WIN32)
+   //One last attempt to write what the TCP transport is holding
+   if (statsd->stream){
+      streamWrite(statsd);
+      free(statsd->stream->ring);
+      free(statsd->stream);
+      statsd->stream = NULL;
+   }
+
+#if defined (HAVE_URING)
+   uringFree(statsd);
+#endif
+
+   if (statsd->shm){
+      closeRing(statsd->shm);
+      free(statsd->shm);
+      statsd->shm = NULL;
+   }
+#endif
+
+   freeSpill(statsd);
+
+   if (statsd->socketFd > 0){
+      close(statsd->socketFd);
+      statsd->socketFd = -1;
+   }
+
+   freeAggregator(statsd->aggregator);
+   statsd->aggregator = NULL;
+
+   free(statsd->batch);
+   statsd->batch = NULL;
+   statsd->batchIndex = 0;
+
+   free(statsd->tags);
+   statsd->tags = NULL;
+}
+
+/**
+   This will initialize (or reinitialize) a statsd object that
+   has already been created by a call to statsd_new() or has been
+   allocated statically on the stack. If the object has aggregation
+   or concurrency enabled, call statsd_release() before reinitializing it.
+
+   @param[in,out] statsd - A previously allocated statsd object
+   @param[in] server - The hostname or ip address of the server
+   @param[in] port - The port number that the packets will be sent to
+   @param[in] bucket - The default bucket name that will be used for 
+      the stats
+
+   @return SCTE_SUCCESS on success, or an error otherwise
+   @see StatsError
+*/
+int ADDCALL statsd_init(Statsd* statsd, const char* server, int port, const char* nameSpace, const char* bucket){
+   statsd->aggregator = NULL;
+   statsd->concurrent = NULL;
+   statsd->stream = NULL;
+   statsd->shm = NULL;
+   statsd->uring = NULL;
+   statsd->scheduler = NULL;
+   statsd->spill = NULL;
+   statsd->shards = NULL;
+   statsd->shardIndex = 0;
+   statsd->backpressure = STATSD_BACKPRESSURE_DROP;
+   statsd->blockTimeout = 0;
+   statsd->droppedMetrics = 0;
+   statsd->droppedBytes = 0;
+   memset(&statsd->counters, 0, sizeof(statsd->counters));
+   statsd->timeSends = 0;
+   statsd->selfReport = NULL;
+   statsd->clock = STATSD_CLOCK_MONOTONIC;
+   statsd->tags = NULL;
+   statsd->batch = NULL;
+   statsd->batchIndex = 0;
+   statsd->packetSize = BATCH_MAX_SIZE;
+   statsd->sampling = STATSD_SAMPLE_RANDOM;
+
+   statsd->serverAddress = server;
+   statsd->port = port;
+   statsd->nameSpace = nameSpace;
+   statsd->bucket = bucket;
+   statsd->random = NULL;
+
+   // Check to see if there is already an open socket, and close it
+   if (statsd->socketFd > 0){
+      close(statsd->socketFd);
+      statsd->socketFd = -1;
+   }
+
+   int ret;
+   if (strncmp(server, STATSD_UNIX_PREFIX, sizeof(STATSD_UNIX_PREFIX) - 1) == 0){
+      ret = openUnixSocket(statsd, server + sizeof(STATSD_UNIX_PREFIX) - 1);
+   }
+   else if (strncmp(server, STATSD_TCP_PREFIX, sizeof(STATSD_TCP_PREFIX) - 1) == 0){
+      ret = openTcpSocket(statsd, server + sizeof(STATSD_TCP_PREFIX) - 1, port);
+   }
+   else if (strncmp(server, STATSD_SHM_PREFIX, sizeof(STATSD_SHM_PREFIX) - 1) == 0){
+      ret = openShm(statsd, server + sizeof(STATSD_SHM_PREFIX) - 1);
+   }
+   else {
+      ret = openInetSocket(statsd, server, port);
+   }
+
+   if (ret != STATSD_SUCCESS){
+      return ret;
+   }
+
+   //The batch buffer is sized by statsd_setPacketSize(), with room
+   //for a terminating null.
+   statsd->batch = (char*)malloc(statsd->packetSize + 1);
+   if (!statsd->batch){
+      return STATSD_MALLOC;
+   }
+
+   statsd->batch[0] = '\0';
+   return STATSD_SUCCESS;
+}
+
+/**
+   Increment the bucket value by 1
+
+   @param[in] stats - The statsd client object
+   @param[in] bucket - The optional bucket name. If this is not
+      provided, the default bucket will be used from the statsd
+      object.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_increment(Statsd* stats, const char* bucket){
+   return sendToServer(stats, bucket, STATSD_COUNT, 1, 1, NULL);   
+}
+
+/**
+   Decrement the bucket value by 1
+
+   @param[in] stats - The statsd client object
+   @param[in] bucket - The optional bucket name. If this is not
+      provided, the defualt bucket will be used from the statsd
+      object.
+   
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_decrement(Statsd* stats, const char* bucket){
+   return sendToServer(stats, bucket, STATSD_COUNT, -1, 1, NULL);   
+}
+
+/**
+   Add a count value to the bucket
+
+   @param[in] stats - The statsd client object.
+   @param[in] bucket - The optional bucket name. If this is
+      not provided, the default bucket will be used from the
+      statsd object.
+   @param[in] count - The value to increment (or decrement) the bucket
+      by. If the value is negative, it will be decremented.
+   @param[in] sampleRate - The sample rate of this statistic. If you specify
+      a value 0 or less, or 1 or more then this value is ignored. Otherwise
+      this value is sent on to the server.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_count(Statsd* stats, const char* bucket, int count, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_COUNT, count, sampleRate, NULL);
+}
+
+/**
+   Sets the value of a bucket to an arbitrary value
+
+   @param[in] stats - The statsd client object.
+   @param[in] bucket - The optional bucket name. If this is
+      not provided, the default bucket will be used from the 
+      statsd object.
+   @param[in] value - The value to set the bucket to.
+   @param[in] sampleRate - The sample rate of this statistic. If you specify
+      a value 0 or less, or 1 or more then this value is ignored. Otherwise
+      this value is sent on to the server. 
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_gauge(Statsd* stats, const char* bucket, int value, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_GAUGE, value, sampleRate, NULL);
+}
+
+/**
+   Counts unique occurrences of events between flushes. 
+
+   @param[in] stats - The statsd client object.
+   @param[in] bucket - The optional bucket name. If this is
+      not provided, the default bucket will be used from the 
+      statsd object.
+   @param[in] value - The value to set the bucket to.
    @param[in] sampleRate - The sample rate of this statistic. If you specify
       a value 0 or less, or 1 or more then this value is ignored. Otherwise
       this value is sent on to the server. 
 
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_set(Statsd* stats, const char* bucket, int value, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_SET, value, sampleRate, NULL);
+}
+
+/**
+   Records the time it took something to take in milliseconds. 
+
+   @param[in] stats - The statsd client object.
+   @param[in] bucket - The optional bucket name. If this is
+      not provided, the default bucket will be used from the 
+      statsd object.
+   @param[in] value - The value to set the bucket to.
+   @param[in] sampleRate - The sample rate of this statistic. If you specify
+      a value 0 or less, or 1 or more then this value is ignored. Otherwise
+      this value is sent on to the server. NOTE: The actual sampling rate
+      must be done externally, as each statistic will be sent on
+      regardless of the sampleRate value.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see sendToServer
+*/
+int ADDCALL statsd_timing(Statsd* stats, const char* bucket, int timing, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_TIMING, timing, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_count(), with a 64 bit count.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_count
+*/
+int ADDCALL statsd_count64(Statsd* stats, const char* bucket, int64_t count, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_COUNT, count, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_gauge(), with a 64 bit value. When aggregated, the
+   value is kept exactly.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_gauge
+*/
+int ADDCALL statsd_gauge64(Statsd* stats, const char* bucket, int64_t value, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_GAUGE, value, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_set(), with a 64 bit member.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_set
+*/
+int ADDCALL statsd_set64(Statsd* stats, const char* bucket, int64_t value, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_SET, value, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_timing(), with a 64 bit timing in milliseconds.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_timing
+*/
+int ADDCALL statsd_timing64(Statsd* stats, const char* bucket, int64_t timing, double sampleRate){
+   return sendToServer(stats, bucket, STATSD_TIMING, timing, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_count(), with a fractional count. The count is sent
+   in the shortest form that reads back as the same double.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the count is not
+      a finite number, an error if there is a problem.
+   @see statsd_count
+*/
+int ADDCALL statsd_countDouble(Statsd* stats, const char* bucket, double count, double sampleRate){
+   return sendDoubleToServer(stats, bucket, STATSD_COUNT, count, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_gauge(), with a fractional value, such as a load
+   average or a ratio.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_gauge
+*/
+int ADDCALL statsd_gaugeDouble(Statsd* stats, const char* bucket, double value, double sampleRate){
+   return sendDoubleToServer(stats, bucket, STATSD_GAUGE, value, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_timing(), with a fractional number of milliseconds.
+   When timings are aggregated they keep microsecond resolution.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the timing is not
+      a finite number, an error if there is a problem.
+   @see statsd_timing
+*/
+int ADDCALL statsd_timingDouble(Statsd* stats, const char* bucket, double timing, double sampleRate){
+   return sendDoubleToServer(stats, bucket, STATSD_TIMING, timing, sampleRate, NULL);
+}
+
+/**
+   This function will reset the batch data that is being
+   held. This is called automatically whenever you send
+   the batch data to the server. You can also call this
+   manually to removed any stored batch data.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS
+*/
+int ADDCALL statsd_resetBatch(Statsd* statsd){
+#if !defined (_WIN32)
+   if (statsd->concurrent){
+      Stage* stage = (Stage*)pthread_getspecific(statsd->concurrent->key);
+      if (stage){
+         claimStage(stage, STAGE_OWNER);
+         if (stage->current){
+            stage->current->length = 0;
+         }
+         unclaimStage(stage);
+      }
+
+      return STATSD_SUCCESS;
+   }
+#endif
+
+   lockClient(statsd);
+   if (statsd->batch){
+      statsd->batch[0] = '\0';
+   }
+
+   statsd->batchIndex = 0;
+
+#if !defined (_WIN32)
+   if (statsd->scheduler){
+      statsd->scheduler->batchDeadline = NO_DEADLINE;
+   }
+#endif
+
+   unlockClient(statsd);
+   return STATSD_SUCCESS;
+}
+
+/**
+   Add stats to the batch buffer to be sent later. 
+
+   @param[in] statsd - The statsd client object
+   @param[in] type - The type of stat being added
+   @param[in] bucket - The name of a bucket to put the stat. This
+      is optional and if not provided the default bucket name from
+      the statsd object will be used.
+   @param[in] value - The value of the stat
+   @param[in] sampleRate - The rate at which the stat was gathered. 
+
+   If the stat does not fit in the space left in the batch, the batch
+   is sent to the server first and the stat starts a new one. If that
+   send fails the old batch is dropped so the new stat still fits.
+   
+   @return STATSD_SUCCESS if everything was successful, STATSD_UDP_SEND
+      if a full batch could not be sent, STATSD_BATCH_FULL if the stat
+      is larger then the packet size.
+*/
+int ADDCALL statsd_addToBatch(Statsd* statsd, StatsType type, const char* bucket, int value, double sampleRate){
+   return statsd_addToBatch64(statsd, type, bucket, value, sampleRate);
+}
+
+/**
+   The same as statsd_addToBatch(), with a 64 bit value.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_addToBatch
+*/
+int ADDCALL statsd_addToBatch64(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate){
+   return statsd_addToBatchTagged(statsd, type, bucket, value, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_addToBatch64(), with tags of the stat's own that are
+   added after the client's default tags.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_addToBatch
+*/
+int ADDCALL statsd_addToBatchTagged(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate, const StatsdTags* tags){
+   if (!bucket){
+      bucket = statsd->bucket;
+   }
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(statsd, bucket, 0, sampleThreshold(sampleRate))){
+      return STATSD_SUCCESS;
+   }
+
+   char digits[20];
+   int valueLength = formatInteger(digits, value);
+   return batchValue(statsd, type, bucket, digits, valueLength, sampleRate, tags);
+}
+
+/**
+   The same as statsd_addToBatch(), with a floating point value.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_addToBatch
+*/
+int ADDCALL statsd_addToBatchDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate){
+   return statsd_addToBatchTaggedDouble(statsd, type, bucket, value, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_addToBatchDouble(), with tags of the stat's own that
+   are added after the client's default tags.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_addToBatch
+*/
+int ADDCALL statsd_addToBatchTaggedDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate, const StatsdTags* tags){
+   if (!isfinite(value)){
+      return STATSD_BAD_VALUE;
+   }
+
+   if (!bucket){
+      bucket = statsd->bucket;
+   }
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(statsd, bucket, 0, sampleThreshold(sampleRate))){
+      return STATSD_SUCCESS;
+   }
+
+   char digits[FLOAT_MAX_SIZE];
+   int valueLength = formatDouble(digits, value);
+   return batchValue(statsd, type, bucket, digits, valueLength, sampleRate, tags);
+}
+
+/**
+   Send the batch message to the server. After a successful send
+   this will reset the batch buffer.
+
+   In concurrent mode this hands the calling thread's staged stats
+   to the flusher thread instead, and returns without waiting for them
+   to be sent.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if the 
+      send() function failed.
+*/
+int ADDCALL statsd_sendBatch(Statsd* statsd){
+#if !defined (_WIN32)
+   //Hand the calling thread's staged stats to the flusher thread
+   if (statsd->concurrent){
+      Stage* stage = (Stage*)pthread_getspecific(statsd->concurrent->key);
+      if (!stage){
+         return STATSD_NO_BATCH;
+      }
+
+      claimStage(stage, STAGE_OWNER);
+      if (!stage->current || stage->current->length == 0){
+         unclaimStage(stage);
+         return STATSD_NO_BATCH;
+      }
+
+      countStat(statsd, &statsd->counters.batches, 1);
+      countStat(statsd, &statsd->counters.batchBytes, stage->current->length);
+      handOff(statsd->concurrent, stage->current);
+      stage->current = NULL;
+      stage->handOffs++;
+      unclaimStage(stage);
+      return STATSD_SUCCESS;
+   }
+#endif
+
+   lockClient(statsd);
+   if (statsd->batchIndex <= 0){
+      unlockClient(statsd);
+      return STATSD_NO_BATCH;
+   }
+
+   statsd->counters.batches++;
+   statsd->counters.batchBytes += statsd->batchIndex;
+
+   int sent = sendDatagram(statsd, statsd->batch, statsd->batchIndex);
+   if (sent == STATSD_DROPPED){
+      statsd_resetBatch(statsd);
+      unlockClient(statsd);
+      return sent;
+   }
+
+   if (sent != STATSD_SUCCESS){
+      unlockClient(statsd);
+      return STATSD_UDP_SEND;
+   }
+
+   drainQueues(statsd);
+   statsd_resetBatch(statsd);
+   unlockClient(statsd);
+   return STATSD_SUCCESS;
+}
+
+/**
+   Set the largest datagram the client will send. This sizes the batch
+   buffer, the packets built when flushing aggregates, and the staging
+   buffers used in concurrent mode. Use STATSD_ETHERNET_PACKET_SIZE for a
+   standard 1500 byte MTU, STATSD_JUMBO_PACKET_SIZE for jumbo frames, or
+   STATSD_LOOPBACK_PACKET_SIZE when the server is on the same host. A
+   client sending to a unix domain socket can go up to
+   STATSD_UNIX_MAX_PACKET_SIZE. The default is BATCH_MAX_SIZE. Any stats
+   already in the batch are kept.
+
+   @param[in] statsd - The statsd client object
+   @param[in] packetSize - The largest datagram payload in bytes
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_PACKET_SIZE if the size is
+      out of range or smaller then the stats already in the batch,
+      STATSD_BAD_MODE if the client is in concurrent mode, STATSD_MALLOC
+      if the buffer could not be resized.
+*/
+int ADDCALL statsd_setPacketSize(Statsd* statsd, int packetSize){
+   int maxPacketSize = statsd->destination.ss_family == AF_UNIX ? STATSD_UNIX_MAX_PACKET_SIZE : STATSD_MAX_PACKET_SIZE;
+   if (packetSize < STATSD_MIN_PACKET_SIZE || packetSize > maxPacketSize || packetSize < statsd->batchIndex){
+      return STATSD_BAD_PACKET_SIZE;
+   }
+
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   lockClient(statsd);
+   char* batch = (char*)realloc(statsd->batch, packetSize + 1);
+   if (!batch){
+      unlockClient(statsd);
+      return STATSD_MALLOC;
+   }
+
+   if (!statsd->batch){
+      batch[0] = '\0';
+   }
+
+   statsd->batch = batch;
+   statsd->packetSize = packetSize;
+   unlockClient(statsd);
+
+   for (int i = 1; statsd->shards && i < statsd->shards->count; i++){
+      statsd_setPacketSize(statsd->shards->servers[i], packetSize);
+   }
+
+#if !defined (_WIN32)
+   //Unix domain datagrams have to fit in the send buffer, so make sure it
+   //is large enough. The kernel may cap this, which shows up as failed
+   //sends of very large packets.
+   if (statsd->destination.ss_family == AF_UNIX && packetSize > STATSD_MAX_PACKET_SIZE){
+      int bufferSize = packetSize;
+      setsockopt(statsd->socketFd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+   }
+#endif
+
+   return STATSD_SUCCESS;
+}
+
+
+/**
+   Turn on client side aggregation. Once enabled, counts, gauges and sets
+   sent through statsd_count(), statsd_gauge(), statsd_set() and friends
+   are folded into a local table instead of being sent right away. Counts
+   are summed per bucket, gauges keep only the last value, and set members
+   are de-duplicated. Nothing is sent until statsd_flush() is called, or
+   the flush scheduler finds the bucket due, which emits one line per
+   updated bucket (or per unique set member). Timings
+   are still sent immediately unless statsd_enableTimingAggregation() is
+   also called.
+
+   @param[in] statsd - The statsd client object
+   @param[in] capacity - The number of buckets to allocate room for up front.
+      The table grows as needed, so this is only a hint. A value of 0 or less
+      will use a small default.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if the table could not
+      be allocated, STATSD_BAD_MODE if the client is in concurrent mode.
+*/
+int ADDCALL statsd_enableAggregation(Statsd* statsd, int capacity){
+   if (statsd->aggregator){
+      return STATSD_SUCCESS;
+   }
+
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   //Round the capacity up to a power of 2 so it can be used as a mask
+   int size = AGGREGATE_DEFAULT_CAPACITY;
+   while (size < capacity){
+      size *= 2;
+   }
+
+   Aggregator* aggregator = (Aggregator*)calloc(1, sizeof(Aggregator));
+   if (!aggregator){
+      return STATSD_MALLOC;
+   }
+
+   aggregator->entries = (Aggregate*)calloc(size, sizeof(Aggregate));
+   if (!aggregator->entries){
+      free(aggregator);
+      return STATSD_MALLOC;
+   }
+
+   aggregator->capacity = size;
+   lockClient(statsd);
+   statsd->aggregator = aggregator;
+
+#if !defined (_WIN32)
+   if (statsd->scheduler && startWheel(statsd) != STATSD_SUCCESS){
+      statsd->aggregator = NULL;
+      unlockClient(statsd);
+      freeAggregator(aggregator);
+      return STATSD_MALLOC;
+   }
+#endif
+
+   unlockClient(statsd);
+   return STATSD_SUCCESS;
+}
+
+/**
+   Flush any aggregated stats to the server and turn off client side
+   aggregation. Stats are sent immediately again after this call.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS on success, or the error from the final flush.
+      Aggregation is turned off either way.
+*/
+int ADDCALL statsd_disableAggregation(Statsd* statsd){
+   if (!statsd->aggregator){
+      return STATSD_SUCCESS;
+   }
+
+   lockClient(statsd);
+   int ret = statsd_flush(statsd);
+   freeAggregator(statsd->aggregator);
+   statsd->aggregator = NULL;
+   unlockClient(statsd);
+   return ret;
+}
+
+/**
+   Send everything the client is holding on to. All buckets that were
+   updated since the last flush are written into the batch buffer, and
+   the batch (including any stats added with statsd_addToBatch()) is
+   sent to the server. 
+
+   In concurrent mode this hands the staged stats of every thread to
+   the flusher thread and wakes it up, without waiting for the send.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if the send()
+      function failed.
+*/
+int ADDCALL statsd_flush(Statsd* statsd){
+#if !defined (_WIN32)
+   if (statsd->concurrent){
+      Concurrent* concurrent = statsd->concurrent;
+
+      pthread_mutex_lock(&concurrent->lock);
+      collectStages(concurrent, 1);
+      pthread_cond_signal(&concurrent->wake);
+      pthread_mutex_unlock(&concurrent->lock);
+      return STATSD_SUCCESS;
+   }
+#endif
+
+   lockClient(statsd);
+   int ret = STATSD_SUCCESS;
+   if (statsd->aggregator){
+      ret = flushAggregates(statsd);
+   }
+
+   if (statsd->batchIndex > 0){
+      int sent = statsd_sendBatch(statsd);
+      if (ret == STATSD_SUCCESS){
+         ret = sent;
+      }
+   }
+
+   reportSelf(statsd);
+   drainQueues(statsd);
+   unlockClient(statsd);
+   return ret;
+}
+
+/**
+   Turn on concurrent mode. In this mode the client can be shared by any
+   number of threads without external locking. Every thread stages its
+   stats in its own buffer, and full buffers are handed to a background
+   flusher thread through a lock free queue. The flusher owns the socket,
+   so recording a stat never takes a lock or makes a system call once the
+   thread's buffer has been set up.
+
+   Every stat recording function, including statsd_addToBatch(), stages
+   the stat. statsd_sendBatch() hands the calling thread's buffer to the
+   flusher, and statsd_flush() hands over the buffers of every thread. A
+   partial buffer that has not been handed off for a whole interval is
+   taken by the flusher itself, so stats of a thread that has gone quiet
+   are sent within two intervals.
+
+   The staging buffers are sized by the packet size at the time this is
+   called, so statsd_setPacketSize() must be called first.
+
+   @param[in] statsd - The statsd client object
+   @param[in] flushInterval - How often the flusher runs in milliseconds.
+      A value of 0 or less uses the default of 1 second.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if aggregation or
+      the flush scheduler is enabled, STATSD_MALLOC if out of memory,
+      STATSD_THREAD if the flusher thread could not be started.
+*/
+int ADDCALL statsd_enableConcurrency(Statsd* statsd, int flushInterval){
+#if defined (_WIN32)
+   return STATSD_THREAD;
+#else
+   if (statsd->concurrent){
+      return STATSD_SUCCESS;
+   }
+
+   if (statsd->aggregator || statsd->scheduler){
+      return STATSD_BAD_MODE;
+   }
+
+   Concurrent* concurrent = NULL;
+   if (posix_memalign((void**)&concurrent, CACHE_LINE_SIZE, sizeof(Concurrent)) != 0){
+      return STATSD_MALLOC;
+   }
+
+   memset(concurrent, 0, sizeof(Concurrent));
+   concurrent->packetSize = statsd->packetSize;
+   concurrent->interval = flushInterval > 0 ? flushInterval : CONCURRENT_DEFAULT_INTERVAL;
+   concurrent->running = 1;
+
+   if (pthread_key_create(&concurrent->key, releaseStage) != 0){
+      free(concurrent);
+      return STATSD_THREAD;
+   }
+
+   pthread_mutex_init(&concurrent->lock, NULL);
+   initWaitCond(&concurrent->wake);
+
+   statsd->concurrent = concurrent;
+   if (pthread_create(&concurrent->flusher, NULL, flusherThread, statsd) != 0){
+      statsd->concurrent = NULL;
+      pthread_key_delete(concurrent->key);
+      pthread_mutex_destroy(&concurrent->lock);
+      pthread_cond_destroy(&concurrent->wake);
+      free(concurrent);
+      return STATSD_THREAD;
+   }
+
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Stop the flusher thread, send everything that is still staged, and
+   return the client to single threaded mode. No other thread may be
+   using the client while this is called.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS
+*/
+int ADDCALL statsd_disableConcurrency(Statsd* statsd){
+#if !defined (_WIN32)
+   Concurrent* concurrent = statsd->concurrent;
+   if (!concurrent){
+      return STATSD_SUCCESS;
+   }
+
+   pthread_mutex_lock(&concurrent->lock);
+   concurrent->running = 0;
+   pthread_cond_signal(&concurrent->wake);
+   pthread_mutex_unlock(&concurrent->lock);
+   pthread_join(concurrent->flusher, NULL);
+
+   //Collect the partial buffers that were never handed off
+   for (Stage* stage = concurrent->stages; stage; stage = stage->next){
+      if (stage->current && stage->current->length > 0){
+         handOff(concurrent, stage->current);
+      }
+      else {
+         free(stage->current);
+      }
+
+      stage->current = NULL;
+   }
+
+   sendStaged(statsd, concurrent->queue);
+   statsd->concurrent = NULL;
+   free(concurrent->iov);
+   free(concurrent->parts);
+
+   Stage* stage = concurrent->stages;
+   while (stage){
+      Stage* next = stage->next;
+      free(stage->spare);
+      free(stage);
+      stage = next;
+   }
+
+   pthread_key_delete(concurrent->key);
+   pthread_mutex_destroy(&concurrent->lock);
+   pthread_cond_destroy(&concurrent->wake);
+   free(concurrent);
+#endif
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Send a block of newline separated stat strings. The block is split on
+   line boundaries into datagrams no larger then the packet size, and all of
+   them are handed to the kernel with as few system calls as possible
+   (a single sendmmsg() per 256 datagrams on Linux). The lines are sent
+   straight out of the caller's buffer without being copied.
+
+   @param[in] statsd - The statsd client object
+   @param[in] lines - The stat strings, each terminated by a newline. The
+      newline after the last line is optional.
+   @param[in] length - The length of the block in bytes
+   @param[out] report - Optional. Filled in with the number of datagrams,
+      how many were sent, how many system calls it took and the first
+      error. If report->status is set, report->statusSize entries of it
+      are set to 1 or 0 for every datagram that was or was not sent.
+
+   @return STATSD_SUCCESS if every datagram was sent, STATSD_UDP_SEND if
+      any of them failed, STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_sendLines(Statsd* statsd, const char* lines, int length, StatsdSendReport* report){
+   struct iovec stackIov[SEND_CHUNK_SIZE];
+   struct iovec* iov = stackIov;
+
+   //Most blocks fit on the stack, larger ones are split a second time
+   //into an array that is big enough.
+   int count = splitLines(lines, length, statsd->packetSize, iov, SEND_CHUNK_SIZE);
+   if (count > SEND_CHUNK_SIZE){
+      iov = (struct iovec*)malloc(count * sizeof(struct iovec));
+      if (!iov){
+         return STATSD_MALLOC;
+      }
+
+      splitLines(lines, length, statsd->packetSize, iov, count);
+   }
+
+   lockClient(statsd);
+   int ret = sendPackets(statsd, iov, NULL, count, report);
+   unlockClient(statsd);
+   if (iov != stackIov){
+      free(iov);
+   }
+
+   return ret;
+}
+
+/**
+   Register a metric whose bucket, type and sample rate are fixed. The
+   "namespace.bucket:" prefix and the "|type|@rate" suffix are serialized
+   once here, so sending through the handle only has to format the value.
+   The handle stays tied to the client and must be freed with
+   statsd_freeMetric() before the client is released.
+
+   @param[in] statsd - The statsd client object
+   @param[out] metric - This is where the new handle will be placed
+   @param[in] bucket - The bucket name. If this is NULL the default bucket
+      of the client is used. The name is copied.
+   @param[in] type - The type of the stat
+   @param[in] sampleRate - The sample rate used every time the metric is sent
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_STATS_TYPE if the type is
+      not recognized, STATSD_BAD_BUCKET if the name is too long, or
+      STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_registerMetric(Statsd* statsd, StatsdMetric** metric, const char* bucket, StatsType type, double sampleRate){
+   return statsd_registerTaggedMetric(statsd, metric, bucket, type, sampleRate, NULL);
+}
+
+/**
+   Register a metric with tags of its own, which are serialized into the
+   metric along with the client's default tags, so sending it costs no
+   more then an untagged metric. The client's default tags are the ones
+   set when the metric is registered, except when the metric is
+   aggregated.
+
+   @param[in] statsd - The statsd client object
+   @param[out] metric - The new metric handle
+   @param[in] bucket - The bucket of the metric, or NULL for the default
+   @param[in] type - The type of the metric
+   @param[in] sampleRate - The sample rate used every time the metric is sent
+   @param[in] tags - The metric's tags, or NULL. They are copied.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_STATS_TYPE if the type is
+      not recognized, STATSD_BAD_BUCKET if the bucket is too long,
+      STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_registerTaggedMetric(Statsd* statsd, StatsdMetric** metric, const char* bucket, StatsType type, double sampleRate, const StatsdTags* tags){
+   if (type <= STATSD_NONE || type >= STATSD_BATCH){
+      return STATSD_BAD_STATS_TYPE;
+   }
+
+   if (!bucket){
+      bucket = statsd->bucket;
+   }
+
+   //Serialize a stat with an empty value and split it around the value
+   char wire[STAT_MAX_SIZE];
+   int wireLength = buildStatString(wire, sizeof(wire), statsd->nameSpace, bucket, type, 0, sampleRate, statsd->tags, tags);
+   if (wireLength < 0){
+      return STATSD_BAD_BUCKET;
+   }
+
+   int bucketLength = (int)strlen(bucket);
+   int prefixLength = (statsd->nameSpace ? (int)strlen(statsd->nameSpace) + 1 : 0) + bucketLength + 1;
+
+   StatsdMetric* newMetric = (StatsdMetric*)malloc(sizeof(StatsdMetric) + wireLength + bucketLength + 1);
+   if (!newMetric){
+      return STATSD_MALLOC;
+   }
+
+   if (copyTags(tags, &newMetric->tags) != STATSD_SUCCESS){
+      free(newMetric);
+      return STATSD_MALLOC;
+   }
+
+   char* storage = (char*)(newMetric + 1);
+   memcpy(storage, wire, wireLength);
+   memcpy(storage + wireLength, bucket, bucketLength + 1);
+
+   newMetric->statsd = statsd;
+   newMetric->type = type;
+   newMetric->sampleRate = sampleRate;
+   newMetric->sampleThreshold = sampleThreshold(sampleRate);
+   newMetric->bucket = storage + wireLength;
+   newMetric->bucketHash = hashBucket(newMetric->bucket, STATSD_NONE);
+   newMetric->prefix = storage;
+   newMetric->prefixLength = prefixLength;
+   newMetric->suffix = storage + prefixLength + 1;
+   newMetric->suffixLength = wireLength - prefixLength - 1;
+
+   *metric = newMetric;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Free a metric handle created by statsd_registerMetric()
+
+   @param[in] metric - The metric handle
+*/
+void ADDCALL statsd_freeMetric(StatsdMetric* metric){
+   if (metric){
+      free(metric->tags);
+   }
+   free(metric);
+}
+
+/**
+   Send a value for a registered metric. This behaves like statsd_count(),
+   statsd_gauge(), statsd_set() or statsd_timing() depending on the type
+   the metric was registered with, including aggregation and concurrent
+   mode.
+
+   @param[in] metric - The metric handle
+   @param[in] value - The value to send
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+*/
+int ADDCALL statsd_sendMetric(StatsdMetric* metric, int value){
+   return statsd_sendMetric64(metric, value);
+}
+
+/**
+   The same as statsd_sendMetric(), with a 64 bit value.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_sendMetric
+*/
+int ADDCALL statsd_sendMetric64(StatsdMetric* metric, int64_t value){
+   Statsd* stats = metric->statsd;
+   double sampleRate = metric->sampleRate;
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(stats, metric->bucket, metric->bucketHash, metric->sampleThreshold)){
+      return STATSD_SUCCESS;
+   }
+
+   if (stats->aggregator && (metric->type != STATSD_TIMING || stats->aggregator->timings)){
+      lockClient(stats);
+      int ret = aggregate(stats, metric->bucket, metric->type, value, sampleRate, metric->tags);
+      unlockClient(stats);
+      return ret;
+   }
+
+   char data[STAT_MAX_SIZE];
+   int dataLength = buildMetricString(data, sizeof(data), metric, value);
+   if (dataLength < 0){
+      return -dataLength;
+   }
+
+   countStat(stats, &stats->counters.serialized, 1);
+   return sendStat(stats, data, dataLength);
+}
+
+/**
+   The same as statsd_sendMetric(), with a floating point value.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_sendMetric
+*/
+int ADDCALL statsd_sendMetricDouble(StatsdMetric* metric, double value){
+   Statsd* stats = metric->statsd;
+   double sampleRate = metric->sampleRate;
+
+   if (!isfinite(value)){
+      return STATSD_BAD_VALUE;
+   }
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(stats, metric->bucket, metric->bucketHash, metric->sampleThreshold)){
+      return STATSD_SUCCESS;
+   }
+
+   if (stats->aggregator && (metric->type != STATSD_TIMING || stats->aggregator->timings)){
+      lockClient(stats);
+      int ret = aggregateDouble(stats, metric->bucket, metric->type, value, sampleRate, metric->tags);
+      unlockClient(stats);
+      return ret;
+   }
+
+   char data[STAT_MAX_SIZE];
+   char digits[FLOAT_MAX_SIZE];
+   int valueLength = formatDouble(digits, value);
+   int dataLength = buildMetricValue(data, sizeof(data), metric, digits, valueLength);
+   if (dataLength < 0){
+      return -dataLength;
+   }
+
+   countStat(stats, &stats->counters.serialized, 1);
+   return sendStat(stats, data, dataLength);
+}
+
+/**
+   Add a value for a registered metric to the batch buffer. This behaves
+   like statsd_addToBatch(), sending the batch first if it is full.
+
+   @param[in] metric - The metric handle
+   @param[in] value - The value of the stat
+
+   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if a full batch could
+      not be sent, STATSD_BATCH_FULL if the stat is larger then the packet
+      size.
+*/
+int ADDCALL statsd_addMetricToBatch(StatsdMetric* metric, int value){
+   return statsd_addMetricToBatch64(metric, value);
+}
+
+/**
+   The same as statsd_addMetricToBatch(), with a 64 bit value.
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+   @see statsd_addMetricToBatch
+*/
+int ADDCALL statsd_addMetricToBatch64(StatsdMetric* metric, int64_t value){
+   //See if we randomly fall under the sample rate
+   if (sampledOut(metric->statsd, metric->bucket, metric->bucketHash, metric->sampleThreshold)){
+      return STATSD_SUCCESS;
+   }
+
+   char digits[20];
+   int valueLength = formatInteger(digits, value);
+   return batchMetricValue(metric, digits, valueLength);
+}
+
+/**
+   The same as statsd_addMetricToBatch(), with a floating point value.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_addMetricToBatch
+*/
+int ADDCALL statsd_addMetricToBatchDouble(StatsdMetric* metric, double value){
+   if (!isfinite(value)){
+      return STATSD_BAD_VALUE;
+   }
+
+   //See if we randomly fall under the sample rate
+   if (sampledOut(metric->statsd, metric->bucket, metric->bucketHash, metric->sampleThreshold)){
+      return STATSD_SUCCESS;
+   }
+
+   char digits[FLOAT_MAX_SIZE];
+   int valueLength = formatDouble(digits, value);
+   return batchMetricValue(metric, digits, valueLength);
+}
+
+/**
+   Aggregate timings on the client as well. Every timing bucket keeps a
+   histogram of fixed size (under 3KB) with the exact count, minimum and
+   maximum. When the aggregates are flushed each histogram is summarized
+   in one of two ways:
+
+   If samples is 0 or less, a gauge is sent for every requested percentile
+   as "bucket.p<percentile>" (for example "bucket.p99" or "bucket.p99_9"),
+   along with "bucket.count", "bucket.min" and "bucket.max" gauges.
+
+   Otherwise up to samples representative timings are sent to the bucket,
+   evenly spread over the histogram, with a sample rate that makes the
+   server count them as the real number of observations.
+
+   This turns on aggregation if it is not already on.
+
+   @param[in] statsd - The statsd client object
+   @param[in] percentiles - The percentiles to send, between 0 and 100.
+      Only used if samples is 0 or less. If this is NULL, the 50th, 90th
+      and 99th percentiles are sent.
+   @param[in] count - The number of percentiles
+   @param[in] samples - The number of representative timings to send per
+      bucket, or 0 to send percentiles.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if out of memory,
+      STATSD_BAD_MODE if the client is in concurrent mode.
+*/
+int ADDCALL statsd_enableTimingAggregation(Statsd* statsd, const double* percentiles, int count, int samples){
+   static const double defaultPercentiles[] = { 50.0, 90.0, 99.0 };
+   if (!percentiles){
+      percentiles = defaultPercentiles;
+      count = sizeof(defaultPercentiles) / sizeof(defaultPercentiles[0]);
+   }
+
+   int ret = statsd_enableAggregation(statsd, 0);
+   if (ret != STATSD_SUCCESS){
+      return ret;
+   }
+
+   Aggregator* aggregator = statsd->aggregator;
+   double* copies = (double*)malloc(count * sizeof(double) + 1);
+   char (*names)[PERCENTILE_NAME_SIZE] = malloc(count * PERCENTILE_NAME_SIZE + 1);
+   if (!copies || !names){
+      free(copies);
+      free(names);
+      return STATSD_MALLOC;
+   }
+
+   //Name every percentile once, with an underscore in place of the
+   //decimal point so it doesn't add a level to the bucket name.
+   for (int i = 0; i < count; i++){
+      copies[i] = percentiles[i];
+      snprintf(names[i], PERCENTILE_NAME_SIZE, ".p%g", percentiles[i]);
+      for (char* c = names[i]; *c; c++){
+         if (*c == '.' && c != names[i]){
+            *c = '_';
+         }
+      }
+   }
+
+   free(aggregator->percentiles);
+   free(aggregator->percentileNames);
+   aggregator->percentiles = copies;
+   aggregator->percentileNames = names;
+   aggregator->percentileCount = count;
+   aggregator->timingSamples = samples;
+   aggregator->timings = 1;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Count the unique members of every set on the client instead of sending
+   them. Each set keeps its exact members up to threshold, after which it
+   switches to a HyperLogLog sketch of fixed size (4KB) for the rest of the
+   interval. When the aggregates are flushed, every set is sent as a gauge
+   of its unique member count (exact or estimated) under its own bucket
+   name, and starts over with exact members.
+
+   This turns on aggregation if it is not already on.
+
+   @param[in] statsd - The statsd client object
+   @param[in] threshold - The number of unique members a set keeps exactly.
+      A value of 0 or less uses a default of 256.
+
+   @return STATSD_SUCCESS on success, STATSD_MALLOC if out of memory,
+      STATSD_BAD_MODE if the client is in concurrent mode.
+*/
+int ADDCALL statsd_enableSetCardinality(Statsd* statsd, int threshold){
+   int ret = statsd_enableAggregation(statsd, 0);
+   if (ret != STATSD_SUCCESS){
+      return ret;
+   }
+
+   statsd->aggregator->cardinality = 1;
+   statsd->aggregator->setThreshold = threshold > 0 ? threshold : SET_DEFAULT_THRESHOLD;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Choose how sampled stats are picked. STATSD_SAMPLE_RANDOM (the default)
+   keeps each stat with a probability equal to its sample rate, using a
+   fast RNG owned by each thread. STATSD_SAMPLE_KEYED makes the decision a
+   hash of the bucket name and the key set by the calling thread with
+   statsd_setSampleKey(), so everything about one key (a request, a user)
+   is either kept or dropped in every process. Stats recorded while the
+   thread has no key are sampled randomly.
+
+   A random function assigned to statsd->random overrides both modes.
+
+   @param[in] statsd - The statsd client object
+   @param[in] mode - The sampling mode
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the mode is not
+      recognized.
+*/
+int ADDCALL statsd_setSampling(Statsd* statsd, StatsdSampling mode){
+   if (mode != STATSD_SAMPLE_RANDOM && mode != STATSD_SAMPLE_KEYED){
+      return STATSD_BAD_MODE;
+   }
+
+   statsd->sampling = mode;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Set the key the calling thread uses for keyed sampling. The key stays
+   in place for every client until it is changed or cleared.
+
+   @param[in] key - The key, such as a request or trace id. Passing NULL
+      clears the key.
+*/
+void ADDCALL statsd_setSampleKey(const char* key){
+   if (!key){
+      samplerKey = 0;
+      return;
+   }
+
+   uint64_t hash = mixHash(hashBucket(key, STATSD_NONE));
+   samplerKey = hash ? hash : 1;
+}
+
+/**
+   Size the ring buffer of a client using the TCP transport, and choose
+   what happens when it fills up because the server is slow or gone.
+   STATSD_OVERFLOW_DROP_NEWEST (the default) drops the stats that don't
+   fit, STATSD_OVERFLOW_DROP_OLDEST makes room by dropping the oldest
+   complete lines. Stats waiting to be written are kept.
+
+   @param[in] statsd - The statsd client object
+   @param[in] size - The size of the ring buffer in bytes, rounded up to a
+      power of 2. It must be at least the packet size.
+   @param[in] overflow - The overflow policy
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client does
+      not use TCP or is in concurrent mode, STATSD_BAD_PACKET_SIZE if the
+      size is too small for the packet size or the waiting stats,
+      STATSD_MALLOC if the buffer could not be allocated.
+*/
+int ADDCALL statsd_setStreamBuffer(Statsd* statsd, int size, StatsdOverflow overflow){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   Stream* stream = statsd->stream;
+   if (!stream || statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   if (overflow != STATSD_OVERFLOW_DROP_NEWEST && overflow != STATSD_OVERFLOW_DROP_OLDEST){
+      return STATSD_BAD_MODE;
+   }
+
+   uint64_t pending = stream->head - stream->tail;
+   if (size < statsd->packetSize || (uint64_t)size < pending){
+      return STATSD_BAD_PACKET_SIZE;
+   }
+
+   uint64_t capacity = 1;
+   while (capacity < (uint64_t)size){
+      capacity <<= 1;
+   }
+
+   char* ring = (char*)malloc(capacity);
+   if (!ring){
+      return STATSD_MALLOC;
+   }
+
+   //Move the waiting stats to the front of the new buffer
+   uint64_t mask = stream->capacity - 1;
+   for (uint64_t i = 0; i < pending; i++){
+      ring[i] = stream->ring[(stream->tail + i) & mask];
+   }
+
+   free(stream->ring);
+   stream->ring = ring;
+   stream->capacity = capacity;
+   stream->tail = 0;
+   stream->head = pending;
+   stream->overflow = overflow;
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Choose what happens when the socket buffer is full. The client's socket
+   never blocks, so by default (STATSD_BACKPRESSURE_DROP) a datagram that
+   does not fit is dropped and counted. STATSD_BACKPRESSURE_SPILL keeps up
+   to limit bytes of datagrams in a local queue, which is sent ahead of any
+   new datagrams once the socket has room. STATSD_BACKPRESSURE_BLOCK waits
+   up to limit milliseconds for room before dropping the datagram. This
+   does not apply to the TCP transport, which has its own buffer.
+
+   @param[in] statsd - The statsd client object
+   @param[in] policy - The backpressure policy
+   @param[in] limit - The size of the spill queue in bytes, or the longest
+      wait in milliseconds. A value of 0 or less uses a default of 64KB or
+      10ms.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the policy is not
+      recognized or the client is in concurrent mode, STATSD_MALLOC if the
+      spill queue could not be allocated.
+*/
+int ADDCALL statsd_setBackpressure(Statsd* statsd, StatsdBackpressure policy, int limit){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   if (policy != STATSD_BACKPRESSURE_DROP && policy != STATSD_BACKPRESSURE_SPILL && policy != STATSD_BACKPRESSURE_BLOCK){
+      return STATSD_BAD_MODE;
+   }
+
+   //A send through io_uring fails after the caller has moved on, so
+   //there is nothing left to wait on or spill
+   if (statsd->uring && policy != STATSD_BACKPRESSURE_DROP){
+      return STATSD_BAD_MODE;
+   }
+
+   freeSpill(statsd);
+
+   if (policy == STATSD_BACKPRESSURE_SPILL){
+      Spill* spill = (Spill*)calloc(1, sizeof(Spill));
+      if (!spill){
+         return STATSD_MALLOC;
+      }
+
+      spill->capacity = limit > 0 ? limit : SPILL_DEFAULT_SIZE;
+      spill->data = (char*)malloc(spill->capacity);
+      if (!spill->data){
+         free(spill);
+         return STATSD_MALLOC;
+      }
+
+      statsd->spill = spill;
+   }
+
+   statsd->backpressure = policy;
+   statsd->blockTimeout = policy == STATSD_BACKPRESSURE_BLOCK && limit <= 0 ? BLOCK_DEFAULT_TIMEOUT : limit;
+
+   for (int i = 1; statsd->shards && i < statsd->shards->count; i++){
+      int ret = statsd_setBackpressure(statsd->shards->servers[i], policy, limit);
+      if (ret != STATSD_SUCCESS){
+         return ret;
+      }
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Set the size of the socket's send buffer (SO_SNDBUF). A larger buffer
+   absorbs bursts that would otherwise hit the backpressure policy. The
+   kernel may round the size, or cap it at a system wide limit.
+
+   @param[in] statsd - The statsd client object
+   @param[in] size - The send buffer size in bytes
+
+   @return STATSD_SUCCESS on success, STATSD_SOCKET if the size could not be set.
+*/
+int ADDCALL statsd_setSendBuffer(Statsd* statsd, int size){
+   if (setsockopt(statsd->socketFd, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size)) != 0){
+      return STATSD_SOCKET;
+   }
+
+   for (int i = 1; statsd->shards && i < statsd->shards->count; i++){
+      if (statsd_setSendBuffer(statsd->shards->servers[i], size) != STATSD_SUCCESS){
+         return STATSD_SOCKET;
+      }
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Get the number of stats and bytes the client has dropped, because the
+   socket or the TCP transport's buffer had no room, or because the send
+   failed. This is safe to call from any thread.
+
+   @param[in] statsd - The statsd client object
+   @param[out] metrics - Optional, the number of stats dropped
+   @param[out] bytes - Optional, the number of bytes dropped
+*/
+void ADDCALL statsd_getDropped(Statsd* statsd, uint64_t* metrics, uint64_t* bytes){
+   uint64_t droppedMetrics = 0;
+   uint64_t droppedBytes = 0;
+
+   int count = statsd->shards ? statsd->shards->count : 1;
+   for (int i = 0; i < count; i++){
+      Statsd* server = statsd->shards ? statsd->shards->servers[i] : statsd;
+      droppedMetrics += __atomic_load_n(&server->droppedMetrics, __ATOMIC_RELAXED);
+      droppedBytes += __atomic_load_n(&server->droppedBytes, __ATOMIC_RELAXED);
+   }
+
+   if (metrics){
+      *metrics = droppedMetrics;
+   }
+
+   if (bytes){
+      *bytes = droppedBytes;
+   }
+}
+
+/**
+   Add another server to the client. Once a client has more then one
+   server, every stat is sent to just one of them, chosen by a consistent
+   hash of its full name (namespace and bucket). The same bucket always
+   goes to the same server, so each server sees every value of the buckets
+   it owns, and adding a server only moves about 1/n of the buckets. The
+   server given to statsd_init() is the first server.
+
+   The new server uses the client's packet size and backpressure policy.
+   Servers take the same forms as in statsd_init(), including unix:// and
+   tcp:// servers.
+
+   @param[in] statsd - The statsd client object
+   @param[in] server - The host name, address or path of the server
+   @param[in] port - The port of the server
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode, STATSD_MALLOC if out of memory, or the error from
+      setting up the server's socket.
+*/
+int ADDCALL statsd_addServer(Statsd* statsd, const char* server, int port){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   Shards* shards = statsd->shards;
+   if (!shards){
+      shards = (Shards*)calloc(1, sizeof(Shards));
+      if (!shards){
+         return STATSD_MALLOC;
+      }
+   }
+
+   int count = shards->count ? shards->count + 1 : 2;
+   Statsd** servers = (Statsd**)realloc(shards->servers, count * sizeof(Statsd*));
+   if (servers){
+      shards->servers = servers;
+   }
+
+   Outbox* outboxes = (Outbox*)realloc(shards->outboxes, count * sizeof(Outbox));
+   if (outboxes){
+      shards->outboxes = outboxes;
+   }
+
+   RingPoint* ring = (RingPoint*)realloc(shards->ring, count * SHARD_POINTS * sizeof(RingPoint));
+   if (ring){
+      shards->ring = ring;
+   }
+
+   Statsd* newServer = NULL;
+   int ret = !servers || !outboxes || !ring ? STATSD_MALLOC : statsd_new(&newServer, server, port, NULL, NULL);
+   if (ret == STATSD_SUCCESS){
+      ret = statsd_setPacketSize(newServer, statsd->packetSize);
+   }
+   if (ret == STATSD_SUCCESS){
+      ret = statsd_setBackpressure(newServer, statsd->backpressure, statsd->backpressure == STATSD_BACKPRESSURE_SPILL ? statsd->spill->capacity : statsd->blockTimeout);
+   }
+
+   if (ret != STATSD_SUCCESS){
+      statsd_free(newServer);
+      if (!statsd->shards){
+         freeShards(shards);
+      }
+      return ret;
+   }
+
+   if (shards->count == 0){
+      shards->servers[0] = statsd;
+      memset(&shards->outboxes[0], 0, sizeof(Outbox));
+      shards->count = 1;
+   }
+
+   newServer->shardIndex = shards->count;
+   newServer->timeSends = statsd->timeSends;
+   shards->servers[shards->count] = newServer;
+   memset(&shards->outboxes[shards->count], 0, sizeof(Outbox));
+   shards->count++;
+
+   //Every server's points come from its own address, so the ring does
+   //not depend on the order servers were added in.
+   shards->ringSize = 0;
+   for (int i = 0; i < shards->count; i++){
+      char key[STAT_MAX_SIZE];
+      int keyLength = snprintf(key, sizeof(key), "%s:%d", shards->servers[i]->serverAddress, shards->servers[i]->port);
+      uint64_t base = hashName(key, keyLength < (int)sizeof(key) ? keyLength : (int)sizeof(key) - 1);
+
+      for (int point = 0; point < SHARD_POINTS; point++){
+         shards->ring[shards->ringSize].hash = mixHash(base + (uint64_t)point * 0x9E3779B97F4A7C15ULL);
+         shards->ring[shards->ringSize].server = i;
+         shards->ringSize++;
+      }
+   }
+
+   qsort(shards->ring, shards->ringSize, sizeof(RingPoint), compareRingPoints);
+   statsd->shards = shards;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Read the client's internal counters: how many stats were sampled out,
+   serialized, batched and sent, how many packets and bytes went out, how
+   many send system calls were made and how many of them failed, what was
+   dropped, and how full batches were. For a sharded client the counters
+   of every server are added together. The counters only ever grow, from
+   when the client was initialized. They can be read from any thread.
+
+   @param[in] statsd - The statsd client object
+   @param[out] stats - Filled in with the counters
+*/
+void ADDCALL statsd_getInternalStats(Statsd* statsd, StatsdInternalStats* stats){
+   memset(stats, 0, sizeof(StatsdInternalStats));
+
+   int count = statsd->shards ? statsd->shards->count : 1;
+   for (int i = 0; i < count; i++){
+      Statsd* server = statsd->shards ? statsd->shards->servers[i] : statsd;
+      const StatsdInternalStats* counters = &server->counters;
+
+      stats->sampledOut += __atomic_load_n(&counters->sampledOut, __ATOMIC_RELAXED);
+      stats->serialized += __atomic_load_n(&counters->serialized, __ATOMIC_RELAXED);
+      stats->batched += __atomic_load_n(&counters->batched, __ATOMIC_RELAXED);
+      stats->sent += __atomic_load_n(&counters->sent, __ATOMIC_RELAXED);
+      stats->packets += __atomic_load_n(&counters->packets, __ATOMIC_RELAXED);
+      stats->bytes += __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED);
+      stats->calls += __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+      stats->failedCalls += __atomic_load_n(&counters->failedCalls, __ATOMIC_RELAXED);
+      stats->batches += __atomic_load_n(&counters->batches, __ATOMIC_RELAXED);
+      stats->batchBytes += __atomic_load_n(&counters->batchBytes, __ATOMIC_RELAXED);
+
+      for (int b = 0; b < STATSD_LATENCY_BUCKETS; b++){
+         stats->sendLatency[b] += __atomic_load_n(&counters->sendLatency[b], __ATOMIC_RELAXED);
+      }
+   }
+
+   statsd_getDropped(statsd, &stats->dropped, &stats->droppedBytes);
+
+   if (stats->batches > 0){
+      stats->batchFill = (double)stats->batchBytes / ((double)stats->batches * statsd->packetSize);
+   }
+}
+
+/**
+   Time every send system call the client makes, into the sendLatency
+   histogram of statsd_getInternalStats(). This costs two reads of the
+   clock per call, so it is off by default.
+
+   @param[in] statsd - The statsd client object
+   @param[in] enable - 1 to time sends, 0 to stop
+
+   @return STATSD_SUCCESS
+*/
+int ADDCALL statsd_enableSendTiming(Statsd* statsd, int enable){
+   statsd->timeSends = enable != 0;
+
+   for (int i = 1; statsd->shards && i < statsd->shards->count; i++){
+      statsd->shards->servers[i]->timeSends = statsd->timeSends;
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Have the client report on itself. Every statsd_flush(), and every pass
+   of the flusher thread in concurrent mode, sends what changed in the
+   internal counters as counts (and the batch fill as a gauge in percent)
+   under nameSpace, at most once every SELF_REPORT_INTERVAL seconds.
+
+   @param[in] statsd - The statsd client object
+   @param[in] nameSpace - Where to put the client's stats, or NULL for
+      STATSD_INTERNAL_NAMESPACE. It is copied.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode, STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_enableSelfReport(Statsd* statsd, const char* nameSpace){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   if (!nameSpace){
+      nameSpace = STATSD_INTERNAL_NAMESPACE;
+   }
+
+   SelfReport* self = (SelfReport*)calloc(1, sizeof(SelfReport));
+   if (!self){
+      return STATSD_MALLOC;
+   }
+
+   self->nameSpace = (char*)malloc(strlen(nameSpace) + 1);
+   if (!self->nameSpace){
+      free(self);
+      return STATSD_MALLOC;
+   }
+
+   strcpy(self->nameSpace, nameSpace);
+   self->reportedAt = time(NULL);
+   statsd_getInternalStats(statsd, &self->reported);
+
+   statsd_disableSelfReport(statsd);
+   statsd->selfReport = self;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Stop the client from reporting on itself.
+
+   @param[in] statsd - The statsd client object
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode.
+*/
+int ADDCALL statsd_disableSelfReport(Statsd* statsd){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   if (statsd->selfReport){
+      free(statsd->selfReport->nameSpace);
+      free(statsd->selfReport);
+      statsd->selfReport = NULL;
+   }
+
+   return STATSD_SUCCESS;
+}
+
+/**
+   Pick the clock timers run on. STATSD_CLOCK_MONOTONIC, the default, is
+   clock_gettime(CLOCK_MONOTONIC). STATSD_CLOCK_TSC reads the processor's
+   time stamp counter, which is cheaper but only available on x86 with an
+   invariant counter. The first time it is picked, the counter is
+   calibrated against the monotonic clock, which takes
+   TSC_CALIBRATION_MILLIS. A timer should be stopped on the clock it was
+   started on.
+
+   @param[in] statsd - The statsd client object
+   @param[in] clock - The clock to use
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the clock is not
+      available on this machine.
+*/
+int ADDCALL statsd_setClock(Statsd* statsd, StatsdClock clock){
+   if (clock == STATSD_CLOCK_TSC){
+#if defined (HAVE_TSC)
+      double nanos;
+      __atomic_load(&tscNanos, &nanos, __ATOMIC_RELAXED);
+      if (nanos == 0.0 && invariantTsc()){
+         nanos = calibrateTsc();
+         __atomic_store(&tscNanos, &nanos, __ATOMIC_RELAXED);
+      }
+
+      if (nanos == 0.0){
+         return STATSD_BAD_MODE;
+      }
+#else
+      return STATSD_BAD_MODE;
+#endif
+   }
+   else if (clock != STATSD_CLOCK_MONOTONIC){
+      return STATSD_BAD_MODE;
+   }
+
+   statsd->clock = clock;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Start timing something. The sampling decision is made here, so a timer
+   that is sampled out does not even read the clock, and its stop is free.
+   The timer is plain memory the caller owns, usually on the stack, and
+   there is nothing to free.
+
+   @param[in] statsd - The statsd client object
+   @param[out] timer - The timer to start
+   @param[in] bucket - The bucket to send the timing to, or NULL for the
+      client's default bucket. It must stay valid until the timer stops.
+   @param[in] sampleRate - The sample rate of the timing
+*/
+void ADDCALL statsd_timerStart(Statsd* statsd, StatsdTimer* timer, const char* bucket, double sampleRate){
+   statsd_timerStartTagged(statsd, timer, bucket, sampleRate, NULL);
+}
+
+/**
+   The same as statsd_timerStart(), for a timing with tags of its own.
+
+   @param[in] statsd - The statsd client object
+   @param[out] timer - The timer to start
+   @param[in] bucket - The bucket to send the timing to, or NULL for the
+      client's default bucket
+   @param[in] sampleRate - The sample rate of the timing
+   @param[in] tags - The timing's tags, or NULL. Like the bucket, they must
+      stay valid until the timer stops.
+*/
+void ADDCALL statsd_timerStartTagged(Statsd* statsd, StatsdTimer* timer, const char* bucket, double sampleRate, const StatsdTags* tags){
+   timer->bucket = bucket ? bucket : statsd->bucket;
+   timer->sampleRate = sampleRate;
+   timer->tags = tags;
+
+   //A timer with no client is not running
+   if (sampledOut(statsd, timer->bucket, 0, sampleThreshold(sampleRate))){
+      timer->statsd = NULL;
+      return;
+   }
+
+   timer->statsd = statsd;
+   timer->start = readClock(statsd->clock);
+}
+
+/**
+   Stop a timer and send the time since statsd_timerStart(), in
+   milliseconds with microsecond resolution ("12.345|ms"). When timings are
+   aggregated the full resolution goes into the histogram. Stopping a timer
+   twice, or one that was sampled out, does nothing.
+
+   @param[in,out] timer - The timer to stop
+
+   @return STATSD_SUCCESS on success, or the error of sending the timing
+*/
+int ADDCALL statsd_timerStop(StatsdTimer* timer){
+   Statsd* statsd = timer->statsd;
+   if (!statsd){
+      return STATSD_SUCCESS;
+   }
+
+   uint64_t elapsed = readClock(statsd->clock) - timer->start;
+   timer->statsd = NULL;
+
+   return sendTiming(statsd, timer->bucket, clockMicros(statsd->clock, elapsed), timer->sampleRate, timer->tags);
+}
+
+/**
+   Build a reusable set of tags, in the DogStatsD "|#key:value,key:value"
+   form. The tags are serialized once, here, and every stat sent with the
+   handle only copies the bytes. Tags are "key:value" or just "key", and
+   can not contain '|', ',' or a line break.
+
+   @param[out] tags - The new tags handle, to free with statsd_freeTags()
+   @param[in] pairs - The tags
+   @param[in] count - The number of tags
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_TAG if a tag is empty or
+      has a character that can't be sent, STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_newTags(StatsdTags** tags, const char** pairs, int count){
+   int length = count > 0 ? 2 + count - 1 : 0;
+   for (int i = 0; i < count; i++){
+      if (!pairs[i] || !pairs[i][0] || strpbrk(pairs[i], "|,\r\n")){
+         return STATSD_BAD_TAG;
+      }
+      length += (int)strlen(pairs[i]);
+   }
+
+   if (length > STAT_MAX_SIZE){
+      return STATSD_BAD_TAG;
+   }
+
+   StatsdTags* newTags = (StatsdTags*)malloc(sizeof(StatsdTags) + length + 1);
+   if (!newTags){
+      return STATSD_MALLOC;
+   }
+
+   char* data = (char*)(newTags + 1);
+   char* out = data;
+   for (int i = 0; i < count; i++){
+      int tagLength = (int)strlen(pairs[i]);
+      *out++ = i == 0 ? '|' : ',';
+      if (i == 0){
+         *out++ = '#';
+      }
+      memcpy(out, pairs[i], tagLength);
+      out += tagLength;
+   }
+   *out = '\0';
+
+   newTags->data = data;
+   newTags->length = length;
+   *tags = newTags;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Free a set of tags made by statsd_newTags(). Nothing may be sent with
+   them after this, but aggregates and metrics keep their own copy.
+
+   @param[in] tags - The tags to free
+*/
+void ADDCALL statsd_freeTags(StatsdTags* tags){
+   free(tags);
+}
+
+/**
+   Set the tags added to every stat the client sends, such as the host or
+   region. They are serialized once, here, and go before the tags of each
+   stat. Metrics that are already registered keep the tags they were
+   registered with.
+
+   @param[in] statsd - The statsd client object
+   @param[in] pairs - The tags, as for statsd_newTags(), or NULL to remove
+      the default tags
+   @param[in] count - The number of tags
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode, STATSD_BAD_TAG if a tag can't be sent,
+      STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_setTags(Statsd* statsd, const char** pairs, int count){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+   StatsdTags* tags = NULL;
+   if (pairs && count > 0){
+      int ret = statsd_newTags(&tags, pairs, count);
+      if (ret != STATSD_SUCCESS){
+         return ret;
+      }
+   }
+
+   free(statsd->tags);
+   statsd->tags = tags;
+   return STATSD_SUCCESS;
+}
+
+/**
+   Send a stat with tags of its own, which are added after the client's
+   default tags. This behaves like statsd_count64(), statsd_gauge64(),
+   statsd_set64() or statsd_timing64() depending on the type. When
+   aggregating, every set of tags is a separate aggregate.
+
+   @param[in] statsd - The statsd client object
+   @param[in] type - The type of the stat
+   @param[in] bucket - The bucket, or NULL for the default bucket
+   @param[in] value - The value of the stat
+   @param[in] sampleRate - The sample rate of the stat
+   @param[in] tags - The stat's tags, or NULL
+
+   @return STATSD_SUCCESS on success, an error if there is a problem.
+*/
+int ADDCALL statsd_sendTagged(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate, const StatsdTags* tags){
+   return sendToServer(statsd, bucket, type, value, sampleRate, tags);
+}
+
+/**
+   The same as statsd_sendTagged(), with a floating point value.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_VALUE if the value is not
+      a finite number, an error if there is a problem.
+   @see statsd_sendTagged
+*/
+int ADDCALL statsd_sendTaggedDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate, const StatsdTags* tags){
+   return sendDoubleToServer(statsd, bucket, type, value, sampleRate, tags);
+}
+
+/**
+   Open the reading end of a shared memory ring, creating the ring if no
+   client has yet. Only one drain may read a ring at a time. Clients send
+   to the ring by giving statsd_init() the same name with a shm:// prefix.
+
+   @param[out] drain - This is where the new drain will be placed
+   @param[in] name - The name of the ring in /dev/shm, as in "statsd"
+   @param[in] size - The size of the ring in bytes if it has to be created,
+      rounded up to a power of 2, or 0 for the default of 1MB. A ring that
+      already exists keeps its size.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_SERVER_ADDRESS if the name
+      is not valid, STATSD_SOCKET if the ring could not be opened,
+      STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_openDrain(StatsdDrain** drain, const char* name, int size){
+#if defined (_WIN32)
+   return STATSD_BAD_SERVER_ADDRESS;
+#else
+   uint64_t capacity = SHM_MIN_CAPACITY;
+   while (capacity < (uint64_t)size && capacity < SHM_MAX_CAPACITY){
+      capacity <<= 1;
+   }
+   if (size <= 0){
+      capacity = SHM_DEFAULT_CAPACITY;
+   }
+
+   StatsdDrain* newDrain = (StatsdDrain*)calloc(1, sizeof(StatsdDrain));
+   if (!newDrain){
+      return STATSD_MALLOC;
+   }
+
+   int ret = openRing(&newDrain->ring, name, capacity);
+   if (ret != STATSD_SUCCESS){
+      free(newDrain);
+      return ret;
+   }
+
+   //Room for the largest record, and the newline after it
+   newDrain->bufferSize = (int)(newDrain->ring.capacity / 4 + 1);
+   if (newDrain->bufferSize < DRAIN_BUFFER_SIZE){
+      newDrain->bufferSize = DRAIN_BUFFER_SIZE;
+   }
+
+   newDrain->buffer = (char*)malloc(newDrain->bufferSize);
+   if (!newDrain->buffer){
+      closeRing(&newDrain->ring);
+      free(newDrain);
+      return STATSD_MALLOC;
+   }
+
+   *drain = newDrain;
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Close a drain made by statsd_openDrain(). The ring and whatever is
+   still in it are left in /dev/shm.
+
+   @param[in] drain - The drain to close
 */
-int ADDCALL statsd_gauge(Statsd* stats, const char* bucket, int value, double sampleRate){
-   return sendToServer(stats, bucket, STATSD_GAUGE, value, sampleRate);
+void ADDCALL statsd_closeDrain(StatsdDrain* drain){
+#if !defined (_WIN32)
+   if (!drain){
+      return;
+   }
+
+   closeRing(&drain->ring);
+   free(drain->buffer);
+   free(drain);
+#endif
 }
 
 /**
-   Counts unique occurrences of events between flushes. 
+   Forward everything that has been added to the ring so far. Records are
+   copied out as lines, their space is given back to the producers, and
+   the lines are sent through the client with statsd_sendLines(), so
+   single stats from many processes go out in full packets. This never
+   waits for records that are still being written.
 
-   @param[in] stats - The statsd client object.
-   @param[in] bucket - The optional bucket name. If this is
-      not provided, the default bucket will be used from the 
-      statsd object.
-   @param[in] value - The value to set the bucket to.
-   @param[in] sampleRate - The sample rate of this statistic. If you specify
-      a value 0 or less, or 1 or more then this value is ignored. Otherwise
-      this value is sent on to the server. 
+   @param[in] drain - The drain
+   @param[in] statsd - The client to forward the stats through
+   @param[out] records - Optional, the number of records forwarded
 
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
+   @return STATSD_SUCCESS on success, or the first error from
+      statsd_sendLines().
 */
-int ADDCALL statsd_set(Statsd* stats, const char* bucket, int value, double sampleRate){
-   return sendToServer(stats, bucket, STATSD_SET, value, sampleRate);
+int ADDCALL statsd_drain(StatsdDrain* drain, Statsd* statsd, int* records){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   ShmRing* ring = &drain->ring;
+   uint64_t mask = ring->capacity - 1;
+   uint64_t tail = __atomic_load_n(&ring->header->tail, __ATOMIC_RELAXED);
+   uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+   int read = 0;
+   int ret = STATSD_SUCCESS;
+
+   while (tail != head){
+      uint64_t start = tail;
+      int length = 0;
+
+      while (tail != head){
+         uint32_t word = __atomic_load_n((uint32_t*)(ring->ring + (tail & mask)), __ATOMIC_ACQUIRE);
+         uint32_t recordLength = word & SHM_RECORD_LENGTH;
+
+         if (word & SHM_RECORD_SKIP){
+            tail += recordLength;
+            continue;
+         }
+
+         if (word == 0 || (word & SHM_RECORD_BUSY)){
+            //Give a slow producer time to finish, then decide it died
+            uint64_t time = monotonicMillis();
+            if (!drain->stalled || drain->stalledAt != tail){
+               drain->stalled = 1;
+               drain->stalledAt = tail;
+               drain->stalledSince = time;
+               break;
+            }
+
+            if (time - drain->stalledSince < SHM_STALL_MILLIS){
+               break;
+            }
+
+            //Without a length there is no finding the next record, so
+            //everything reserved so far goes
+            uint64_t lost = word == 0 ? head - tail : (sizeof(uint32_t) + recordLength + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1);
+            __atomic_add_fetch(&ring->header->dropped, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ring->header->droppedBytes, lost, __ATOMIC_RELAXED);
+            drain->stalled = 0;
+            tail += lost;
+            continue;
+         }
+
+         if (length + (int)recordLength + 1 > drain->bufferSize){
+            break;
+         }
+
+         memcpy(drain->buffer + length, ring->ring + (tail & mask) + sizeof(uint32_t), recordLength);
+         length += recordLength;
+         drain->buffer[length++] = '\n';
+         tail += (sizeof(uint32_t) + recordLength + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1);
+         read++;
+      }
+
+      if (tail == start){
+         break;
+      }
+
+      ringRelease(ring, start, tail);
+
+      if (length > 0){
+         int sent = statsd_sendLines(statsd, drain->buffer, length, NULL);
+         if (ret == STATSD_SUCCESS){
+            ret = sent;
+         }
+      }
+   }
+
+   if (records){
+      *records = read;
+   }
+
+   return ret;
+#endif
 }
 
 /**
-   Records the time it took something to take in milliseconds. 
+   Get the number of stats and bytes every client of the ring has dropped
+   because the ring was full, along with anything the drain threw away
+   from producers that died while writing.
 
-   @param[in] stats - The statsd client object.
-   @param[in] bucket - The optional bucket name. If this is
-      not provided, the default bucket will be used from the 
-      statsd object.
-   @param[in] value - The value to set the bucket to.
-   @param[in] sampleRate - The sample rate of this statistic. If you specify
-      a value 0 or less, or 1 or more then this value is ignored. Otherwise
-      this value is sent on to the server. NOTE: The actual sampling rate
-      must be done externally, as each statistic will be sent on
-      regardless of the sampleRate value.
+   @param[in] drain - The drain
+   @param[out] metrics - Optional, the number of stats dropped
+   @param[out] bytes - Optional, the number of bytes dropped
+*/
+void ADDCALL statsd_getRingDropped(StatsdDrain* drain, uint64_t* metrics, uint64_t* bytes){
+#if defined (_WIN32)
+   uint64_t droppedMetrics = 0;
+   uint64_t droppedBytes = 0;
+#else
+   uint64_t droppedMetrics = __atomic_load_n(&drain->ring.header->dropped, __ATOMIC_RELAXED);
+   uint64_t droppedBytes = __atomic_load_n(&drain->ring.header->droppedBytes, __ATOMIC_RELAXED);
+#endif
 
-   @return STATSD_SUCCESS on success, an error if there is a problem.
-   @see sendToServer
+   if (metrics){
+      *metrics = droppedMetrics;
+   }
+   if (bytes){
+      *bytes = droppedBytes;
+   }
+}
+
+/**
+   Send datagrams through io_uring instead of sendmmsg(). Each datagram is
+   copied into a buffer registered with the kernel and written to the
+   socket, which is registered too, and every batch of sends takes a single
+   io_uring_enter() call. The completions are reaped in batches on later
+   sends. This is meant for a flusher thread sending at high packet rates.
+   Whether io_uring is there is only known at run time, so if it is not,
+   this returns STATSD_BAD_MODE and the client keeps sending the usual way.
+
+   A failed send is only seen once it is reaped, so it is dropped and
+   counted whatever the backpressure policy, which has to be
+   STATSD_BACKPRESSURE_DROP. Servers have to be added before, and
+   concurrent mode enabled after.
+
+   @param[in] statsd - The statsd client object
+   @param[in] depth - The number of sends that can be in flight at once,
+      rounded up to a power of 2, or 0 for 64. The buffers are sized by
+      the current packet size.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if io_uring is not
+      available, or the client is in concurrent mode, does not send
+      datagrams, or has a backpressure policy other then dropping,
+      STATSD_MALLOC if out of memory.
 */
-int ADDCALL statsd_timing(Statsd* stats, const char* bucket, int timing, double sampleRate){
-   return sendToServer(stats, bucket, STATSD_TIMING, timing, sampleRate);
+int ADDCALL statsd_enableUring(Statsd* statsd, int depth){
+#if defined (HAVE_URING)
+   if (statsd->concurrent || statsd->stream || statsd->shm || statsd->backpressure != STATSD_BACKPRESSURE_DROP){
+      return STATSD_BAD_MODE;
+   }
+
+   if (depth <= 0){
+      depth = URING_DEFAULT_DEPTH;
+   }
+   if (depth > URING_MAX_DEPTH){
+      depth = URING_MAX_DEPTH;
+   }
+
+   int count = statsd->shards ? statsd->shards->count : 1;
+   for (int i = 0; i < count; i++){
+      Statsd* server = statsd->shards ? statsd->shards->servers[i] : statsd;
+      if (server->stream || server->shm){
+         return STATSD_BAD_MODE;
+      }
+   }
+
+   for (int i = 0; i < count; i++){
+      Statsd* server = statsd->shards ? statsd->shards->servers[i] : statsd;
+      if (server->uring){
+         continue;
+      }
+
+      int ret = uringSetup(server, depth);
+      if (ret != STATSD_SUCCESS){
+         statsd_disableUring(statsd);
+         return ret;
+      }
+   }
+
+   return STATSD_SUCCESS;
+#else
+   return STATSD_BAD_MODE;
+#endif
 }
 
 /**
-   This function will reset the batch data that is being
-   held. This is called automatically whenever you send
-   the batch data to the server. You can also call this
-   manually to removed any stored batch data.
+   Go back to sending with sendmmsg(), after waiting for the sends that are
+   still in flight.
 
    @param[in] statsd - The statsd client object
-   @return STATSD_SUCCESS
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode.
 */
-int ADDCALL statsd_resetBatch(Statsd* statsd){
-   memset(statsd->batch, 0, BATCH_MAX_SIZE);
-   statsd->batchIndex = 0;
+int ADDCALL statsd_disableUring(Statsd* statsd){
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
+   }
+
+#if defined (HAVE_URING)
+   int count = statsd->shards ? statsd->shards->count : 1;
+   for (int i = 0; i < count; i++){
+      uringFree(statsd->shards ? statsd->shards->servers[i] : statsd);
+   }
+#endif
+
    return STATSD_SUCCESS;
 }
 
 /**
-   Add stats to the batch buffer to be sent later. 
+   Turn on the flush scheduler, so that nothing the client holds on to
+   waits for a manual statsd_sendBatch() or statsd_flush(). The batch is
+   sent as soon as it holds threshold bytes, or maxLatency milliseconds
+   after its first stat was added, whichever comes first. Aggregated
+   buckets are flushed every interval set with statsd_setFlushInterval()
+   or statsd_setBucketInterval(), one second unless told otherwise.
+   Buckets are due on multiples of their interval, so the ones that share
+   an interval are flushed into the same packets.
+
+   Deadlines are kept in a timer wheel with 10ms ticks, so the work done
+   on every run only depends on what is due, and aggregates may be up to
+   a tick late.
+
+   Something has to run the scheduler. With background set, a thread does
+   it. The client is still only used by one thread at a time, but the
+   stat, batch and flush functions take a lock shared with the scheduler
+   thread. Otherwise an event loop calls statsd_runScheduler() when the
+   fd from statsd_getSchedulerFd() is readable, or once the timeout from
+   statsd_getSchedulerTimeout() has passed.
 
    @param[in] statsd - The statsd client object
-   @param[in] type - The type of stat being added
-   @param[in] bucket - The name of a bucket to put the stat. This
-      is optional and if not provided the default bucket name from
-      the statsd object will be used.
-   @param[in] value - The value of the stat
-   @param[in] sampleRate - The rate at which the stat was gathered. 
-   
-   @return STATSD_SUCCESS if everything was successful. 
+   @param[in] maxLatency - The longest a stat waits in the batch, in
+      milliseconds, or 0 for 100ms
+   @param[in] threshold - The batch size in bytes that sends it right away,
+      or 0 to only send a batch early once it is full
+   @param[in] background - Non zero to run the scheduler in a thread
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the client is in
+      concurrent mode, which has its own flusher thread, STATSD_MALLOC if
+      out of memory, STATSD_THREAD if the thread could not be started.
 */
-int ADDCALL statsd_addToBatch(Statsd* statsd, StatsType type, const char* bucket, int value, double sampleRate){
-   //See if we randomly fall under the sample rate
-   if (sampleRate > 0 && sampleRate < 1 && (double)((double)statsd->random() / RAND_MAX) >= sampleRate){
+int ADDCALL statsd_enableScheduler(Statsd* statsd, int maxLatency, int threshold, int background){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   if (statsd->scheduler){
       return STATSD_SUCCESS;
    }
- 
-   char statsString[256];
-   if (!bucket){
-      bucket = statsd->bucket;
+
+   if (statsd->concurrent){
+      return STATSD_BAD_MODE;
    }
 
-   int strLength = buildStatString(statsString, statsd->nameSpace, bucket, type, value, sampleRate);
-   if (strLength < 0){
-      return -strLength;
+   Scheduler* scheduler = (Scheduler*)calloc(1, sizeof(Scheduler));
+   if (!scheduler){
+      return STATSD_MALLOC;
    }
 
-   if (strLength + 1 + statsd->batchIndex < BATCH_MAX_SIZE){
-      strcat(statsd->batch, statsString);
-      strcat(statsd->batch, "\n");
-      statsd->batchIndex += strLength + 1;
+   scheduler->maxLatency = maxLatency > 0 ? maxLatency : SCHEDULER_DEFAULT_LATENCY;
+   scheduler->threshold = threshold > 0 ? threshold : 0;
+   scheduler->batchDeadline = NO_DEADLINE;
+   scheduler->wakeAt = NO_DEADLINE;
+   scheduler->timerFd = -1;
+   for (int i = STATSD_COUNT; i <= STATSD_TIMING; i++){
+      scheduler->intervals[i] = SCHEDULER_DEFAULT_INTERVAL;
    }
-   else {
-      return STATSD_BATCH_FULL;
+
+   pthread_mutexattr_t attributes;
+   pthread_mutexattr_init(&attributes);
+   pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&scheduler->lock, &attributes);
+   pthread_mutexattr_destroy(&attributes);
+   initWaitCond(&scheduler->wake);
+
+   statsd->scheduler = scheduler;
+   if (statsd->aggregator && startWheel(statsd) != STATSD_SUCCESS){
+      statsd_disableScheduler(statsd);
+      return STATSD_MALLOC;
+   }
+
+   //A batch that was started by hand gets a deadline from now
+   if (statsd->batchIndex > 0){
+      scheduler->batchDeadline = monotonicMillis() + scheduler->maxLatency;
+   }
+
+   armScheduler(statsd, nextDeadline(statsd));
+
+   if (background){
+      scheduler->background = 1;
+      scheduler->running = 1;
+      if (pthread_create(&scheduler->thread, NULL, schedulerThread, statsd) != 0){
+         scheduler->background = 0;
+         scheduler->running = 0;
+         statsd_disableScheduler(statsd);
+         return STATSD_THREAD;
+      }
    }
 
    return STATSD_SUCCESS;
+#endif
 }
 
 /**
-   Send the batch message to the server. After a successful send
-   this will reset the batch buffer.
+   Stop the flush scheduler, and its thread if it has one, after flushing
+   everything the client is holding on to. Batches and aggregates are only
+   sent by hand again after this call.
 
    @param[in] statsd - The statsd client object
-   @return STATSD_SUCCESS on success, STATSD_UDP_SEND if the 
-      sendto() function failed.
+   @return STATSD_SUCCESS on success, or the error from the final flush.
 */
-int ADDCALL statsd_sendBatch(Statsd* statsd){
-   if (statsd->batchIndex <= 0){
-      return STATSD_NO_BATCH;
+int ADDCALL statsd_disableScheduler(Statsd* statsd){
+#if defined (_WIN32)
+   return STATSD_SUCCESS;
+#else
+   Scheduler* scheduler = statsd->scheduler;
+   if (!scheduler){
+      return STATSD_SUCCESS;
    }
 
-   int sent = sendto(statsd->socketFd, statsd->batch, statsd->batchIndex, 0, (const struct sockaddr*)&statsd->destination, sizeof(struct sockaddr_in));
+   if (scheduler->background){
+      pthread_mutex_lock(&scheduler->lock);
+      scheduler->running = 0;
+      pthread_cond_signal(&scheduler->wake);
+      pthread_mutex_unlock(&scheduler->lock);
+      pthread_join(scheduler->thread, NULL);
+      scheduler->background = 0;
+   }
 
-   if (sent == -1){
-      return STATSD_UDP_SEND;
+   int ret = statsd_flush(statsd);
+
+   if (statsd->aggregator){
+      free(statsd->aggregator->wheel);
+      statsd->aggregator->wheel = NULL;
    }
-   
-   statsd_resetBatch(statsd);
+
+   if (scheduler->timerFd >= 0){
+      close(scheduler->timerFd);
+   }
+
+   for (int i = 0; i < scheduler->overrideCount; i++){
+      free(scheduler->overrides[i].bucket);
+   }
+
+   free(scheduler->overrides);
+   pthread_mutex_destroy(&scheduler->lock);
+   pthread_cond_destroy(&scheduler->wake);
+   free(scheduler);
+   statsd->scheduler = NULL;
+   return ret;
+#endif
+}
+
+/**
+   Set how often the flush scheduler flushes the aggregates of a type, for
+   example gauges every 10 seconds and counts every second. A bucket that
+   is waiting to be flushed keeps its current due time, the new interval
+   applies from its next flush on.
+
+   @param[in] statsd - The statsd client object
+   @param[in] type - STATSD_COUNT, STATSD_GAUGE, STATSD_SET or
+      STATSD_TIMING, or STATSD_NONE for all of them
+   @param[in] interval - The flush interval in milliseconds, or 0 for the
+      default of 1 second. It is rounded up to at least one 10ms tick.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the scheduler is
+      not enabled, STATSD_BAD_STATS_TYPE if the type can not be aggregated.
+*/
+int ADDCALL statsd_setFlushInterval(Statsd* statsd, StatsType type, int interval){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   Scheduler* scheduler = statsd->scheduler;
+   if (!scheduler){
+      return STATSD_BAD_MODE;
+   }
+
+   if (type < STATSD_NONE || type > STATSD_TIMING){
+      return STATSD_BAD_STATS_TYPE;
+   }
+
+   if (interval <= 0){
+      interval = SCHEDULER_DEFAULT_INTERVAL;
+   }
+   if (interval < WHEEL_TICK){
+      interval = WHEEL_TICK;
+   }
+
+   lockClient(statsd);
+   for (int i = STATSD_COUNT; i <= STATSD_TIMING; i++){
+      if (type == STATSD_NONE || type == (StatsType)i){
+         scheduler->intervals[i] = interval;
+      }
+   }
+
+   //Every bucket looks its interval up again on its next update
+   Aggregator* aggregator = statsd->aggregator;
+   for (int i = 0; aggregator && i < aggregator->capacity; i++){
+      aggregator->entries[i].interval = 0;
+   }
+   unlockClient(statsd);
+
+   return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Give one bucket a flush interval of its own, overriding the interval of
+   its type. It applies to the bucket whatever its tags, from its next
+   flush on.
+
+   @param[in] statsd - The statsd client object
+   @param[in] bucket - The bucket name, without the namespace. It is copied.
+   @param[in] type - The type of the bucket, or STATSD_NONE for any type
+   @param[in] interval - The flush interval in milliseconds, or 0 to go
+      back to the interval of the type. It is rounded up to at least one
+      10ms tick.
+
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the scheduler is
+      not enabled, STATSD_BAD_BUCKET if there is no bucket,
+      STATSD_BAD_STATS_TYPE if the type can not be aggregated,
+      STATSD_MALLOC if out of memory.
+*/
+int ADDCALL statsd_setBucketInterval(Statsd* statsd, const char* bucket, StatsType type, int interval){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   Scheduler* scheduler = statsd->scheduler;
+   if (!scheduler){
+      return STATSD_BAD_MODE;
+   }
+
+   if (!bucket){
+      return STATSD_BAD_BUCKET;
+   }
+
+   if (type < STATSD_NONE || type > STATSD_TIMING){
+      return STATSD_BAD_STATS_TYPE;
+   }
+
+   if (interval > 0 && interval < WHEEL_TICK){
+      interval = WHEEL_TICK;
+   }
+
+   lockClient(statsd);
+   int found = 0;
+   for (int i = 0; i < scheduler->overrideCount; i++){
+      BucketInterval* override = &scheduler->overrides[i];
+      if (override->type != type || strcmp(override->bucket, bucket) != 0){
+         continue;
+      }
+
+      if (interval > 0){
+         override->interval = interval;
+      }
+      else {
+         free(override->bucket);
+         *override = scheduler->overrides[--scheduler->overrideCount];
+      }
+
+      found = 1;
+      break;
+   }
+
+   if (!found && interval > 0){
+      size_t length = strlen(bucket) + 1;
+      char* copy = (char*)malloc(length);
+      BucketInterval* overrides = copy ? (BucketInterval*)realloc(scheduler->overrides, (scheduler->overrideCount + 1) * sizeof(BucketInterval)) : NULL;
+      if (!overrides){
+         free(copy);
+         unlockClient(statsd);
+         return STATSD_MALLOC;
+      }
+
+      memcpy(copy, bucket, length);
+      overrides[scheduler->overrideCount].bucket = copy;
+      overrides[scheduler->overrideCount].type = type;
+      overrides[scheduler->overrideCount].interval = interval;
+      scheduler->overrides = overrides;
+      scheduler->overrideCount++;
+   }
+
+   Aggregator* aggregator = statsd->aggregator;
+   for (int i = 0; aggregator && i < aggregator->capacity; i++){
+      Aggregate* entry = &aggregator->entries[i];
+      if (entry->bucket && strcmp(entry->bucket, bucket) == 0){
+         entry->interval = 0;
+      }
+   }
+   unlockClient(statsd);
+
    return STATSD_SUCCESS;
+#endif
+}
+
+/**
+   Get a file descriptor that becomes readable whenever the flush scheduler
+   has something due, for an event loop to wait on with poll(), select() or
+   epoll. It is a timerfd that the client keeps set to the next deadline,
+   and it is closed by statsd_disableScheduler(). When it is readable, call
+   statsd_runScheduler().
+
+   @param[in] statsd - The statsd client object
+   @return The file descriptor, or -1 if the scheduler is not enabled or
+      the platform has no timerfd, in which case use
+      statsd_getSchedulerTimeout().
+*/
+int ADDCALL statsd_getSchedulerFd(Statsd* statsd){
+#if defined (__linux__)
+   Scheduler* scheduler = statsd->scheduler;
+   if (!scheduler){
+      return -1;
+   }
+
+   if (scheduler->timerFd < 0){
+      scheduler->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (scheduler->timerFd >= 0){
+         armScheduler(statsd, scheduler->wakeAt);
+      }
+   }
+
+   return scheduler->timerFd;
+#else
+   return -1;
+#endif
+}
+
+/**
+   Get how long an event loop can wait before it has to call
+   statsd_runScheduler(). Adding a stat can bring the deadline closer, so
+   ask again after recording stats.
+
+   @param[in] statsd - The statsd client object
+   @return The timeout in milliseconds, 0 if something is already due, or
+      -1 if nothing is waiting to be sent or the scheduler is not enabled.
+*/
+int ADDCALL statsd_getSchedulerTimeout(Statsd* statsd){
+#if defined (_WIN32)
+   return -1;
+#else
+   if (!statsd->scheduler){
+      return -1;
+   }
+
+   lockClient(statsd);
+   uint64_t deadline = nextDeadline(statsd);
+   unlockClient(statsd);
+
+   if (deadline == NO_DEADLINE){
+      return -1;
+   }
+
+   uint64_t now = monotonicMillis();
+   if (deadline <= now){
+      return 0;
+   }
+
+   return deadline - now > INT32_MAX ? INT32_MAX : (int)(deadline - now);
+#endif
 }
 
+/**
+   Send the batch if its deadline has passed, and flush the aggregated
+   buckets that are due. An event loop calls this when the scheduler's fd
+   is readable or its timeout has passed. Calling it early does no harm.
+
+   @param[in] statsd - The statsd client object
+   @return STATSD_SUCCESS on success, STATSD_BAD_MODE if the scheduler is
+      not enabled, or the first error from building or sending.
+*/
+int ADDCALL statsd_runScheduler(Statsd* statsd){
+#if defined (_WIN32)
+   return STATSD_BAD_MODE;
+#else
+   Scheduler* scheduler = statsd->scheduler;
+   if (!scheduler){
+      return STATSD_BAD_MODE;
+   }
+
+   lockClient(statsd);
+
+   //Reading the timer clears it until it is set again
+   if (scheduler->timerFd >= 0){
+      uint64_t expirations;
+      if (read(scheduler->timerFd, &expirations, sizeof(expirations)) < 0){
+         expirations = 0;
+      }
+   }
+
+   int ret = runDue(statsd, monotonicMillis());
+   unlockClient(statsd);
+   return ret;
+#endif
+}
@@ -23,6 +23,8 @@ OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef LIB_STATS_D_H
 #define LIB_STATS_D_H
 
+#include <stdint.h>
+
 #define ADDAPI
 #define ADDCALL
 
@@ -58,6 +60,87 @@ OR OTHER DEALINGS IN THE SOFTWARE.
 #define BATCH_MAX_SIZE 512
 #endif
 
+//Common packet sizes for statsd_setPacketSize()
+#define STATSD_ETHERNET_PACKET_SIZE 1432
+#define STATSD_JUMBO_PACKET_SIZE 8932
+#define STATSD_LOOPBACK_PACKET_SIZE 65507
+#define STATSD_MIN_PACKET_SIZE 64
+#define STATSD_MAX_PACKET_SIZE 65507
+#define STATSD_UNIX_MAX_PACKET_SIZE 131072
+
+//Servers starting with this prefix are unix domain socket paths,
+//as in "unix:///var/run/statsd.sock"
+#define STATSD_UNIX_PREFIX "unix://"
+
+//Servers starting with this prefix are reached over TCP, as in
+//"tcp://statsd.example.com"
+#define STATSD_TCP_PREFIX "tcp://"
+
+//Servers starting with this prefix are shared memory rings in /dev/shm,
+//emptied by statsd-drain, as in "shm://statsd"
+#define STATSD_SHM_PREFIX "shm://"
+
+struct _statsd_aggregator_t;
+struct _statsd_concurrent_t;
+struct _statsd_stream_t;
+struct _statsd_shm_t;
+struct _statsd_uring_t;
+struct _statsd_scheduler_t;
+struct _statsd_spill_t;
+struct _statsd_shards_t;
+struct _statsd_self_report_t;
+
+//The number of buckets in the send latency histogram. Bucket 0 counts
+//calls under 1us, bucket i calls of [2^(i-1), 2^i) microseconds, and the
+//last bucket everything from 2^14us (about 16ms) up.
+#define STATSD_LATENCY_BUCKETS 16
+
+//Where the client reports on itself unless told otherwise
+#define STATSD_INTERNAL_NAMESPACE "statsd.client"
+
+typedef struct _statsd_internal_stats_t {
+   uint64_t sampledOut;
+   uint64_t serialized;
+   uint64_t batched;
+   uint64_t sent;
+   uint64_t packets;
+   uint64_t bytes;
+   uint64_t calls;
+   uint64_t failedCalls;
+   uint64_t dropped;
+   uint64_t droppedBytes;
+   uint64_t batches;
+   uint64_t batchBytes;
+   double batchFill;
+   uint64_t sendLatency[STATSD_LATENCY_BUCKETS];
+} StatsdInternalStats;
+
+typedef enum {
+   STATSD_SAMPLE_RANDOM = 0,
+   STATSD_SAMPLE_KEYED
+} StatsdSampling;
+
+typedef enum {
+   STATSD_OVERFLOW_DROP_NEWEST = 0,
+   STATSD_OVERFLOW_DROP_OLDEST
+} StatsdOverflow;
+
+typedef enum {
+   STATSD_BACKPRESSURE_DROP = 0,
+   STATSD_BACKPRESSURE_SPILL,
+   STATSD_BACKPRESSURE_BLOCK
+} StatsdBackpressure;
+
+typedef enum {
+   STATSD_CLOCK_MONOTONIC = 0,
+   STATSD_CLOCK_TSC
+} StatsdClock;
+
+typedef struct _statsd_tags_t {
+   const char* data;
+   int length;
+} StatsdTags;
+
 typedef struct _statsd_t {
    const char* serverAddress;
    char ipAddress[128];
@@ -65,12 +148,38 @@ typedef struct _statsd_t {
    const char* bucket;
    int port;
    int socketFd;
-   struct sockaddr_in destination;
+   struct sockaddr_storage destination;
+   socklen_t destinationLength;
    
    int (*random)(void);
+   StatsdSampling sampling;
 
-   char batch[BATCH_MAX_SIZE];
+   char* batch;
    int batchIndex;
+   int packetSize;
+
+   struct _statsd_aggregator_t* aggregator;
+   struct _statsd_concurrent_t* concurrent;
+   struct _statsd_stream_t* stream;
+   struct _statsd_shm_t* shm;
+   struct _statsd_uring_t* uring;
+   struct _statsd_scheduler_t* scheduler;
+
+   StatsdBackpressure backpressure;
+   int blockTimeout;
+   struct _statsd_spill_t* spill;
+   uint64_t droppedMetrics;
+   uint64_t droppedBytes;
+
+   struct _statsd_shards_t* shards;
+   int shardIndex;
+
+   StatsdInternalStats counters;
+   int timeSends;
+   struct _statsd_self_report_t* selfReport;
+
+   StatsdClock clock;
+   StatsdTags* tags;
 } Statsd;
 
 typedef enum {
@@ -82,6 +191,41 @@ typedef enum {
    STATSD_BATCH
 } StatsType;
 
+typedef struct _statsd_metric_t {
+   Statsd* statsd;
+   StatsType type;
+   double sampleRate;
+   uint64_t sampleThreshold;
+   const char* bucket;
+   uint64_t bucketHash;
+
+   const char* prefix;
+   int prefixLength;
+   const char* suffix;
+   int suffixLength;
+   StatsdTags* tags;
+} StatsdMetric;
+
+typedef struct _statsd_timer_t {
+   Statsd* statsd;
+   const char* bucket;
+   double sampleRate;
+   const StatsdTags* tags;
+   uint64_t start;
+} StatsdTimer;
+
+typedef struct _statsd_drain_t StatsdDrain;
+
+typedef struct _statsd_send_report_t {
+   int packets;
+   int sent;
+   int calls;
+   int firstError;
+
+   char* status;
+   int statusSize;
+} StatsdSendReport;
+
 typedef enum {
    STATSD_SUCCESS = 0,
    STATSD_BAD_BUCKET,
@@ -94,7 +238,13 @@ typedef enum {
    STATSD_BATCH_IN_PROGRESS,
    STATSD_NO_BATCH,
    STATSD_BATCH_FULL,
-   STATSD_BAD_STATS_TYPE
+   STATSD_BAD_STATS_TYPE,
+   STATSD_THREAD,
+   STATSD_BAD_MODE,
+   STATSD_BAD_PACKET_SIZE,
+   STATSD_DROPPED,
+   STATSD_BAD_VALUE,
+   STATSD_BAD_TAG
 } StatsError;
 
 #ifdef __cplusplus
@@ -111,9 +261,71 @@ ADDAPI int ADDCALL statsd_count(Statsd* statsd, const char* bucket, int count, d
 ADDAPI int ADDCALL statsd_gauge(Statsd* statsd, const char* bucket, int value, double sampleRate);
 ADDAPI int ADDCALL statsd_set(Statsd* statsd, const char* bucket, int value, double sampleRate);
 ADDAPI int ADDCALL statsd_timing(Statsd* statsd, const char* bucket, int timing, double sampleRate);
+ADDAPI int ADDCALL statsd_count64(Statsd* statsd, const char* bucket, int64_t count, double sampleRate);
+ADDAPI int ADDCALL statsd_gauge64(Statsd* statsd, const char* bucket, int64_t value, double sampleRate);
+ADDAPI int ADDCALL statsd_set64(Statsd* statsd, const char* bucket, int64_t value, double sampleRate);
+ADDAPI int ADDCALL statsd_timing64(Statsd* statsd, const char* bucket, int64_t timing, double sampleRate);
+ADDAPI int ADDCALL statsd_countDouble(Statsd* statsd, const char* bucket, double count, double sampleRate);
+ADDAPI int ADDCALL statsd_gaugeDouble(Statsd* statsd, const char* bucket, double value, double sampleRate);
+ADDAPI int ADDCALL statsd_timingDouble(Statsd* statsd, const char* bucket, double timing, double sampleRate);
 ADDAPI int ADDCALL statsd_resetBatch(Statsd* statsd);
 ADDAPI int ADDCALL statsd_addToBatch(Statsd* statsd, StatsType type, const char* bucket, int value, double sampleRate);
+ADDAPI int ADDCALL statsd_addToBatch64(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate);
+ADDAPI int ADDCALL statsd_addToBatchDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate);
 ADDAPI int ADDCALL statsd_sendBatch(Statsd* statsd);
+ADDAPI int ADDCALL statsd_setPacketSize(Statsd* statsd, int packetSize);
+ADDAPI int ADDCALL statsd_enableAggregation(Statsd* statsd, int capacity);
+ADDAPI int ADDCALL statsd_disableAggregation(Statsd* statsd);
+ADDAPI int ADDCALL statsd_flush(Statsd* statsd);
+ADDAPI int ADDCALL statsd_enableTimingAggregation(Statsd* statsd, const double* percentiles, int count, int samples);
+ADDAPI int ADDCALL statsd_enableSetCardinality(Statsd* statsd, int threshold);
+ADDAPI int ADDCALL statsd_setSampling(Statsd* statsd, StatsdSampling mode);
+ADDAPI void ADDCALL statsd_setSampleKey(const char* key);
+ADDAPI int ADDCALL statsd_enableConcurrency(Statsd* statsd, int flushInterval);
+ADDAPI int ADDCALL statsd_disableConcurrency(Statsd* statsd);
+ADDAPI int ADDCALL statsd_sendLines(Statsd* statsd, const char* lines, int length, StatsdSendReport* report);
+ADDAPI int ADDCALL statsd_registerMetric(Statsd* statsd, StatsdMetric** metric, const char* bucket, StatsType type, double sampleRate);
+ADDAPI void ADDCALL statsd_freeMetric(StatsdMetric* metric);
+ADDAPI int ADDCALL statsd_sendMetric(StatsdMetric* metric, int value);
+ADDAPI int ADDCALL statsd_addMetricToBatch(StatsdMetric* metric, int value);
+ADDAPI int ADDCALL statsd_sendMetric64(StatsdMetric* metric, int64_t value);
+ADDAPI int ADDCALL statsd_sendMetricDouble(StatsdMetric* metric, double value);
+ADDAPI int ADDCALL statsd_addMetricToBatch64(StatsdMetric* metric, int64_t value);
+ADDAPI int ADDCALL statsd_addMetricToBatchDouble(StatsdMetric* metric, double value);
+ADDAPI int ADDCALL statsd_setStreamBuffer(Statsd* statsd, int size, StatsdOverflow overflow);
+ADDAPI int ADDCALL statsd_setBackpressure(Statsd* statsd, StatsdBackpressure policy, int limit);
+ADDAPI int ADDCALL statsd_setSendBuffer(Statsd* statsd, int size);
+ADDAPI void ADDCALL statsd_getDropped(Statsd* statsd, uint64_t* metrics, uint64_t* bytes);
+ADDAPI int ADDCALL statsd_addServer(Statsd* statsd, const char* server, int port);
+ADDAPI void ADDCALL statsd_getInternalStats(Statsd* statsd, StatsdInternalStats* stats);
+ADDAPI int ADDCALL statsd_enableSendTiming(Statsd* statsd, int enable);
+ADDAPI int ADDCALL statsd_enableSelfReport(Statsd* statsd, const char* nameSpace);
+ADDAPI int ADDCALL statsd_disableSelfReport(Statsd* statsd);
+ADDAPI int ADDCALL statsd_setClock(Statsd* statsd, StatsdClock clock);
+ADDAPI void ADDCALL statsd_timerStart(Statsd* statsd, StatsdTimer* timer, const char* bucket, double sampleRate);
+ADDAPI int ADDCALL statsd_timerStop(StatsdTimer* timer);
+ADDAPI int ADDCALL statsd_newTags(StatsdTags** tags, const char** pairs, int count);
+ADDAPI void ADDCALL statsd_freeTags(StatsdTags* tags);
+ADDAPI int ADDCALL statsd_setTags(Statsd* statsd, const char** pairs, int count);
+ADDAPI int ADDCALL statsd_sendTagged(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate, const StatsdTags* tags);
+ADDAPI int ADDCALL statsd_sendTaggedDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate, const StatsdTags* tags);
+ADDAPI int ADDCALL statsd_addToBatchTagged(Statsd* statsd, StatsType type, const char* bucket, int64_t value, double sampleRate, const StatsdTags* tags);
+ADDAPI int ADDCALL statsd_addToBatchTaggedDouble(Statsd* statsd, StatsType type, const char* bucket, double value, double sampleRate, const StatsdTags* tags);
+ADDAPI int ADDCALL statsd_registerTaggedMetric(Statsd* statsd, StatsdMetric** metric, const char* bucket, StatsType type, double sampleRate, const StatsdTags* tags);
+ADDAPI void ADDCALL statsd_timerStartTagged(Statsd* statsd, StatsdTimer* timer, const char* bucket, double sampleRate, const StatsdTags* tags);
+ADDAPI int ADDCALL statsd_openDrain(StatsdDrain** drain, const char* name, int size);
+ADDAPI void ADDCALL statsd_closeDrain(StatsdDrain* drain);
+ADDAPI int ADDCALL statsd_drain(StatsdDrain* drain, Statsd* statsd, int* records);
+ADDAPI void ADDCALL statsd_getRingDropped(StatsdDrain* drain, uint64_t* metrics, uint64_t* bytes);
+ADDAPI int ADDCALL statsd_enableUring(Statsd* statsd, int depth);
+ADDAPI int ADDCALL statsd_disableUring(Statsd* statsd);
+ADDAPI int ADDCALL statsd_enableScheduler(Statsd* statsd, int maxLatency, int threshold, int background);
+ADDAPI int ADDCALL statsd_disableScheduler(Statsd* statsd);
+ADDAPI int ADDCALL statsd_setFlushInterval(Statsd* statsd, StatsType type, int interval);
+ADDAPI int ADDCALL statsd_setBucketInterval(Statsd* statsd, const char* bucket, StatsType type, int interval);
+ADDAPI int ADDCALL statsd_getSchedulerFd(Statsd* statsd);
+ADDAPI int ADDCALL statsd_getSchedulerTimeout(Statsd* statsd);
+ADDAPI int ADDCALL statsd_runScheduler(Statsd* statsd);
 
 #ifdef __cplusplus
 }